@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define __PROGTEST__
+#include "bigint.cpp"
+
+// times the multiplication algorithms of mac3 and the squaring algorithms
+// of sqr against each other on random operands of the same size, to find
+// the thresholds where mac3 and sqr should switch between them, each
+// algorithm only does the top level of the product and recurses through
+// mac3 or sqr
+//
+// usage: bench [--min N] [--max N]
+// prints a single JSON object to stdout, sizes are in digits
+
+using Clock = std::chrono::steady_clock;
+
+struct Algorithm {
+    const char* name;
+    void (*mac)(Digits, ConstDigits, ConstDigits, ScratchArena&);
+    // smallest operand it can split
+    size_t min_size;
+    // largest operand it is timed on, the others take too long
+    size_t max_size = SIZE_MAX;
+    // computes the square of x and ignores y
+    bool squares = false;
+};
+
+// times a squaring algorithm on x alone
+template<void (*SQR)(Digits, ConstDigits, ScratchArena&)>
+void square_x(Digits out, ConstDigits x, ConstDigits, ScratchArena& arena) {
+    SQR(out, x, arena);
+}
+
+const Algorithm ALGORITHMS[] = {
+    {
+        "schoolbook",
+        [](Digits out, ConstDigits x, ConstDigits y, ScratchArena&) {
+            mac_schoolbook(out, x, y);
+        },
+        1,
+        4096,
+    },
+    {"karatsuba", mac_karatsuba, 2},
+    {"toom3", mac_toom3, 3},
+    {"toom4", mac_toom4, 4},
+#ifdef DIGIT64
+    {"ntt", mac_ntt, 1},
+#endif
+    {"mac3", mac3, 1},
+    {
+        "sqr_schoolbook",
+        [](Digits out, ConstDigits x, ConstDigits, ScratchArena&) {
+            sqr_schoolbook(out, x);
+        },
+        1,
+        4096,
+        true,
+    },
+    {"sqr_karatsuba", square_x<sqr_karatsuba>, 2, SIZE_MAX, true},
+    {"sqr_toom3", square_x<sqr_toom3>, 3, SIZE_MAX, true},
+    {"sqr_toom4", square_x<sqr_toom4>, 4, SIZE_MAX, true},
+#ifdef DIGIT64
+    {
+        "sqr_ntt",
+        [](Digits out, ConstDigits x, ConstDigits, ScratchArena& arena) {
+            mac_ntt(out, x, x, arena);
+        },
+        1,
+        SIZE_MAX,
+        true,
+    },
+#endif
+    {"sqr", square_x<sqr>, 1, SIZE_MAX, true},
+};
+
+// the NTT takes up to 10 (x + y) digits at the top, the other algorithms
+// less for themselves and what mac3 takes below them
+size_t scratch_size(ConstDigits x, ConstDigits y) {
+    return 10 * (x.size() + y.size()) + mac3_scratch_size(x.size(), y.size());
+}
+
+// the product of x and y by the algorithm, checked against the schoolbook
+// product before the algorithm is timed, a broken algorithm would be timed
+// as fine otherwise
+OwnedDigits product(const Algorithm& algorithm, ConstDigits x, ConstDigits y) {
+    OwnedDigits out(x.size() + y.size());
+    ScratchArena arena(scratch_size(x, y));
+    algorithm.mac(out, x, y, arena);
+    return out;
+}
+
+// seconds per product, the best of five batches of at least 10 ms each so
+// that other work on the machine doesn't move the crossovers
+double measure(const Algorithm& algorithm, ConstDigits x, ConstDigits y) {
+    OwnedDigits out(x.size() + y.size());
+    ScratchArena arena(scratch_size(x, y));
+    double best = INFINITY;
+    for (int batch = 0; batch < 5; batch++) {
+        size_t runs = 0;
+        auto start = Clock::now();
+        std::chrono::duration<double> elapsed {};
+        do {
+            std::fill(out.begin(), out.end(), 0);
+            algorithm.mac(out, x, y, arena);
+            runs++;
+            elapsed = Clock::now() - start;
+        } while (elapsed.count() < 0.01);
+        best = std::min(best, elapsed.count() / runs);
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    size_t min_size = 16;
+    size_t max_size = 16384;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--min" && i + 1 < argc) {
+            min_size = std::stoul(argv[++i]);
+        } else if (arg == "--max" && i + 1 < argc) {
+            max_size = std::stoul(argv[++i]);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--min N] [--max N]"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::mt19937_64 random(42);
+    std::cout << "{\n  \"digit_bits\": " << DIGIT_BITS
+              << ",\n  \"thresholds\": {\"karatsuba\": " << KARATSUBA_THRESHOLD
+              << ", \"toom3\": " << TOOM3_THRESHOLD
+              << ", \"toom4\": " << TOOM4_THRESHOLD;
+#ifdef DIGIT64
+    std::cout << ", \"ntt\": " << NTT_THRESHOLD;
+#endif
+    std::cout << ", \"sqr_karatsuba\": " << SQR_KARATSUBA_THRESHOLD
+              << ", \"sqr_toom3\": " << SQR_TOOM3_THRESHOLD
+              << ", \"sqr_toom4\": " << SQR_TOOM4_THRESHOLD;
+#ifdef DIGIT64
+    std::cout << ", \"sqr_ntt\": " << SQR_NTT_THRESHOLD;
+#endif
+    std::cout << "},\n  \"sizes\": [";
+
+    // about eight sizes per doubling
+    for (size_t size = min_size; size <= max_size;
+         size += std::max<size_t>(size / 8, 1)) {
+        OwnedDigits x(size);
+        OwnedDigits y(size);
+        for (size_t i = 0; i < size; i++) {
+            x[i] = (Digit)random();
+            y[i] = (Digit)random();
+        }
+
+        OwnedDigits expected_product(2 * size);
+        mac_schoolbook(expected_product, x, y);
+        OwnedDigits expected_square(2 * size);
+        sqr_schoolbook(expected_square, x);
+        for (const Algorithm& algorithm : ALGORITHMS) {
+            if (size < algorithm.min_size || size > algorithm.max_size) {
+                continue;
+            }
+            const OwnedDigits& expected =
+                algorithm.squares ? expected_square : expected_product;
+            if (product(algorithm, x, y) != expected) {
+                std::cerr << algorithm.name << " disagrees with schoolbook on "
+                          << size << " digits" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        std::cout << (size == min_size ? "\n" : ",\n") << "    {\"digits\": "
+                  << size;
+        for (const Algorithm& algorithm : ALGORITHMS) {
+            if (size < algorithm.min_size || size > algorithm.max_size) {
+                continue;
+            }
+            std::cout << ", \"" << algorithm.name
+                      << "\": " << measure(algorithm, x, y);
+        }
+        std::cout << "}" << std::flush;
+    }
+    std::cout << "\n  ]\n}\n";
+
+    return EXIT_SUCCESS;
+}
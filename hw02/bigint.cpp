@@ -5,6 +5,7 @@
     #include <climits>
     #include <cmath>
     #include <compare>
+    #include <cstddef>
     #include <cstdint>
     #include <cstdio>
     #include <cstdlib>
@@ -182,35 +183,11 @@ struct ConstSlice {
     }
 };
 
-template<typename T, const size_t L>
-class StackSliceAllocator {
-    size_t offset = 0;
-    T storage[L] = {};
-
-  public:
-    Slice<T> allocate(size_t size) {
-        if (offset + size > L) {
-            T* ptr = new T[size]();
-            return Slice(ptr, size);
-        } else {
-            size_t old = offset;
-            offset += size;
-            return Slice(this->storage + old, size);
-        }
-    }
-
-    void free(Slice<T> slice) {
-        T* start = this->storage;
-        T* end = start + L;
-        if (start <= slice.start && slice.start < end) {
-            // do nothing
-        } else {
-            delete[] slice.start;
-        }
-    }
-};
-
-// #define DIGIT64
+// digits are 64 bit wherever the compiler has a 128 bit type for their
+// products, define DIGIT32 to get 32 bit digits everywhere
+#if defined(__SIZEOF_INT128__) && !defined(DIGIT32)
+    #define DIGIT64
+#endif
 
 #ifdef DIGIT64
 using Digit = uint64_t;
@@ -222,6 +199,22 @@ using DoubleDigit = uint64_t;
 
 constexpr Digit DIGIT_BITS = sizeof(Digit) * 8;
 
+// decimal strings are converted in chunks of the largest power of ten that
+// fits into a digit
+#ifdef DIGIT64
+constexpr Digit DECIMAL_CHUNK_DIGITS = 19;
+constexpr Digit DECIMAL_CHUNK_BASE = 10'000'000'000'000'000'000ull;
+#else
+constexpr Digit DECIMAL_CHUNK_DIGITS = 9;
+constexpr Digit DECIMAL_CHUNK_BASE = 1'000'000'000;
+#endif
+
+// with 64 bit digits on x86-64 the loops over digits are written in assembly,
+// compilers don't keep a carry in the carry flag across loop iterations
+#if defined(DIGIT64) && defined(__x86_64__)
+    #define DIGIT_ASM
+#endif
+
 using Digits = Slice<Digit>;
 using ConstDigits = ConstSlice<Digit>;
 using OwnedDigits = std::vector<Digit>;
@@ -279,6 +272,53 @@ inline Digit mul_carry_u32(Digit a, Digit b, Digit* acc) {
     return double_low(d);
 }
 
+#ifdef DIGIT_ASM
+// a[0..len) += b[0..len), return carry, len > 0
+//
+// the index runs from -len up to 0 so that inc, which keeps the carry flag,
+// both advances and ends the loop
+inline Digit add_n(Digit* a, const Digit* b, size_t len) {
+    ptrdiff_t i = -(ptrdiff_t)len;
+    Digit digit;
+    Digit carry;
+    asm volatile(
+        "clc\n"
+        "1:\n\t"
+        "movq (%[b],%[i],8), %[digit]\n\t"
+        "adcq %[digit], (%[a],%[i],8)\n\t"
+        "incq %[i]\n\t"
+        "jnz 1b\n\t"
+        "setc %b[carry]\n\t"
+        "movzbq %b[carry], %[carry]"
+        : [i] "+r"(i), [digit] "=&r"(digit), [carry] "=r"(carry)
+        : [a] "r"(a + len), [b] "r"(b + len)
+        : "cc", "memory"
+    );
+    return carry;
+}
+
+// a[0..len) -= b[0..len), return borrow, len > 0
+inline Digit sub_n(Digit* a, const Digit* b, size_t len) {
+    ptrdiff_t i = -(ptrdiff_t)len;
+    Digit digit;
+    Digit borrow;
+    asm volatile(
+        "clc\n"
+        "1:\n\t"
+        "movq (%[b],%[i],8), %[digit]\n\t"
+        "sbbq %[digit], (%[a],%[i],8)\n\t"
+        "incq %[i]\n\t"
+        "jnz 1b\n\t"
+        "setc %b[borrow]\n\t"
+        "movzbq %b[borrow], %[borrow]"
+        : [i] "+r"(i), [digit] "=&r"(digit), [borrow] "=r"(borrow)
+        : [a] "r"(a + len), [b] "r"(b + len)
+        : "cc", "memory"
+    );
+    return borrow;
+}
+#endif
+
 // a += b, return carry
 Digit add2(Digits a, ConstDigits b) {
     size_t a_len = a.size();
@@ -288,6 +328,12 @@ Digit add2(Digits a, ConstDigits b) {
     Digit carry = 0;
     size_t i = 0;
 
+#ifdef DIGIT_ASM
+    if (b_len > 0) {
+        carry = add_n(a.begin(), b.begin(), b_len);
+        i = b_len;
+    }
+#endif
     for (; i < b_len; i++) {
         a[i] = add_carry(a[i], b[i], &carry);
     }
@@ -307,6 +353,12 @@ Digit sub2(Digits a, ConstDigits b) {
     Digit carry = 0;
     size_t i = 0;
 
+#ifdef DIGIT_ASM
+    if (len > 0) {
+        carry = sub_n(a.begin(), b.begin(), len);
+        i = len;
+    }
+#endif
     for (; i < len; i++) {
         a[i] = sub_carry(a[i], b[i], &carry);
     }
@@ -367,6 +419,84 @@ Digit mul_digit(Digits a, Digit b) {
     return carry;
 }
 
+// a[0..len) += b[0..len) * c, return the digit carried out
+Digit mac_kernel(Digit* a, const Digit* b, size_t len, Digit c) {
+    Digit carry = 0;
+    for (size_t i = 0; i < len; i++) {
+        a[i] = mac_carry(a[i], b[i], c, &carry);
+    }
+    return carry;
+}
+
+#ifdef DIGIT_ASM
+// mac_kernel for CPUs with BMI2 and ADX
+//
+// mulx multiplies without touching flags, so the high half of the previous
+// product is added through the overflow flag (adox) while a[i] is added
+// through the carry flag (adcx), the loop is counted by lea and jrcxz which
+// keep both flags, the products alternate between two registers to save
+// moves and the loop is unrolled four times
+Digit mac_kernel_adx(Digit* a, const Digit* b, size_t len, Digit c) {
+    // the digits that don't fill a whole iteration go first
+    size_t head = len % 4;
+    Digit high = mac_kernel(a, b, head, c);
+    if (head == len) {
+        return high;
+    }
+
+    ptrdiff_t i = -(ptrdiff_t)(len - head);
+    Digit low;
+    Digit other_high;
+    asm volatile(
+        "xorl %k[low], %k[low]\n"
+        "1:\n\t"
+        "mulxq (%[b],%[i],8), %[low], %[other_high]\n\t"
+        "adoxq %[high], %[low]\n\t"
+        "adcxq (%[a],%[i],8), %[low]\n\t"
+        "movq %[low], (%[a],%[i],8)\n\t"
+        "mulxq 8(%[b],%[i],8), %[low], %[high]\n\t"
+        "adoxq %[other_high], %[low]\n\t"
+        "adcxq 8(%[a],%[i],8), %[low]\n\t"
+        "movq %[low], 8(%[a],%[i],8)\n\t"
+        "mulxq 16(%[b],%[i],8), %[low], %[other_high]\n\t"
+        "adoxq %[high], %[low]\n\t"
+        "adcxq 16(%[a],%[i],8), %[low]\n\t"
+        "movq %[low], 16(%[a],%[i],8)\n\t"
+        "mulxq 24(%[b],%[i],8), %[low], %[high]\n\t"
+        "adoxq %[other_high], %[low]\n\t"
+        "adcxq 24(%[a],%[i],8), %[low]\n\t"
+        "movq %[low], 24(%[a],%[i],8)\n\t"
+        "leaq 4(%[i]), %[i]\n\t"
+        "jrcxz 2f\n\t"
+        "jmp 1b\n"
+        "2:\n\t"
+        "movl $0, %k[low]\n\t"
+        "adoxq %[low], %[high]\n\t"
+        "adcxq %[low], %[high]"
+        : [i] "+c"(i),
+          [high] "+r"(high),
+          [low] "=&r"(low),
+          [other_high] "=&r"(other_high)
+        : [a] "r"(a + len), [b] "r"(b + len), "d"(c)
+        : "cc", "memory"
+    );
+    return high;
+}
+
+using MacKernel = Digit (*)(Digit*, const Digit*, size_t, Digit);
+
+MacKernel select_mac_kernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2") && __builtin_cpu_supports("adx")) {
+        return mac_kernel_adx;
+    }
+    return mac_kernel;
+}
+
+// chosen once for the CPU the program runs on
+const MacKernel MAC_KERNEL = select_mac_kernel();
+#endif
+
 // a += b * c
 Digit mac_digit(Digits a, ConstDigits b, Digit c) {
     if (c == 0) {
@@ -376,10 +506,11 @@ Digit mac_digit(Digits a, ConstDigits b, Digit c) {
     assert(a.size() >= b.size());
     size_t b_len = b.size();
 
-    Digit carry = 0;
-    for (size_t i = 0; i < b_len; i++) {
-        a[i] = mac_carry(a[i], b[i], c, &carry);
-    }
+#ifdef DIGIT_ASM
+    Digit carry = MAC_KERNEL(a.begin(), b.begin(), b_len, c);
+#else
+    Digit carry = mac_kernel(a.begin(), b.begin(), b_len, c);
+#endif
 
     if (carry != 0) {
         carry = add_digit(a.start_at(b_len), carry);
@@ -390,6 +521,13 @@ Digit mac_digit(Digits a, ConstDigits b, Digit c) {
 
 // return a / b, *rem = a % b
 inline Digit div_wide(Digit a, Digit b, Digit* rem) {
+#ifdef DIGIT_ASM
+    // *rem < b, so the quotient fits into a digit and div can't fault
+    Digit quotient;
+    asm("divq %[b]" : "=a"(quotient), "+d"(*rem) : "a"(a), [b] "rm"(b));
+    return quotient;
+#endif
+
     DoubleDigit lhs = double_pack(*rem, a);
     DoubleDigit rhs = (DoubleDigit)b;
 
@@ -453,6 +591,7 @@ ConstDigits normalize_slice(ConstDigits digits) {
 }
 
 void mac3(Digits acc, ConstDigits b, ConstDigits c);
+void sqr(Digits out, ConstDigits x);
 
 class CBigInt {
     bool is_negative = false;
@@ -564,8 +703,8 @@ class CBigInt {
             size_t big_digits = std::ceil(bits / DIGIT_BITS);
             this->digits.reserve(big_digits);
 
-            Digit chunk_size = 9;  // 10^9 fits in 2^32, 10^10 does not
-            Digit chunk_base = 1'000'000'000;  // 10^power
+            Digit chunk_size = DECIMAL_CHUNK_DIGITS;
+            Digit chunk_base = DECIMAL_CHUNK_BASE;
 
             size_t head = view.size() % chunk_size;
             Digit digit = parse_digit_decimal(view.begin(), head);
@@ -764,6 +903,10 @@ class CBigInt {
     }
 
     CBigInt operator*(const CBigInt& other) const {
+        if (this == &other) {
+            return square();
+        }
+
         OwnedDigits digits_(this->size() + other.size(), 0);
         mac3(digits_, this->const_slice(), other.const_slice());
 
@@ -774,6 +917,14 @@ class CBigInt {
         *this = *this * other;
     }
 
+    // *this * *this, sqr computes the products of two different digits once
+    CBigInt square() const {
+        OwnedDigits digits_(2 * this->size(), 0);
+        sqr(digits_, this->const_slice());
+
+        return CBigInt(false, digits_);
+    }
+
     void operator*=(Digit other) {
         Digit carry = mul_digit(digits, other);
         if (carry != 0) {
@@ -882,7 +1033,12 @@ class CBigInt {
         if (stream.flags() & std::ios::hex) {
             decoded = big.decode_hex_le("0123456789abcdef");
         } else {
-            decoded = big.decode_le(10, 9, 1'000'000'000, "0123456789");
+            decoded = big.decode_le(
+                10,
+                DECIMAL_CHUNK_DIGITS,
+                DECIMAL_CHUNK_BASE,
+                "0123456789"
+            );
         }
         std::reverse(decoded.begin(), decoded.end());
 
@@ -1039,106 +1195,1148 @@ class CBigInt {
 };
 
 // acc += b * c
-void mac3(Digits out, ConstDigits x, ConstDigits y) {
-    x = normalize_slice(x);
-    y = normalize_slice(y);
+// shorter operand sizes in digits from which mac3 switches to the next
+// algorithm, measured with hw02/bench
+constexpr size_t KARATSUBA_THRESHOLD = 56;
+constexpr size_t TOOM3_THRESHOLD = 180;
+constexpr size_t TOOM4_THRESHOLD = 1000;
+// only with 64 bit digits
+constexpr size_t NTT_THRESHOLD = 10000;
+
+// the same for sqr, the schoolbook square does half the work of a product
+constexpr size_t SQR_KARATSUBA_THRESHOLD = 100;
+constexpr size_t SQR_TOOM3_THRESHOLD = 240;
+constexpr size_t SQR_TOOM4_THRESHOLD = 1000;
+constexpr size_t SQR_NTT_THRESHOLD = 10000;
+
+// the temporaries of one product, allocated once by mac3 with room for the
+// whole recursion and handed out in stack order through ScratchFrame
+class ScratchArena {
+    std::unique_ptr<Digit[]> buffer;
+    size_t size;
+    size_t used = 0;
+
+    friend class ScratchFrame;
 
-    // size_t x_start = 0;
-    // while (x_start < x.size() && x[x_start] == 0) {
-    //   x_start++;
-    // }
+  public:
+    explicit ScratchArena(size_t size) :
+        buffer(size == 0 ? nullptr : new Digit[size]),
+        size(size) {}
 
-    // size_t y_start = 0;
-    // while (y_start < y.size() && y[y_start] == 0) {
-    //   y_start++;
-    // }
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+};
 
-    // size_t common = std::min(x_start, y_start);
-    // out = out.start_at(common);
-    // x = x.start_at(common);
-    // y = y.start_at(common);
+// takes zeroed parts of an arena, they are given back when the frame goes
+// out of scope
+class ScratchFrame {
+    ScratchArena& arena;
+    size_t start;
 
-    out = out.clamp_size(x.size() + y.size());
+  public:
+    explicit ScratchFrame(ScratchArena& arena_) :
+        arena(arena_),
+        start(arena_.used) {}
 
-    if (x.size() > y.size()) {
-        std::swap(x, y);
+    ScratchFrame(const ScratchFrame&) = delete;
+    ScratchFrame& operator=(const ScratchFrame&) = delete;
+
+    ~ScratchFrame() {
+        arena.used = start;
     }
 
-    if (x.size() <= 64) {
-        size_t x_size = x.size();
-        for (size_t i = 0; i < x_size; i++) {
-            Digit overflow = mac_digit(out.start_at(i), y, x[i]);
-            assert(overflow == 0);
-        }
-    } else {
-        // Karatsuba multiplication
-        // https://en.wikipedia.org/wiki/Karatsuba_algorithm#Basic_step
+    Digits take(size_t size) {
+        assert(arena.used + size <= arena.size);
+        Digits part(arena.buffer.get() + arena.used, size);
+        arena.used += size;
+        part.clear();
+        return part;
+    }
+};
+
+void mac3(Digits out, ConstDigits x, ConstDigits y, ScratchArena& arena);
+void sqr(Digits out, ConstDigits x, ScratchArena& arena);
+
+// out += x * y, one digit of x at a time
+void mac_schoolbook(Digits out, ConstDigits x, ConstDigits y) {
+    size_t x_size = x.size();
+    for (size_t i = 0; i < x_size; i++) {
+        [[maybe_unused]] Digit overflow = mac_digit(out.start_at(i), y, x[i]);
+        assert(overflow == 0);
+    }
+}
+
+// a <<= shift, 0 < shift < DIGIT_BITS, returns the bits shifted out
+Digit shift_left(Digits a, unsigned shift) {
+    Digit low = 0;
+    size_t len = a.size();
+    for (size_t i = 0; i < len; i++) {
+        Digit digit = a[i];
+        a[i] = (digit << shift) | low;
+        low = digit >> (DIGIT_BITS - shift);
+    }
+    return low;
+}
+
+// out = x * x, out is zero and has 2 * x.size() digits
+//
+// every product of two different digits appears twice in the square, they
+// are summed once and doubled, then the squares of the digits are added
+void sqr_schoolbook(Digits out, ConstDigits x) {
+    size_t x_size = x.size();
+    assert(out.size() >= 2 * x_size);
+
+    for (size_t i = 0; i + 1 < x_size; i++) {
+        [[maybe_unused]] Digit overflow =
+            mac_digit(out.start_at(2 * i + 1), x.start_at(i + 1), x[i]);
+        assert(overflow == 0);
+    }
+    [[maybe_unused]] Digit overflow = shift_left(out, 1);
+    assert(overflow == 0);
+
+    Digit carry = 0;
+    for (size_t i = 0; i < x_size; i++) {
+        DoubleDigit square = (DoubleDigit)x[i] * x[i];
+        DoubleDigit low =
+            (DoubleDigit)out[2 * i] + double_low(square) + carry;
+        out[2 * i] = double_low(low);
+        DoubleDigit high = (DoubleDigit)out[2 * i + 1] + double_high(square)
+            + double_high(low);
+        out[2 * i + 1] = double_low(high);
+        carry = double_high(high);
+    }
+    assert(carry == 0);
+}
+
+// out += x * y, 2 <= x.size() <= y.size() <= 1.5 * x.size()
+void mac_karatsuba(
+    Digits out,
+    ConstDigits x,
+    ConstDigits y,
+    ScratchArena& arena
+) {
+    // Karatsuba multiplication
+    // https://en.wikipedia.org/wiki/Karatsuba_algorithm#Basic_step
 
-        size_t b = x.size() / 2;
+    size_t b = x.size() / 2;
 
-        auto x_split = x.split_at(b);
-        ConstDigits x0 = x_split.first;
-        ConstDigits x1 = x_split.second;
+    auto x_split = x.split_at(b);
+    ConstDigits x0 = x_split.first;
+    ConstDigits x1 = x_split.second;
 
-        auto y_split = y.split_at(b);
-        ConstDigits y0 = y_split.first;
-        ConstDigits y1 = y_split.second;
+    auto y_split = y.split_at(b);
+    ConstDigits y0 = y_split.first;
+    ConstDigits y1 = y_split.second;
+
+    // z3 = (x1 + x0) * (y1 + y0)
+    // z2 = x1 * y1
+    // z0 = x0 * y0
+    //
+    // x * y = z0
+    //       + z2 << 2b
+    //       + (z3 - z2 - z0) << b
+
+    ScratchFrame frame(arena);
+
+    size_t z0_add_size = std::max(x0.size(), x1.size()) + 1;
+    size_t z0_size = std::max(z0_add_size, x0.size() + y0.size());
+
+    size_t z2_add_size = std::max(y0.size(), y1.size()) + 1;
+    size_t z2_size = std::max(z2_add_size, x1.size() + y1.size());
+
+    Digits z0 = frame.take(z0_size);
+    Digits z2 = frame.take(z2_size);
+
+    {
+        Digit carry = 0;
+
+        z0.copy_from(x1);
+        // (x1 + x0)
+        carry |= add2(z0.clamp_size(z0_add_size), x0);
+
+        z2.copy_from(y1);
+        // (y1 + y0)
+        carry |= add2(z2.clamp_size(z2_add_size), y0);
 
         // z3 = (x1 + x0) * (y1 + y0)
+        mac3(out.start_at(b), z0, z2, arena);
+
         // z2 = x1 * y1
+        z2.clear();
+        mac3(z2, x1, y1, arena);
+
         // z0 = x0 * y0
-        //
-        // x * y = z0
-        //       + z2 << 2b
-        //       + (z3 - z2 - z0) << b
+        z0.clear();
+        mac3(z0, x0, y0, arena);
 
-        StackSliceAllocator<Digit, 512> alloc {};
+        // x * y = ...
+        // subtract first, adding first can overflow out on the way when
+        // the product is close to filling it
+        carry |= sub2(out.start_at(b), z2);
+        carry |= sub2(out.start_at(b), z0);
+        carry |= add2(out, z0);
+        carry |= add2(out.start_at(2 * b), z2);
 
-        size_t z0_add_size = std::max(x0.size(), x1.size()) + 1;
-        size_t z0_size = std::max(z0_add_size, x0.size() + y0.size());
+        assert(carry == 0);
+    }
+}
 
-        size_t z2_add_size = std::max(y0.size(), y1.size()) + 1;
-        size_t z2_size = std::max(z2_add_size, x1.size() + y1.size());
+// out = x * x, out is zero and has 2 * x.size() digits, x.size() >= 2
+//
+// mac_karatsuba with both operands the same, x0^2 and x1^2 don't overlap
+// and are squared straight into out, the middle part is (x1 + x0)^2 minus
+// the two of them
+void sqr_karatsuba(Digits out, ConstDigits x, ScratchArena& arena) {
+    size_t b = x.size() / 2;
+
+    auto x_split = x.split_at(b);
+    ConstDigits x0 = x_split.first;
+    ConstDigits x1 = x_split.second;
+
+    // z0 = x0^2
+    Digits z0 = out.clamp_size(2 * b);
+    sqr(z0, x0, arena);
+    // z2 = x1^2
+    Digits z2 = out.start_at(2 * b);
+    sqr(z2, x1, arena);
+
+    ScratchFrame frame(arena);
+    size_t sum_size = x1.size() + 1;
+    Digits sum = frame.take(sum_size);
+    Digits z3 = frame.take(2 * sum_size);
 
-        Digits z0 = alloc.allocate(z0_size);
-        Digits z2 = alloc.allocate(z2_size);
+    Digit carry = 0;
 
-        {
-            Digit carry = 0;
+    // z3 = (x1 + x0)^2
+    sum.copy_from(x1);
+    carry |= add2(sum, x0);
+    sqr(z3, sum, arena);
 
-            z0.copy_from(x1);
-            // (x1 + x0)
-            carry |= add2(z0.clamp_size(z0_add_size), x0);
+    // x * x = z0 + z2 << 2b + (z3 - z2 - z0) << b
+    carry |= sub2(z3, z0);
+    carry |= sub2(z3, z2);
+    carry |= add2(out.start_at(b), normalize_slice(z3));
 
-            z2.copy_from(y1);
-            // (y1 + y0)
-            carry |= add2(z2.clamp_size(z2_add_size), y0);
+    assert(carry == 0);
+}
 
-            // z3 = (x1 + x0) * (y1 + y0)
-            mac3(out.start_at(b), z0, z2);
+// a >>= shift, 0 < shift < DIGIT_BITS
+void shift_right(Digits a, unsigned shift) {
+    size_t len = a.size();
+    for (size_t i = 0; i < len; i++) {
+        Digit high = i + 1 < len ? a[i + 1] : 0;
+        a[i] = (a[i] >> shift) | (high << (DIGIT_BITS - shift));
+    }
+}
 
-            // z2 = x1 * y1
-            z2.clear();
-            mac3(z2, x1, y1);
+// a /= d, d must divide a
+//
+// the odd part of d is divided by multiplying with its inverse modulo
+// 2^DIGIT_BITS from the lowest digit up, which is much cheaper than div
+void div_exact_digit(Digits a, Digit d) {
+    assert(d != 0);
+    unsigned shift = __builtin_ctzll(d);
+    if (shift != 0) {
+        shift_right(a, shift);
+        d >>= shift;
+    }
+    if (d == 1) {
+        return;
+    }
+
+    // newton's iteration, d * d = 1 (mod 8) and every step doubles the
+    // number of correct bits
+    Digit inverse = d;
+    for (int i = 0; i < 5; i++) {
+        inverse *= 2 - d * inverse;
+    }
 
-            // z0 = x0 * y0
-            z0.clear();
-            mac3(z0, x0, y0);
+    Digit borrow = 0;
+    size_t len = a.size();
+    for (size_t i = 0; i < len; i++) {
+        Digit below = a[i] < borrow;
+        Digit quotient = (a[i] - borrow) * inverse;
+        a[i] = quotient;
+        borrow = double_high((DoubleDigit)quotient * d) + below;
+    }
+    assert(borrow == 0);
+}
+
+// a number with a sign, the values the toom-cook algorithms evaluate and
+// interpolate can be negative, digits has room for all of them
+struct SignedDigits {
+    Digits digits;
+    bool negative = false;
+};
+
+// a += b if b_negative is false, a -= b otherwise
+void signed_add(SignedDigits& a, ConstDigits b, bool b_negative) {
+    b = normalize_slice(b);
+    assert(b.size() <= a.digits.size());
+
+    if (a.negative == b_negative) {
+        [[maybe_unused]] Digit carry = add2(a.digits, b);
+        assert(carry == 0);
+    } else if (sub2(a.digits, b) != 0) {
+        // |b| > |a|, a - b wrapped around
+        twos_complement(a.digits);
+        a.negative = !a.negative;
+    }
+}
+
+void signed_add(SignedDigits& a, const SignedDigits& b) {
+    signed_add(a, b.digits, b.negative);
+}
 
-            // x * y = ...
-            carry |= add2(out, z0);
-            carry |= add2(out.start_at(2 * b), z2);
-            carry |= sub2(out.start_at(b), z2);
-            carry |= sub2(out.start_at(b), z0);
+void signed_sub(SignedDigits& a, const SignedDigits& b) {
+    signed_add(a, b.digits, !b.negative);
+}
+
+// a -= b * c, scratch has the size of a
+void signed_sub_mul(
+    SignedDigits& a,
+    const SignedDigits& b,
+    Digit c,
+    Digits scratch
+) {
+    scratch.clear();
+    scratch.copy_from(normalize_slice(b.digits));
+    [[maybe_unused]] Digit carry = mul_digit(scratch, c);
+    assert(carry == 0);
+    signed_add(a, scratch, !b.negative);
+}
+
+// out = a * b
+void signed_mul(
+    SignedDigits& out,
+    const SignedDigits& a,
+    const SignedDigits& b,
+    ScratchArena& arena
+) {
+    out.digits.clear();
+    mac3(out.digits, a.digits, b.digits, arena);
+    out.negative = a.negative != b.negative;
+}
+
+// out = a * a
+void signed_sqr(SignedDigits& out, const SignedDigits& a, ScratchArena& arena) {
+    out.digits.clear();
+    sqr(out.digits, a.digits, arena);
+    out.negative = false;
+}
+
+// out = a
+void set_digits(Digits out, ConstDigits a) {
+    out.clear();
+    out.copy_from(a);
+}
+
+// out += sum of w[i] << (i * k digits), all w[i] are non-negative
+void add_coefficients(Digits out, size_t k, SignedDigits* w, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        ConstDigits coefficient = normalize_slice(w[i].digits);
+        assert(!w[i].negative || coefficient.empty());
+        [[maybe_unused]] Digit carry = add2(out.start_at(i * k), coefficient);
+        assert(carry == 0);
+    }
+}
+
+// the pieces of a split into parts of k digits, missing ones are empty
+ConstDigits toom_piece(ConstDigits a, size_t i, size_t k) {
+    return a.start_at(i * k).clamp_size(k);
+}
+
+// at_1 = a(1), at_minus_1 = a(-1), at_minus_2 = a(-2) for the polynomial
+// a0 + a1 t + a2 t^2 with coefficients the parts of a
+void toom3_evaluate(
+    ConstDigits a,
+    size_t k,
+    SignedDigits& at_1,
+    SignedDigits& at_minus_1,
+    SignedDigits& at_minus_2
+) {
+    ConstDigits a0 = toom_piece(a, 0, k);
+    ConstDigits a1 = toom_piece(a, 1, k);
+    ConstDigits a2 = a.start_at(2 * k);
+
+    // a0 + a2
+    set_digits(at_1.digits, a0);
+    at_1.negative = false;
+    signed_add(at_1, a2, false);
+
+    // a0 - a1 + a2
+    set_digits(at_minus_1.digits, at_1.digits);
+    at_minus_1.negative = false;
+    signed_add(at_minus_1, a1, true);
+
+    // a0 + a1 + a2
+    signed_add(at_1, a1, false);
+
+    // 2 * (a0 - a1 + a2 + a2) - a0
+    set_digits(at_minus_2.digits, at_minus_1.digits);
+    at_minus_2.negative = at_minus_1.negative;
+    signed_add(at_minus_2, a2, false);
+    [[maybe_unused]] Digit carry = mul_digit(at_minus_2.digits, 2);
+    assert(carry == 0);
+    signed_add(at_minus_2, a0, true);
+}
 
-            assert(carry == 0);
+// out += the product with the values r0 = r(0), r1 = r(1), r_minus_1 =
+// r(-1), r_minus_2 = r(-2) and r_inf = r(inf), r1, r_minus_1 and r_minus_2
+// are used up
+void toom3_interpolate(
+    Digits out,
+    size_t k,
+    const SignedDigits& r0,
+    SignedDigits& r1,
+    SignedDigits& r_minus_1,
+    SignedDigits& r_minus_2,
+    const SignedDigits& r_inf
+) {
+    // r_minus_2 = (r(-2) - r(1)) / 3
+    signed_sub(r_minus_2, r1);
+    div_exact_digit(r_minus_2.digits, 3);
+    // r1 = (r(1) - r(-1)) / 2
+    signed_sub(r1, r_minus_1);
+    div_exact_digit(r1.digits, 2);
+    // r_minus_1 = r(-1) - r(0)
+    signed_sub(r_minus_1, r0);
+    // r_minus_2 = (r_minus_1 - r_minus_2) / 2 + 2 r(inf)
+    signed_sub(r_minus_2, r_minus_1);
+    r_minus_2.negative = !r_minus_2.negative;
+    div_exact_digit(r_minus_2.digits, 2);
+    signed_add(r_minus_2, r_inf);
+    signed_add(r_minus_2, r_inf);
+    // r_minus_1 = r_minus_1 + r1 - r(inf)
+    signed_add(r_minus_1, r1);
+    signed_sub(r_minus_1, r_inf);
+    // r1 = r1 - r_minus_2
+    signed_sub(r1, r_minus_2);
+
+    SignedDigits w[] = {r0, r1, r_minus_1, r_minus_2, r_inf};
+    add_coefficients(out, k, w, 5);
+}
+
+// out += x * y, x.size() <= y.size() <= 1.5 * x.size()
+//
+// Toom-Cook 3-way multiplication, x and y are split into three parts that
+// are the coefficients of two polynomials, their product is evaluated in 0,
+// 1, -1, -2 and infinity and interpolated back with the sequence from
+// Bodrato, Towards Optimal Toom-Cook Multiplication (2007)
+void mac_toom3(
+    Digits out,
+    ConstDigits x,
+    ConstDigits y,
+    ScratchArena& arena
+) {
+    size_t k = (y.size() + 2) / 3;
+    size_t value_size = k + 1;
+    size_t product_size = 2 * value_size;
+
+    ScratchFrame frame(arena);
+    SignedDigits x_1 {frame.take(value_size)};
+    SignedDigits x_minus_1 {frame.take(value_size)};
+    SignedDigits x_minus_2 {frame.take(value_size)};
+    SignedDigits y_1 {frame.take(value_size)};
+    SignedDigits y_minus_1 {frame.take(value_size)};
+    SignedDigits y_minus_2 {frame.take(value_size)};
+
+    toom3_evaluate(x, k, x_1, x_minus_1, x_minus_2);
+    toom3_evaluate(y, k, y_1, y_minus_1, y_minus_2);
+
+    SignedDigits r0 {frame.take(product_size)};
+    SignedDigits r1 {frame.take(product_size)};
+    SignedDigits r_minus_1 {frame.take(product_size)};
+    SignedDigits r_minus_2 {frame.take(product_size)};
+    SignedDigits r_inf {frame.take(product_size)};
+
+    signed_mul(r1, x_1, y_1, arena);
+    signed_mul(r_minus_1, x_minus_1, y_minus_1, arena);
+    signed_mul(r_minus_2, x_minus_2, y_minus_2, arena);
+    mac3(r0.digits, toom_piece(x, 0, k), toom_piece(y, 0, k), arena);
+    mac3(r_inf.digits, x.start_at(2 * k), y.start_at(2 * k), arena);
+
+    toom3_interpolate(out, k, r0, r1, r_minus_1, r_minus_2, r_inf);
+}
+
+// out = x * x, out is zero
+//
+// mac_toom3 with both operands the same, x is only evaluated once and its
+// values are squared
+void sqr_toom3(Digits out, ConstDigits x, ScratchArena& arena) {
+    size_t k = (x.size() + 2) / 3;
+    size_t value_size = k + 1;
+    size_t product_size = 2 * value_size;
+
+    ScratchFrame frame(arena);
+    SignedDigits x_1 {frame.take(value_size)};
+    SignedDigits x_minus_1 {frame.take(value_size)};
+    SignedDigits x_minus_2 {frame.take(value_size)};
+
+    toom3_evaluate(x, k, x_1, x_minus_1, x_minus_2);
+
+    SignedDigits r0 {frame.take(product_size)};
+    SignedDigits r1 {frame.take(product_size)};
+    SignedDigits r_minus_1 {frame.take(product_size)};
+    SignedDigits r_minus_2 {frame.take(product_size)};
+    SignedDigits r_inf {frame.take(product_size)};
+
+    signed_sqr(r1, x_1, arena);
+    signed_sqr(r_minus_1, x_minus_1, arena);
+    signed_sqr(r_minus_2, x_minus_2, arena);
+    sqr(r0.digits, toom_piece(x, 0, k), arena);
+    sqr(r_inf.digits, x.start_at(2 * k), arena);
+
+    toom3_interpolate(out, k, r0, r1, r_minus_1, r_minus_2, r_inf);
+}
+
+// at_1 = a(1), at_minus_1 = a(-1), at_2 = a(2), at_minus_2 = a(-2) and
+// at_half = 8 a(1/2) for the polynomial a0 + a1 t + a2 t^2 + a3 t^3 with
+// coefficients the parts of a, scratch has k + 1 digits
+void toom4_evaluate(
+    ConstDigits a,
+    size_t k,
+    SignedDigits& at_1,
+    SignedDigits& at_minus_1,
+    SignedDigits& at_2,
+    SignedDigits& at_minus_2,
+    SignedDigits& at_half,
+    Digits scratch
+) {
+    ConstDigits a0 = toom_piece(a, 0, k);
+    ConstDigits a1 = toom_piece(a, 1, k);
+    ConstDigits a2 = toom_piece(a, 2, k);
+    ConstDigits a3 = a.start_at(3 * k);
+    Digit carry = 0;
+
+    // a1 + a3
+    set_digits(scratch, a1);
+    carry |= add2(scratch, a3);
+
+    // a0 + a2 -+ (a1 + a3)
+    set_digits(at_1.digits, a0);
+    at_1.negative = false;
+    signed_add(at_1, a2, false);
+    set_digits(at_minus_1.digits, at_1.digits);
+    at_minus_1.negative = false;
+    signed_add(at_1, scratch, false);
+    signed_add(at_minus_1, scratch, true);
+
+    // 2 a1 + 8 a3
+    set_digits(scratch, a3);
+    carry |= mul_digit(scratch, 4);
+    carry |= add2(scratch, a1);
+    carry |= mul_digit(scratch, 2);
+
+    // a0 + 4 a2 -+ (2 a1 + 8 a3)
+    set_digits(at_2.digits, a2);
+    at_2.negative = false;
+    carry |= mul_digit(at_2.digits, 4);
+    signed_add(at_2, a0, false);
+    set_digits(at_minus_2.digits, at_2.digits);
+    at_minus_2.negative = false;
+    signed_add(at_2, scratch, false);
+    signed_add(at_minus_2, scratch, true);
+
+    // ((2 a0 + a1) 2 + a2) 2 + a3
+    set_digits(at_half.digits, a0);
+    at_half.negative = false;
+    carry |= mul_digit(at_half.digits, 2);
+    carry |= add2(at_half.digits, a1);
+    carry |= mul_digit(at_half.digits, 2);
+    carry |= add2(at_half.digits, a2);
+    carry |= mul_digit(at_half.digits, 2);
+    carry |= add2(at_half.digits, a3);
+
+    assert(carry == 0);
+}
+
+// out += the product with the values r0 = r(0), r1 = r(1), r_minus_1 =
+// r(-1), r2 = r(2), r_minus_2 = r(-2), r_half = 64 r(1/2) and r_inf =
+// r(inf), all but r0 and r_inf are used up, scratch is as long as r0
+void toom4_interpolate(
+    Digits out,
+    size_t k,
+    const SignedDigits& r0,
+    SignedDigits& r1,
+    SignedDigits& r_minus_1,
+    SignedDigits& r2,
+    SignedDigits& r_minus_2,
+    SignedDigits& r_half,
+    const SignedDigits& r_inf,
+    Digits scratch
+) {
+    // with w0..w6 the coefficients of the product, w0 = r(0), w6 = r(inf)
+
+    // r1 = w1 + w3 + w5, r_minus_1 = w0 + w2 + w4 + w6
+    signed_sub(r1, r_minus_1);
+    div_exact_digit(r1.digits, 2);
+    signed_add(r_minus_1, r1);
+    // r2 = w1 + 4 w3 + 16 w5, r_minus_2 = w0 + 4 w2 + 16 w4 + 64 w6
+    signed_sub(r2, r_minus_2);
+    div_exact_digit(r2.digits, 4);
+    signed_add(r_minus_2, r2);
+    signed_add(r_minus_2, r2);
+
+    // r_minus_1 = w2 + w4
+    signed_sub(r_minus_1, r0);
+    signed_sub(r_minus_1, r_inf);
+    // r_minus_2 = w2 + 4 w4
+    signed_sub(r_minus_2, r0);
+    signed_sub_mul(r_minus_2, r_inf, 64, scratch);
+    div_exact_digit(r_minus_2.digits, 4);
+    // r_minus_2 = w4, r_minus_1 = w2
+    signed_sub(r_minus_2, r_minus_1);
+    div_exact_digit(r_minus_2.digits, 3);
+    signed_sub(r_minus_1, r_minus_2);
+
+    // r_half = 16 w1 + 4 w3 + w5
+    signed_sub_mul(r_half, r0, 64, scratch);
+    signed_sub_mul(r_half, r_minus_1, 16, scratch);
+    signed_sub_mul(r_half, r_minus_2, 4, scratch);
+    signed_sub(r_half, r_inf);
+    div_exact_digit(r_half.digits, 2);
+    // r2 = w3 + 5 w5
+    signed_sub(r2, r1);
+    div_exact_digit(r2.digits, 3);
+    // r_half = 4 w3 + 5 w5
+    signed_sub_mul(r_half, r1, 16, scratch);
+    r_half.negative = !r_half.negative;
+    div_exact_digit(r_half.digits, 3);
+    // r_half = w3, r2 = w5, r1 = w1
+    signed_sub(r_half, r2);
+    div_exact_digit(r_half.digits, 3);
+    signed_sub(r2, r_half);
+    div_exact_digit(r2.digits, 5);
+    signed_sub(r1, r_half);
+    signed_sub(r1, r2);
+
+    SignedDigits w[] = {r0, r1, r_minus_1, r_half, r_minus_2, r2, r_inf};
+    add_coefficients(out, k, w, 7);
+}
+
+// out += x * y, x.size() <= y.size() <= 1.5 * x.size()
+//
+// Toom-Cook 4-way multiplication, like mac_toom3 with four parts and the
+// product evaluated in 0, 1, -1, 2, -2, 1/2 and infinity, the coefficients
+// are recovered from the sums and differences of the values in opposite
+// points, every division in it is exact
+void mac_toom4(
+    Digits out,
+    ConstDigits x,
+    ConstDigits y,
+    ScratchArena& arena
+) {
+    size_t k = (y.size() + 3) / 4;
+    size_t value_size = k + 1;
+    size_t product_size = 2 * value_size;
+
+    ScratchFrame frame(arena);
+    SignedDigits x_1 {frame.take(value_size)};
+    SignedDigits x_minus_1 {frame.take(value_size)};
+    SignedDigits x_2 {frame.take(value_size)};
+    SignedDigits x_minus_2 {frame.take(value_size)};
+    SignedDigits x_half {frame.take(value_size)};
+    SignedDigits y_1 {frame.take(value_size)};
+    SignedDigits y_minus_1 {frame.take(value_size)};
+    SignedDigits y_2 {frame.take(value_size)};
+    SignedDigits y_minus_2 {frame.take(value_size)};
+    SignedDigits y_half {frame.take(value_size)};
+    Digits value_scratch = frame.take(value_size);
+
+    toom4_evaluate(
+        x, k, x_1, x_minus_1, x_2, x_minus_2, x_half, value_scratch
+    );
+    toom4_evaluate(
+        y, k, y_1, y_minus_1, y_2, y_minus_2, y_half, value_scratch
+    );
+
+    SignedDigits r0 {frame.take(product_size)};
+    SignedDigits r1 {frame.take(product_size)};
+    SignedDigits r_minus_1 {frame.take(product_size)};
+    SignedDigits r2 {frame.take(product_size)};
+    SignedDigits r_minus_2 {frame.take(product_size)};
+    SignedDigits r_half {frame.take(product_size)};
+    SignedDigits r_inf {frame.take(product_size)};
+    Digits scratch = frame.take(product_size);
+
+    signed_mul(r1, x_1, y_1, arena);
+    signed_mul(r_minus_1, x_minus_1, y_minus_1, arena);
+    signed_mul(r2, x_2, y_2, arena);
+    signed_mul(r_minus_2, x_minus_2, y_minus_2, arena);
+    signed_mul(r_half, x_half, y_half, arena);
+    mac3(r0.digits, toom_piece(x, 0, k), toom_piece(y, 0, k), arena);
+    mac3(r_inf.digits, x.start_at(3 * k), y.start_at(3 * k), arena);
+
+    toom4_interpolate(
+        out, k, r0, r1, r_minus_1, r2, r_minus_2, r_half, r_inf, scratch
+    );
+}
+
+// out = x * x, out is zero
+//
+// mac_toom4 with both operands the same, like sqr_toom3
+void sqr_toom4(Digits out, ConstDigits x, ScratchArena& arena) {
+    size_t k = (x.size() + 3) / 4;
+    size_t value_size = k + 1;
+    size_t product_size = 2 * value_size;
+
+    ScratchFrame frame(arena);
+    SignedDigits x_1 {frame.take(value_size)};
+    SignedDigits x_minus_1 {frame.take(value_size)};
+    SignedDigits x_2 {frame.take(value_size)};
+    SignedDigits x_minus_2 {frame.take(value_size)};
+    SignedDigits x_half {frame.take(value_size)};
+    Digits value_scratch = frame.take(value_size);
+
+    toom4_evaluate(
+        x, k, x_1, x_minus_1, x_2, x_minus_2, x_half, value_scratch
+    );
+
+    SignedDigits r0 {frame.take(product_size)};
+    SignedDigits r1 {frame.take(product_size)};
+    SignedDigits r_minus_1 {frame.take(product_size)};
+    SignedDigits r2 {frame.take(product_size)};
+    SignedDigits r_minus_2 {frame.take(product_size)};
+    SignedDigits r_half {frame.take(product_size)};
+    SignedDigits r_inf {frame.take(product_size)};
+    Digits scratch = frame.take(product_size);
+
+    signed_sqr(r1, x_1, arena);
+    signed_sqr(r_minus_1, x_minus_1, arena);
+    signed_sqr(r2, x_2, arena);
+    signed_sqr(r_minus_2, x_minus_2, arena);
+    signed_sqr(r_half, x_half, arena);
+    sqr(r0.digits, toom_piece(x, 0, k), arena);
+    sqr(r_inf.digits, x.start_at(3 * k), arena);
+
+    toom4_interpolate(
+        out, k, r0, r1, r_minus_1, r2, r_minus_2, r_half, r_inf, scratch
+    );
+}
+
+#ifdef DIGIT64
+// a prime p < 2^63 for number theoretic transforms, 2^50 divides p - 1 so
+// there are transforms of up to 2^50 values modulo p
+//
+// values are kept below p, mul works in montgomery form: mul(a, b) is
+// a * b / 2^64, so multiplying by a constant stored as c * 2^64 gives a * c
+struct NttPrime {
+    Digit p;
+    // p * inverse = 1 (mod 2^64)
+    Digit inverse;
+    // generates the multiplicative group modulo p
+    Digit generator;
+
+    // a + p if a is negative as a signed number, without a branch, values
+    // are random and a branch would be mispredicted half of the time
+    Digit wrap(Digit a) const {
+        return a + (p & -(a >> (DIGIT_BITS - 1)));
+    }
+
+    Digit add(Digit a, Digit b) const {
+        return wrap(a + b - p);
+    }
+
+    Digit sub(Digit a, Digit b) const {
+        return wrap(a - b);
+    }
+
+    // a * b / 2^64 (mod p)
+    //
+    // m * p has the same low digit as a * b, so subtracting it leaves
+    // a * b / 2^64 in the high digits
+    Digit mul(Digit a, Digit b) const {
+        DoubleDigit product = (DoubleDigit)a * b;
+        Digit m = double_low(product) * inverse;
+        Digit subtrahend = double_high((DoubleDigit)m * p);
+        return wrap(double_high(product) - subtrahend);
+    }
+
+    // a * b (mod p) with a division, for setting up constants
+    Digit mul_slow(Digit a, Digit b) const {
+        return (Digit)((DoubleDigit)a * b % p);
+    }
+
+    Digit pow_slow(Digit a, Digit exponent) const {
+        Digit result = 1;
+        for (; exponent != 0; exponent >>= 1) {
+            if (exponent & 1) {
+                result = mul_slow(result, a);
+            }
+            a = mul_slow(a, a);
+        }
+        return result;
+    }
+
+    // a * 2^64 (mod p)
+    Digit to_montgomery(Digit a) const {
+        return (Digit)(((DoubleDigit)a << DIGIT_BITS) % p);
+    }
+
+    // a mod p, p > 2^62 so a digit is below 4 p
+    Digit reduce(Digit a) const {
+        while (a >= p) {
+            a -= p;
         }
+        return a;
+    }
+};
+
+// 8170 * 2^50 + 1, 8134 * 2^50 + 1 and 8094 * 2^50 + 1, products have
+// coefficients below n * 2^128 which is less than their product as long as
+// n < 2^60
+constexpr NttPrime NTT_PRIMES[] = {
+    {9198602238904238081ull, 9248141834805313537ull, 3},
+    {9158069842257903617ull, 9288674231451648001ull, 3},
+    {9113033845984198657ull, 9333710227725352961ull, 5},
+};
+
+// transforms up to this many values run stage by stage, larger ones are
+// split in halves until they fit into the L1 cache
+constexpr size_t NTT_BLOCK = 1 << 12;
+
+// powers of the roots of unity used in the transforms of n values,
+// roots[h + j] = w^j for w a root of unity of order 2h, in montgomery form
+void ntt_roots(const NttPrime& prime, Digits roots, size_t n, bool inverse) {
+    Digit root = prime.pow_slow(prime.generator, (prime.p - 1) / n);
+    if (inverse) {
+        root = prime.pow_slow(root, n - 1);
+    }
+
+    size_t half = n / 2;
+    Digit step = prime.to_montgomery(root);
+    Digit power = prime.to_montgomery(1);
+    for (size_t j = 0; j < half; j++) {
+        roots[half + j] = power;
+        power = prime.mul(power, step);
+    }
+
+    // a root of order 2h is the square of a root of order 4h
+    for (size_t h = half / 2; h >= 1; h /= 2) {
+        for (size_t j = 0; j < h; j++) {
+            roots[h + j] = roots[2 * h + 2 * j];
+        }
+    }
+}
+
+// decimation in frequency, a in natural order becomes its transform in
+// bit reversed order
+void ntt_forward(
+    const NttPrime& prime,
+    Digit* a,
+    size_t n,
+    const Digit* roots
+) {
+    if (n > NTT_BLOCK) {
+        size_t h = n / 2;
+        for (size_t j = 0; j < h; j++) {
+            Digit u = a[j];
+            Digit v = a[j + h];
+            a[j] = prime.add(u, v);
+            a[j + h] = prime.mul(prime.sub(u, v), roots[h + j]);
+        }
+        ntt_forward(prime, a, h, roots);
+        ntt_forward(prime, a + h, h, roots);
+        return;
+    }
+
+    for (size_t h = n / 2; h >= 1; h /= 2) {
+        for (size_t block = 0; block < n; block += 2 * h) {
+            Digit* b = a + block;
+            for (size_t j = 0; j < h; j++) {
+                Digit u = b[j];
+                Digit v = b[j + h];
+                b[j] = prime.add(u, v);
+                b[j + h] = prime.mul(prime.sub(u, v), roots[h + j]);
+            }
+        }
+    }
+}
+
+// decimation in time with the inverse roots, undoes ntt_forward except for
+// a factor of n
+void ntt_inverse(
+    const NttPrime& prime,
+    Digit* a,
+    size_t n,
+    const Digit* roots
+) {
+    if (n > NTT_BLOCK) {
+        size_t h = n / 2;
+        ntt_inverse(prime, a, h, roots);
+        ntt_inverse(prime, a + h, h, roots);
+        for (size_t j = 0; j < h; j++) {
+            Digit u = a[j];
+            Digit v = prime.mul(a[j + h], roots[h + j]);
+            a[j] = prime.add(u, v);
+            a[j + h] = prime.sub(u, v);
+        }
+        return;
+    }
+
+    for (size_t h = 1; h < n; h *= 2) {
+        for (size_t block = 0; block < n; block += 2 * h) {
+            Digit* b = a + block;
+            for (size_t j = 0; j < h; j++) {
+                Digit u = b[j];
+                Digit v = prime.mul(b[j + h], roots[h + j]);
+                b[j] = prime.add(u, v);
+                b[j + h] = prime.sub(u, v);
+            }
+        }
+    }
+}
+
+// the cyclic convolution of x and y modulo prime in out, n values each,
+// scratch has 2 n digits, when x and y are the same only x is transformed
+void ntt_convolve(
+    const NttPrime& prime,
+    Digits out,
+    ConstDigits x,
+    ConstDigits y,
+    Digits scratch
+) {
+    size_t n = out.size();
+    auto parts = scratch.split_at(n);
+    Digits other = out;
+    Digits roots = parts.second;
+
+    out.clear();
+    for (size_t i = 0; i < x.size(); i++) {
+        out[i] = prime.reduce(x[i]);
+    }
+
+    ntt_roots(prime, roots, n, false);
+    ntt_forward(prime, out.begin(), n, roots.begin());
+
+    if (x.begin() != y.begin() || x.size() != y.size()) {
+        other = parts.first;
+        other.clear();
+        for (size_t i = 0; i < y.size(); i++) {
+            other[i] = prime.reduce(y[i]);
+        }
+        ntt_forward(prime, other.begin(), n, roots.begin());
+    }
+
+    // the products come out divided by 2^64 and the inverse transform
+    // multiplies by n, both are undone with the last multiplication
+    for (size_t i = 0; i < n; i++) {
+        out[i] = prime.mul(out[i], other[i]);
+    }
+
+    ntt_roots(prime, roots, n, true);
+    ntt_inverse(prime, out.begin(), n, roots.begin());
 
-        alloc.free(z0);
-        alloc.free(z2);
+    Digit r = prime.to_montgomery(1);
+    Digit scale = prime.mul_slow(
+        prime.mul_slow(r, r),
+        prime.pow_slow(n % prime.p, prime.p - 2)
+    );
+    for (size_t i = 0; i < n; i++) {
+        out[i] = prime.mul(out[i], scale);
     }
 }
 
+// length of the transforms for a product of size digits
+size_t ntt_size(size_t size) {
+    size_t n = 1;
+    while (n < size) {
+        n *= 2;
+    }
+    return n;
+}
+
+// out += x * y
+//
+// the digits of x and y are the coefficients of polynomials which are
+// multiplied modulo three primes with number theoretic transforms, the
+// coefficients of the product are put together from their residues with
+// Garner's algorithm and added to out with their carries
+void mac_ntt(Digits out, ConstDigits x, ConstDigits y, ScratchArena& arena) {
+    out = out.clamp_size(x.size() + y.size());
+    size_t n = ntt_size(x.size() + y.size());
+
+    ScratchFrame frame(arena);
+    Digits residues[] = {frame.take(n), frame.take(n), frame.take(n)};
+    Digits scratch = frame.take(2 * n);
+    for (size_t i = 0; i < 3; i++) {
+        ntt_convolve(NTT_PRIMES[i], residues[i], x, y, scratch);
+    }
+
+    const NttPrime& p1 = NTT_PRIMES[0];
+    const NttPrime& p2 = NTT_PRIMES[1];
+    const NttPrime& p3 = NTT_PRIMES[2];
+
+    // p1^-1 mod p2, p1^-1 mod p3 and p2^-1 mod p3 in montgomery form
+    Digit p1_inverse_2 = p2.to_montgomery(p2.pow_slow(p1.p % p2.p, p2.p - 2));
+    Digit p1_inverse_3 = p3.to_montgomery(p3.pow_slow(p1.p % p3.p, p3.p - 2));
+    Digit p2_inverse_3 = p3.to_montgomery(p3.pow_slow(p2.p % p3.p, p3.p - 2));
+    DoubleDigit p1_p2 = (DoubleDigit)p1.p * p2.p;
+
+    // carried into out[i], below 2^128
+    Digit carry_low = 0;
+    Digit carry_high = 0;
+    size_t len = out.size();
+    for (size_t i = 0; i < len; i++) {
+        // coefficient = v1 + v2 p1 + v3 p1 p2
+        Digit v1 = residues[0][i];
+        Digit v2 = p2.mul(p2.sub(residues[1][i], p2.reduce(v1)), p1_inverse_2);
+        Digit v3 = p3.mul(
+            p3.sub(
+                p3.mul(p3.sub(residues[2][i], p3.reduce(v1)), p1_inverse_3),
+                p3.reduce(v2)
+            ),
+            p2_inverse_3
+        );
+
+        // the terms of the coefficient by the digit they start in
+        DoubleDigit v2_p1 = (DoubleDigit)v2 * p1.p;
+        DoubleDigit v3_low = (DoubleDigit)v3 * double_low(p1_p2);
+        DoubleDigit v3_high = (DoubleDigit)v3 * double_high(p1_p2);
+
+        DoubleDigit sum = (DoubleDigit)out[i] + carry_low + v1
+            + double_low(v2_p1) + double_low(v3_low);
+        out[i] = double_low(sum);
+
+        sum = (sum >> DIGIT_BITS) + carry_high + double_high(v2_p1)
+            + double_high(v3_low) + double_low(v3_high);
+        carry_low = double_low(sum);
+        carry_high = double_high(sum) + double_high(v3_high);
+    }
+
+    assert(carry_low == 0 && carry_high == 0);
+}
+#endif
+
+// out += x * y, y.size() > 1.5 * x.size()
+//
+// the toom-cook algorithms need parts of similar size, y is multiplied in
+// pieces as long as x
+void mac_unbalanced(
+    Digits out,
+    ConstDigits x,
+    ConstDigits y,
+    ScratchArena& arena
+) {
+    size_t piece_size = x.size();
+    ScratchFrame frame(arena);
+    Digits product = frame.take(2 * piece_size);
+
+    for (size_t i = 0; i < y.size(); i += piece_size) {
+        product.clear();
+        mac3(product, x, y.start_at(i).clamp_size(piece_size), arena);
+        [[maybe_unused]] Digit carry =
+            add2(out.start_at(i), normalize_slice(product));
+        assert(carry == 0);
+    }
+}
+
+// out += x * y, the temporaries of the algorithms come from arena
+void mac3(Digits out, ConstDigits x, ConstDigits y, ScratchArena& arena) {
+    x = normalize_slice(x);
+    y = normalize_slice(y);
+
+    out = out.clamp_size(x.size() + y.size());
+
+    if (x.size() > y.size()) {
+        std::swap(x, y);
+    }
+
+    if (x.size() < KARATSUBA_THRESHOLD) {
+        mac_schoolbook(out, x, y);
+#ifdef DIGIT64
+    } else if (x.size() >= NTT_THRESHOLD) {
+        mac_ntt(out, x, y, arena);
+#endif
+    } else if (2 * y.size() > 3 * x.size()) {
+        mac_unbalanced(out, x, y, arena);
+    } else if (x.size() < TOOM3_THRESHOLD) {
+        mac_karatsuba(out, x, y, arena);
+    } else if (x.size() < TOOM4_THRESHOLD) {
+        mac_toom3(out, x, y, arena);
+    } else {
+        mac_toom4(out, x, y, arena);
+    }
+}
+
+// digits of scratch mac3 needs for operands of x_size and y_size digits
+//
+// the NTT is only done at the top, below it every algorithm takes at most
+// 4.05 (x + y) digits plus a constant for itself and recurses on operands
+// of at most 0.6 (x + y) digits, except mac_unbalanced which takes 2 x and
+// recurses on 2 x with x < 0.4 (x + y), so by induction 6 (x + y) is enough
+size_t mac3_scratch_size(size_t x_size, size_t y_size) {
+    size_t min_size = std::min(x_size, y_size);
+    if (min_size < KARATSUBA_THRESHOLD) {
+        return 0;
+    }
+#ifdef DIGIT64
+    if (min_size >= NTT_THRESHOLD) {
+        return 5 * ntt_size(x_size + y_size);
+    }
+#endif
+    return 6 * (x_size + y_size);
+}
+
+// out += x * y
+void mac3(Digits out, ConstDigits x, ConstDigits y) {
+    x = normalize_slice(x);
+    y = normalize_slice(y);
+
+    ScratchArena arena(mac3_scratch_size(x.size(), y.size()));
+    mac3(out, x, y, arena);
+}
+
+// out = x * x, out is zero, the temporaries of the algorithms come from
+// arena
+void sqr(Digits out, ConstDigits x, ScratchArena& arena) {
+    x = normalize_slice(x);
+
+    out = out.clamp_size(2 * x.size());
+    assert(out.size() == 2 * x.size());
+
+    if (x.size() < SQR_KARATSUBA_THRESHOLD) {
+        sqr_schoolbook(out, x);
+    } else if (x.size() < SQR_TOOM3_THRESHOLD) {
+        sqr_karatsuba(out, x, arena);
+#ifdef DIGIT64
+    } else if (x.size() >= SQR_NTT_THRESHOLD) {
+        // mac_ntt sees that both operands are x and transforms it once
+        mac_ntt(out, x, x, arena);
+#endif
+    } else if (x.size() < SQR_TOOM4_THRESHOLD) {
+        sqr_toom3(out, x, arena);
+    } else {
+        sqr_toom4(out, x, arena);
+    }
+}
+
+// digits of scratch sqr needs for an operand of x_size digits
+//
+// like mac3_scratch_size, below the NTT every algorithm takes at most
+// 5.5 x digits plus a constant for itself and recurses on operands of at
+// most 0.5 x digits plus a constant, so 8 x is enough
+size_t sqr_scratch_size(size_t x_size) {
+    if (x_size < SQR_KARATSUBA_THRESHOLD) {
+        return 0;
+    }
+#ifdef DIGIT64
+    if (x_size >= SQR_NTT_THRESHOLD) {
+        return 5 * ntt_size(2 * x_size);
+    }
+#endif
+    return 8 * x_size;
+}
+
+// out = x * x, out is zero
+void sqr(Digits out, ConstDigits x) {
+    x = normalize_slice(x);
+
+    ScratchArena arena(sqr_scratch_size(x.size()));
+    sqr(out, x, arena);
+}
+
 #ifndef __PROGTEST__
 static bool equal(const CBigInt& x, const char val[]) {
     std::ostringstream oss;
@@ -1338,6 +2536,75 @@ int main() {
     assert(!(a == -87654321));
     assert(a != -87654321);
 
+    // carries and borrows across 64 bit digits
+    a = "0xffffffffffffffff";
+    a += 1;
+    assert(equal(a, "18446744073709551616"));
+    assert(equalHex(a, "10000000000000000"));
+    a -= CBigInt(1);
+    assert(equalHex(a, "ffffffffffffffff"));
+    a = "0xffffffffffffffffffffffffffffffff";
+    assert(equalHex(
+        a * a,
+        "fffffffffffffffffffffffffffffffe00000000000000000000000000000001"
+    ));
+    a += 1;
+    assert(equal(a, "340282366920938463463374607431768211456"));
+    b = a;
+    b -= CBigInt(1);
+    assert(equalHex(b, "ffffffffffffffffffffffffffffffff"));
+    b = 0;
+    b -= a;
+    assert(equalHex(b, "-100000000000000000000000000000000"));
+
+    // (16^n - 1)^2 = 16^2n - 2 * 16^n + 1, large enough for every
+    // multiplication algorithm
+    for (size_t n : {17, 63, 200, 1500, 4000, 17000, 170000}) {
+        a = ("0x" + std::string(n, 'f')).c_str();
+        std::string square = std::string(n - 1, 'f') + "e"
+            + std::string(n - 1, '0') + "1";
+        assert(equalHex(a * a, square.c_str()));
+        assert(equalHex(a + 1, ("1" + std::string(n, '0')).c_str()));
+    }
+
+    // (16^n - 1) * (16^m - 1), n < m, also operands of very different sizes
+    for (auto [n, m] : {
+             std::pair {100, 3000},
+             {3000, 10000},
+             {17000, 20000},
+             {170000, 400000},
+         }) {
+        a = ("0x" + std::string(n, 'f')).c_str();
+        b = ("0x" + std::string(m, 'f')).c_str();
+        std::string product = std::string(n - 1, 'f') + "e"
+            + std::string(m - n, 'f') + std::string(n - 1, '0') + "1";
+        assert(equalHex(a * b, product.c_str()));
+        assert(equalHex(b * a, product.c_str()));
+    }
+
+    // (10^n - 1)^2 through decimal chunks that don't line up with digits
+    for (size_t n : {9, 19, 20, 400}) {
+        a = std::string(n, '9').c_str();
+        std::string square = std::string(n - 1, '9') + "8"
+            + std::string(n - 1, '0') + "1";
+        assert(equal(a * a, square.c_str()));
+    }
+
+    // a * a goes through sqr, checked against the product of two copies
+    for (size_t n : {30, 700, 2000, 5000, 20000, 170000}) {
+        std::string hex = "-0x";
+        for (size_t i = 0; i < n; i++) {
+            hex += "0123456789abcdef"[(i * i + 7 * i + 3) % 16];
+        }
+        a = hex.c_str();
+        b = a;
+        CBigInt product = a * b;
+        assert(a * a == product);
+        assert(a.square() == product);
+        b *= b;
+        assert(b == product);
+    }
+
     return EXIT_SUCCESS;
 }
 #endif /* __PROGTEST__ */
@@ -0,0 +1,646 @@
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <chrono>
+#include <functional>
+#include <sstream>
+
+#include "velka.cpp"
+
+// synthetic workloads for measuring the performance of CSpreadsheet
+//
+// usage: velka_bench.bin [--scale N] [--only NAME]
+// prints a single JSON object to stdout, --scale multiplies the size of all
+// workloads (--scale 100 gives 10M cells in save_load)
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchResult {
+    std::string name;
+    // size of the generated sheet
+    size_t cells = 0;
+    // bytes written by save, only for save_load
+    size_t bytes = 0;
+    double setup_seconds = 0;
+    // latency of each measured operation in seconds
+    std::vector<double> latencies;
+    long peak_rss_kb = 0;
+};
+
+struct BenchOptions {
+    size_t scale = 1;
+    std::string only;
+};
+
+long peak_rss_kb() {
+    struct rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// 1 based column number to letters, 1 = A, 27 = AA
+std::string column_name(int x) {
+    std::string name;
+    while (x > 0) {
+        x--;
+        name.push_back((char)('A' + x % 26));
+        x /= 26;
+    }
+    std::reverse(name.begin(), name.end());
+    return name;
+}
+
+std::string cell_name(int x, int y) {
+    return column_name(x) + std::to_string(y);
+}
+
+// measure a single operation
+template<typename F>
+void measure(BenchResult& result, F fun) {
+    auto start = Clock::now();
+    fun();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    result.latencies.push_back(elapsed.count());
+}
+
+// measure the setup of a workload
+template<typename F>
+void measure_setup(BenchResult& result, F fun) {
+    auto start = Clock::now();
+    fun();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    result.setup_seconds = elapsed.count();
+}
+
+// stop the run if an operation being measured failed, asserts are compiled
+// out of benchmarks
+void check(bool success, const char* operation) {
+    if (!success) {
+        std::cerr << operation << " failed" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+// keep the compiler from optimizing out reads
+void consume(const CValue& value) {
+    static volatile size_t sink = 0;
+    sink = sink + value.index();
+}
+
+// A1 = 1, An = An-1 + 1, edit the head and read the tail
+BenchResult bench_chain(size_t scale) {
+    BenchResult result {"chain"};
+    int length = (int)(10'000 * scale);
+    CSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        sheet.setCell(CPos(1, 1), "1");
+        for (int y = 2; y <= length; y++) {
+            sheet.setCell(CPos(1, y), "=" + cell_name(1, y - 1) + "+1");
+        }
+        consume(sheet.getValue(CPos(1, length)));
+    });
+    result.cells = (size_t)length;
+
+    for (int i = 0; i < 100; i++) {
+        measure(result, [&] {
+            sheet.setCell(CPos(1, 1), std::to_string(i));
+            consume(sheet.getValue(CPos(1, length)));
+        });
+    }
+    return result;
+}
+
+// many cells depending on a single input, edit it and read all of them
+BenchResult bench_fanout(size_t scale) {
+    BenchResult result {"fanout"};
+    int width = (int)(10'000 * scale);
+    CSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        sheet.setCell(CPos(1, 1), "1");
+        for (int y = 1; y <= width; y++) {
+            sheet.setCell(CPos(2, y), "=$A$1*" + std::to_string(y));
+        }
+    });
+    result.cells = (size_t)width + 1;
+
+    for (int i = 0; i < 50; i++) {
+        measure(result, [&] {
+            sheet.setCell(CPos(1, 1), std::to_string(i));
+            for (int y = 1; y <= width; y++) {
+                consume(sheet.getValue(CPos(2, y)));
+            }
+        });
+    }
+    return result;
+}
+
+// edit an input with a large cone many times without reading in between
+BenchResult bench_hot_edits(size_t scale) {
+    BenchResult result {"hot_edits"};
+    int width = (int)(10'000 * scale);
+    CSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        sheet.setCell(CPos(1, 1), "1");
+        for (int y = 1; y <= width; y++) {
+            sheet.setCell(CPos(2, y), "=$A$1+" + std::to_string(y));
+        }
+        for (int y = 1; y <= width; y++) {
+            consume(sheet.getValue(CPos(2, y)));
+        }
+    });
+    result.cells = (size_t)width + 1;
+
+    for (int i = 0; i < 1000; i++) {
+        measure(result, [&] { sheet.setCell(CPos(1, 1), std::to_string(i)); });
+    }
+    consume(sheet.getValue(CPos(2, width)));
+    return result;
+}
+
+// a column of numbers summed by many cells, edit one number and read all sums
+BenchResult bench_range_sum(size_t scale) {
+    BenchResult result {"range_sum"};
+    int height = (int)(10'000 * scale);
+    int sums = 100;
+    CSpreadsheet sheet;
+    std::string range = "$A$1:$A$" + std::to_string(height);
+
+    measure_setup(result, [&] {
+        for (int y = 1; y <= height; y++) {
+            sheet.setCell(CPos(1, y), std::to_string(y));
+        }
+        for (int y = 1; y <= sums; y++) {
+            sheet.setCell(CPos(2, y), "=sum(" + range + ")");
+        }
+    });
+    result.cells = (size_t)(height + sums);
+
+    for (int i = 0; i < 20; i++) {
+        measure(result, [&] {
+            sheet.setCell(CPos(1, 1 + i % height), std::to_string(i));
+            for (int y = 1; y <= sums; y++) {
+                consume(sheet.getValue(CPos(2, y)));
+            }
+        });
+    }
+    return result;
+}
+
+// fill a rectangle by repeatedly copying a row of formulas downwards
+BenchResult bench_copy_rect(size_t scale) {
+    BenchResult result {"copy_rect"};
+    int width = 20;
+    int height = (int)(500 * scale);
+    CSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        for (int x = 1; x <= width; x++) {
+            sheet.setCell(CPos(x, 1), std::to_string(x));
+            sheet.setCell(
+                CPos(x, 2),
+                "=" + cell_name(x, 1) + "*2+$A$1"
+            );
+        }
+    });
+    result.cells = (size_t)(width * height);
+
+    for (int y = 3; y <= height; y++) {
+        measure(result, [&] {
+            sheet.copyRect(CPos(1, y), CPos(1, y - 1), width, 1);
+        });
+    }
+    consume(sheet.getValue(CPos(width, height)));
+    return result;
+}
+
+// insert and delete rows near the top of a tall sheet of formulas
+BenchResult bench_insert_rows(size_t scale) {
+    BenchResult result {"insert_rows"};
+    int height = (int)(100'000 * scale);
+    CSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        for (int y = 1; y <= height; y++) {
+            sheet.setCell(CPos(1, y), std::to_string(y));
+            sheet.setCell(CPos(2, y), "=A" + std::to_string(y) + "*2");
+        }
+    });
+    result.cells = (size_t)height * 2;
+
+    for (int i = 0; i < 100; i++) {
+        measure(result, [&] {
+            if (i % 2 == 0) {
+                sheet.insertRows(2, 1);
+            } else {
+                sheet.deleteRows(2, 1);
+            }
+            consume(sheet.getValue(CPos(2, height)));
+        });
+    }
+    return result;
+}
+
+// edit a row of numbers and formulas and read the whole rectangle, cell by
+// cell or with a single getValues
+BenchResult bench_read_rect(size_t scale, bool bulk) {
+    BenchResult result {bulk ? "read_rect_bulk" : "read_rect"};
+    int width = 10;
+    int height = (int)(10'000 * scale);
+    CSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        for (int y = 1; y <= height; y++) {
+            sheet.setCell(CPos(1, y), std::to_string(y));
+            for (int x = 2; x <= width; x++) {
+                sheet.setCell(CPos(x, y), "=" + cell_name(x - 1, y) + "*2");
+            }
+        }
+    });
+    result.cells = (size_t)width * height;
+
+    std::vector<CValue> values((size_t)width * height);
+    for (int i = 0; i < 20; i++) {
+        measure(result, [&] {
+            sheet.setCell(CPos(1, 1 + i * 97 % height), std::to_string(-i));
+            if (bulk) {
+                sheet.getValues(CPos(1, 1), width, height, values.data());
+            } else {
+                for (int x = 1; x <= width; x++) {
+                    for (int y = 1; y <= height; y++) {
+                        values[(size_t)(x - 1) * height + y - 1] =
+                            sheet.getValue(CPos(x, y));
+                    }
+                }
+            }
+            consume(values.back());
+        });
+    }
+    return result;
+}
+
+// sheets of formulas over a shared sheet of inputs, edit an input and
+// recalculate the workbook, the dependent sheets are evaluated in parallel
+BenchResult bench_workbook(size_t scale) {
+    BenchResult result {"workbook"};
+    int height = (int)(10'000 * scale);
+    int sheets = 8;
+    CWorkbook workbook;
+
+    measure_setup(result, [&] {
+        workbook.addSheet("Base");
+        for (int y = 1; y <= height; y++) {
+            workbook.setCell("Base", CPos(1, y), std::to_string(y));
+        }
+        for (int k = 0; k < sheets; k++) {
+            std::string name = "S" + std::to_string(k);
+            workbook.addSheet(name);
+            for (int y = 1; y <= height; y++) {
+                workbook.setCell(
+                    name,
+                    CPos(1, y),
+                    "=Base!" + cell_name(1, y) + "*" + std::to_string(k)
+                );
+            }
+            workbook.setCell(
+                name,
+                CPos(2, 1),
+                "=sum(A1:" + cell_name(1, height) + ")"
+            );
+        }
+        workbook.recalculate();
+    });
+    result.cells = (size_t)height * (sheets + 1);
+
+    for (int i = 0; i < 20; i++) {
+        measure(result, [&] {
+            workbook.setCell("Base", CPos(1, 1 + i), std::to_string(-i));
+            workbook.recalculate();
+            consume(workbook.getValue("S1", CPos(2, 1)));
+        });
+    }
+    return result;
+}
+
+// arithmetic heavy formulas over two inputs, edit one and read all of them,
+// either interpreted or compiled into machine code
+BenchResult bench_numeric(size_t scale, bool jit) {
+    BenchResult result {jit ? "numeric_jit" : "numeric"};
+    int height = (int)(10'000 * scale);
+    CSpreadsheet sheet;
+    sheet.setJit(jit);
+
+    measure_setup(result, [&] {
+        sheet.setCell(CPos(1, 1), "1");
+        sheet.setCell(CPos(2, 1), "2");
+        for (int y = 1; y <= height; y++) {
+            std::string n = std::to_string(y);
+            sheet.setCell(
+                CPos(3, y),
+                "=($A$1*" + n + "+$B$1)^2/($A$1+" + n + ")-if($B$1>" + n
+                    + ", $A$1*$B$1, -$B$1)+($A$1-$B$1)*($A$1-$B$1)"
+            );
+        }
+    });
+    result.cells = (size_t)height + 2;
+
+    for (int i = 0; i < 50; i++) {
+        measure(result, [&] {
+            sheet.setCell(CPos(1 + i % 2, 1), std::to_string(i));
+            for (int y = 1; y <= height; y++) {
+                consume(sheet.getValue(CPos(3, y)));
+            }
+        });
+    }
+    return result;
+}
+
+// a model of a few hundred cells over two inputs evaluated for many input
+// rows, either by setCell and getValue or as one batch of scenarios
+BenchResult bench_scenarios(size_t scale, bool batch) {
+    BenchResult result {batch ? "scenarios" : "scenarios_loop"};
+    int height = 500;
+    size_t count = 1'000 * scale;
+    CSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        sheet.setCell(CPos(1, 1), "1");
+        sheet.setCell(CPos(1, 2), "2");
+        sheet.setCell(CPos(2, 1), "=$A$1*$A$2");
+        for (int y = 2; y <= height; y++) {
+            sheet.setCell(
+                CPos(2, y),
+                "=if(" + cell_name(2, y - 1) + ">100, " + cell_name(2, y - 1)
+                    + "/2, " + cell_name(2, y - 1) + "+$A$1)"
+            );
+        }
+        sheet.setCell(CPos(3, 1), "=sum(B1:" + cell_name(2, height) + ")");
+    });
+    result.cells = (size_t)height + 3;
+
+    std::vector<CPos> inputs = {CPos(1, 1), CPos(1, 2)};
+    std::vector<CPos> outputs = {CPos(3, 1), CPos(2, height)};
+    std::vector<CValue> values;
+    for (size_t i = 0; i < count; i++) {
+        values.push_back(CValue((double)(i % 97)));
+        values.push_back(CValue((double)(i % 13)));
+    }
+    std::vector<CValue> results(count * outputs.size());
+
+    for (int i = 0; i < 5; i++) {
+        measure(result, [&] {
+            if (batch) {
+                sheet.evaluateScenarios(
+                    inputs,
+                    outputs,
+                    count,
+                    values.data(),
+                    results.data(),
+                    std::thread::hardware_concurrency()
+                );
+            } else {
+                for (size_t j = 0; j < count; j++) {
+                    for (size_t k = 0; k < inputs.size(); k++) {
+                        double value = std::get<double>(values[j * 2 + k]);
+                        sheet.setCell(inputs[k], std::to_string(value));
+                    }
+                    for (size_t k = 0; k < outputs.size(); k++) {
+                        results[j * 2 + k] = sheet.getValue(outputs[k]);
+                    }
+                }
+            }
+            consume(results.back());
+        });
+    }
+    return result;
+}
+
+// an edit followed by several readers each wanting a consistent view, with
+// copies of the sheet or with pinned versions
+BenchResult bench_readers(size_t scale, bool versioned) {
+    BenchResult result {versioned ? "readers_pinned" : "readers_copied"};
+    int height = (int)(10'000 * scale);
+    VersionedSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        sheet.edit([&](CSpreadsheet& head) {
+            for (int y = 1; y <= height; y++) {
+                head.setCell(CPos(1, y), std::to_string(y));
+                head.setCell(CPos(2, y), "=" + cell_name(1, y) + "*2");
+            }
+        });
+    });
+    result.cells = 2 * (size_t)height;
+
+    for (int i = 0; i < 50; i++) {
+        measure(result, [&] {
+            sheet.setCell(CPos(1, 1), std::to_string(i));
+            for (int reader = 0; reader < 8; reader++) {
+                if (versioned) {
+                    auto snapshot = sheet.pin();
+                    consume(snapshot->getValue(CPos(2, 1)));
+                } else {
+                    CSpreadsheet copy = sheet.edit([](CSpreadsheet& head) {
+                        return head;
+                    });
+                    consume(copy.getValue(CPos(2, 1)));
+                }
+            }
+        });
+    }
+    return result;
+}
+
+// save and load a sheet of numbers and short formulas
+BenchResult bench_save_load(size_t scale, bool compressed) {
+    BenchResult result {compressed ? "save_load_compressed" : "save_load"};
+    int cells = (int)(100'000 * scale);
+    int height = 10'000;
+    CSpreadsheet sheet;
+
+    measure_setup(result, [&] {
+        for (int i = 0; i < cells; i++) {
+            int x = 1 + i / height;
+            int y = 1 + i % height;
+            if (i % 2 == 0) {
+                sheet.setCell(CPos(x, y), std::to_string(i));
+            } else {
+                sheet.setCell(CPos(x, y), "=" + cell_name(x, y - 1) + "+1");
+            }
+        }
+    });
+    result.cells = (size_t)cells;
+
+    for (int i = 0; i < 3; i++) {
+        std::ostringstream oss;
+        bool saved = false;
+        measure(result, [&] {
+            saved = compressed ? sheet.saveCompressed(oss) : sheet.save(oss);
+        });
+        check(saved, "save");
+        result.bytes = oss.str().size();
+
+        std::istringstream iss(oss.str());
+        CSpreadsheet loaded;
+        bool success = false;
+        measure(result, [&] { success = loaded.load(iss); });
+        check(success, "load");
+    }
+    return result;
+}
+
+// clusters of cells forming a cycle, read them all, then break and restore
+// one cycle at a time
+BenchResult bench_cycles(size_t scale) {
+    BenchResult result {"cycles"};
+    int clusters = (int)(100 * scale);
+    int size = 100;
+    CSpreadsheet sheet;
+
+    auto link = [&](int x, int y) {
+        int next = y % size + 1;
+        return "=" + cell_name(x, next) + "+1";
+    };
+
+    measure_setup(result, [&] {
+        for (int x = 1; x <= clusters; x++) {
+            for (int y = 1; y <= size; y++) {
+                sheet.setCell(CPos(x, y), link(x, y));
+            }
+        }
+        for (int x = 1; x <= clusters; x++) {
+            for (int y = 1; y <= size; y++) {
+                consume(sheet.getValue(CPos(x, y)));
+            }
+        }
+    });
+    result.cells = (size_t)(clusters * size);
+
+    for (int x = 1; x <= clusters; x++) {
+        measure(result, [&] {
+            sheet.setCell(CPos(x, size), "1");
+            consume(sheet.getValue(CPos(x, 1)));
+            sheet.setCell(CPos(x, size), link(x, size));
+            consume(sheet.getValue(CPos(x, 1)));
+        });
+    }
+    return result;
+}
+
+double percentile(std::vector<double> sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(p * (double)(sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void print_result(const BenchResult& result, bool last) {
+    std::vector<double> sorted = result.latencies;
+    std::sort(sorted.begin(), sorted.end());
+
+    double total = 0;
+    for (double latency : sorted) {
+        total += latency;
+    }
+
+    double throughput = total > 0 ? (double)sorted.size() / total : 0;
+
+    std::cout << "    {\"name\": \"" << result.name << "\", "
+              << "\"cells\": " << result.cells << ", "
+              << "\"bytes\": " << result.bytes << ", "
+              << "\"setup_seconds\": " << result.setup_seconds << ", "
+              << "\"ops\": " << sorted.size() << ", "
+              << "\"seconds\": " << total << ", "
+              << "\"ops_per_second\": " << throughput << ", "
+              << "\"latency_us\": {"
+              << "\"p50\": " << percentile(sorted, 0.50) * 1e6 << ", "
+              << "\"p90\": " << percentile(sorted, 0.90) * 1e6 << ", "
+              << "\"p99\": " << percentile(sorted, 0.99) * 1e6 << ", "
+              << "\"max\": " << percentile(sorted, 1.0) * 1e6 << "}, "
+              << "\"peak_rss_kb\": " << result.peak_rss_kb << "}"
+              << (last ? "" : ",") << "\n";
+}
+
+void* run_benchmarks(void* arg) {
+    const BenchOptions& options = *(const BenchOptions*)arg;
+
+    std::vector<std::pair<std::string, std::function<BenchResult(size_t)>>>
+        workloads = {
+            {"chain", bench_chain},
+            {"fanout", bench_fanout},
+            {"hot_edits", bench_hot_edits},
+            {"range_sum", bench_range_sum},
+            {"copy_rect", bench_copy_rect},
+            {"insert_rows", bench_insert_rows},
+            {"workbook", bench_workbook},
+            {"read_rect", [](size_t s) { return bench_read_rect(s, false); }},
+            {"read_rect_bulk",
+             [](size_t s) { return bench_read_rect(s, true); }},
+            {"numeric", [](size_t s) { return bench_numeric(s, false); }},
+            {"numeric_jit", [](size_t s) { return bench_numeric(s, true); }},
+            {"scenarios_loop",
+             [](size_t s) { return bench_scenarios(s, false); }},
+            {"scenarios", [](size_t s) { return bench_scenarios(s, true); }},
+            {"readers_copied",
+             [](size_t s) { return bench_readers(s, false); }},
+            {"readers_pinned",
+             [](size_t s) { return bench_readers(s, true); }},
+            {"save_load", [](size_t s) { return bench_save_load(s, false); }},
+            {"save_load_compressed",
+             [](size_t s) { return bench_save_load(s, true); }},
+            {"cycles", bench_cycles},
+        };
+
+    std::vector<BenchResult> results;
+    for (auto& [name, fun] : workloads) {
+        if (!options.only.empty() && options.only != name) {
+            continue;
+        }
+        results.push_back(fun(options.scale));
+        // peak of the whole process so far
+        results.back().peak_rss_kb = peak_rss_kb();
+    }
+
+    std::cout << "{\n  \"scale\": " << options.scale << ",\n"
+              << "  \"workloads\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        print_result(results[i], i + 1 == results.size());
+    }
+    std::cout << "  ],\n  \"peak_rss_kb\": " << peak_rss_kb() << "\n}\n";
+
+    return nullptr;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--scale" && i + 1 < argc) {
+            options.scale = std::stoul(argv[++i]);
+        } else if (arg == "--only" && i + 1 < argc) {
+            options.only = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--scale N] [--only NAME]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // evaluation is recursive, long dependency chains need a large stack
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, (size_t)1 << 30);
+
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, run_benchmarks, &options) != 0) {
+        std::cerr << "failed to create benchmark thread" << std::endl;
+        return EXIT_FAILURE;
+    }
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attr);
+
+    return EXIT_SUCCESS;
+}
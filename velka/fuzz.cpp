@@ -0,0 +1,621 @@
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <sstream>
+
+#include "velka.cpp"
+
+namespace baseline {
+#include "fuzz_reference.cpp"
+}
+
+// differential test of the engines of velka, runs the operations generated
+// by fuzz.py on every engine and compares the values they give with the
+// baseline implementation, the time each engine spent is printed as JSON
+//
+// the engines have one sheet, s, the workbook has a second one, t, reading
+// s, which the reference keeps right of the column FUZZ_SECOND_SHEET
+//
+// usage: velka/fuzz [seed] [ops]
+
+using Clock = std::chrono::steady_clock;
+
+// the rectangle compared by check, one row and column more than fuzz.py
+// writes to
+constexpr int FUZZ_WIDTH = 9;
+constexpr int FUZZ_HEIGHT = 13;
+// the reference keeps the second sheet right of this column, SECOND_SHEET of
+// fuzz.py
+constexpr int FUZZ_SECOND_SHEET = 1000;
+
+// an operation generated by fuzz.py
+struct FuzzOp {
+    enum Kind {
+        // set a to contents b
+        SET_CELL,
+        // copy the w x h rectangle at b to a
+        COPY_RECT,
+        ROUND_TRIP,
+        // compare all engines with the reference
+        CHECK,
+        // compare evaluateScenarios giving a the number b with setCell
+        SCENARIO,
+        // set a of the second sheet to contents b, which the reference sees
+        // as c
+        SET_SHEET_CELL,
+        // copy the w x h rectangle at b to a in the second sheet
+        COPY_SHEET_RECT,
+        // insert or delete h rows or columns at w of the sheet a
+        INSERT_ROWS,
+        DELETE_ROWS,
+        INSERT_COLUMNS,
+        DELETE_COLUMNS,
+    };
+
+    Kind kind;
+    const char* a;
+    const char* b;
+    int w;
+    int h;
+    const char* c;
+};
+
+// one way of computing the values of a sheet
+struct FuzzEngine {
+    std::string name;
+    std::function<void(CPos, const std::string&)> set;
+    std::function<void(CPos, CPos, int, int)> copy;
+    // insert or delete rows or columns as the op says
+    std::function<void(const FuzzOp&)> axes;
+    // save the sheet and load it back
+    std::function<bool()> round_trip;
+    // read the FUZZ_WIDTH x FUZZ_HEIGHT rectangle at A1 in column major order
+    std::function<void(CValue*)> read;
+    double seconds = 0;
+};
+
+bool fuzz_same(const CValue& a, const CValue& b) {
+    if (a.index() != b.index()) {
+        return false;
+    }
+    if (!std::holds_alternative<double>(a)) {
+        return a == b;
+    }
+    double x = std::get<double>(a);
+    double y = std::get<double>(b);
+    if (std::isnan(x) || std::isnan(y)) {
+        return std::isnan(x) && std::isnan(y);
+    }
+    return x == y || std::fabs(x - y) <= 1e-9 * std::max(std::fabs(x), 1.0);
+}
+
+std::string fuzz_format(const CValue& value) {
+    switch (value.index()) {
+        case 0:
+            return "undefined";
+        case 1: {
+            std::ostringstream os;
+            os.precision(17);
+            os << std::get<double>(value);
+            return os.str();
+        }
+        default:
+            return "\"" + std::get<std::string>(value) + "\"";
+    }
+}
+
+class FuzzRunner {
+    // engines[0] is the reference
+    std::vector<FuzzEngine> engines;
+
+    baseline::CSpreadsheet reference;
+    CSpreadsheet jit;
+    CSpreadsheet bulk;
+    // bulk as of its last round trip, deltas are loaded into it
+    CSpreadsheet bulk_saved;
+    CWorkbook workbook;
+    VersionedSpreadsheet versioned;
+    CSpreadsheet history;
+    CSpreadsheet scenarios;
+
+    // seed of fuzz.py, printed with the results
+    unsigned seed;
+    size_t ops = 0;
+    size_t checks = 0;
+    double scenario_seconds = 0;
+    double scenario_reference_seconds = 0;
+
+    template<typename F>
+    void timed(double& seconds, F fun) {
+        auto start = Clock::now();
+        fun();
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        seconds += elapsed.count();
+    }
+
+    static baseline::CPos to_baseline(CPos pos) {
+        return baseline::CPos(pos.x, pos.y);
+    }
+
+    static baseline::CPos second_sheet(CPos pos) {
+        return baseline::CPos(FUZZ_SECOND_SHEET + pos.x, pos.y);
+    }
+
+    template<typename S, typename P = CPos>
+    static void read_cells(S& sheet, CValue* out) {
+        for (int x = 0; x < FUZZ_WIDTH; x++) {
+            for (int y = 0; y < FUZZ_HEIGHT; y++) {
+                out[x * FUZZ_HEIGHT + y] = sheet.getValue(P(x + 1, y + 1));
+            }
+        }
+    }
+
+    // position in the reference of the i-th cell read by read_cells from
+    // the sheet right of column
+    static baseline::CPos reference_pos(size_t i, int column = 0) {
+        return baseline::CPos(
+            column + (int)(i / FUZZ_HEIGHT) + 1,
+            (int)(i % FUZZ_HEIGHT) + 1
+        );
+    }
+
+    // the axis edit of op on sheet, or on the sheet named by name of a
+    // workbook
+    template<typename S, typename... Name>
+    static bool change_axes(S& sheet, const FuzzOp& op, Name... name) {
+        switch (op.kind) {
+            case FuzzOp::INSERT_ROWS:
+                return sheet.insertRows(name..., op.w, op.h);
+            case FuzzOp::DELETE_ROWS:
+                return sheet.deleteRows(name..., op.w, op.h);
+            case FuzzOp::INSERT_COLUMNS:
+                return sheet.insertColumns(name..., op.w, op.h);
+            case FuzzOp::DELETE_COLUMNS:
+                return sheet.deleteColumns(name..., op.w, op.h);
+            default:
+                return false;
+        }
+    }
+
+    // the axis edit of op on the columns of the reference kept for the first
+    // or the second sheet, they are split halfway to FUZZ_SECOND_SHEET, so
+    // that copies moving references of the second sheet left of its first
+    // column and inserted columns moving cells of the first sheet right
+    // don't carry them into the other sheet
+    void shift_reference(const FuzzOp& op, bool second) {
+        int split = FUZZ_SECOND_SHEET / 2;
+        bool columns = op.kind == FuzzOp::INSERT_COLUMNS
+            || op.kind == FuzzOp::DELETE_COLUMNS;
+        bool insert = op.kind == FuzzOp::INSERT_ROWS
+            || op.kind == FuzzOp::INSERT_COLUMNS;
+        reference.shift(
+            columns,
+            op.w + (second && columns ? FUZZ_SECOND_SHEET : 0),
+            insert ? op.h : -op.h,
+            second ? split : INT_MIN,
+            second ? INT_MAX : split - 1
+        );
+    }
+
+    template<typename S>
+    static bool reload(S& sheet) {
+        std::ostringstream os;
+        if (!sheet.save(os)) {
+            return false;
+        }
+        S loaded;
+        std::istringstream is(os.str());
+        if (!loaded.load(is)) {
+            return false;
+        }
+        sheet = std::move(loaded);
+        return true;
+    }
+
+    // the cells of cycles of the reference and the cells reading them
+    struct Cycles {
+        std::set<baseline::CPos> members;
+        std::set<baseline::CPos> readers;
+
+        explicit Cycles(const baseline::CSpreadsheet& reference):
+            members(reference.cycle_members()),
+            readers(reference.reading_cycles()) {}
+    };
+
+    // compare the values read by an engine of velka with the reference, the
+    // cells of cycles have to be undefined and the cells reading them, which
+    // the baseline gives other values by design, have to be what velka gives
+    // them in a plain sheet
+    void compare(
+        const std::string& engine,
+        const std::vector<CValue>& expected,
+        const std::vector<CValue>& velka,
+        const std::vector<CValue>& actual,
+        const Cycles& cycles,
+        int column = 0
+    ) {
+        for (size_t i = 0; i < actual.size(); i++) {
+            baseline::CPos at = reference_pos(i, column);
+            CPos pos(at.x - column, at.y);
+            if (cycles.members.count(at)) {
+                if (!fuzz_same(UNDEFINED, actual[i])) {
+                    mismatch(engine, "cycle", pos, UNDEFINED, actual[i]);
+                }
+            } else if (cycles.readers.count(at)) {
+                if (!fuzz_same(velka[i], actual[i])) {
+                    mismatch(engine, "cycle reader", pos, velka[i], actual[i]);
+                }
+            } else if (!fuzz_same(expected[i], actual[i])) {
+                mismatch(engine, "value", pos, expected[i], actual[i]);
+            }
+        }
+    }
+
+    [[noreturn]] void mismatch(
+        const std::string& engine,
+        const std::string& what,
+        CPos pos,
+        const CValue& expected,
+        const CValue& actual
+    ) {
+        std::cerr << "seed " << seed << ", op " << ops << ": " << engine
+                  << " " << what << " at (" << pos.x << ", " << pos.y
+                  << ") gave " << fuzz_format(actual) << ", expected "
+                  << fuzz_format(expected) << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+  public:
+    explicit FuzzRunner(unsigned seed): seed(seed) {
+        jit.setJit(true);
+        workbook.addSheet("s");
+        workbook.addSheet("t");
+
+        engines.push_back({
+            "reference",
+            [&](CPos pos, const std::string& contents) {
+                if (!contents.empty()) {
+                    reference.setCell(to_baseline(pos), contents);
+                }
+            },
+            [&](CPos dst, CPos src, int w, int h) {
+                reference.copyRect(to_baseline(dst), to_baseline(src), w, h);
+            },
+            [&](const FuzzOp& op) { shift_reference(op, false); },
+            [&] { return reload(reference); },
+            [&](CValue* out) {
+                read_cells<baseline::CSpreadsheet, baseline::CPos>(
+                    reference,
+                    out
+                );
+            },
+        });
+        engines.push_back({
+            "jit",
+            [&](CPos pos, const std::string& contents) {
+                jit.setCell(pos, contents);
+            },
+            [&](CPos dst, CPos src, int w, int h) {
+                jit.copyRect(dst, src, w, h);
+            },
+            [&](const FuzzOp& op) { change_axes(jit, op); },
+            [&] {
+                std::ostringstream os;
+                if (!jit.saveCompressed(os)) {
+                    return false;
+                }
+                CSpreadsheet loaded;
+                std::istringstream is(os.str());
+                if (!loaded.load(is)) {
+                    return false;
+                }
+                jit = std::move(loaded);
+                jit.setJit(true);
+                return true;
+            },
+            [&](CValue* out) { read_cells(jit, out); },
+        });
+        engines.push_back({
+            "bulk",
+            [&](CPos pos, const std::string& contents) {
+                bulk.setCell(pos, contents);
+            },
+            [&](CPos dst, CPos src, int w, int h) {
+                bulk.copyRect(dst, src, w, h);
+            },
+            [&](const FuzzOp& op) { change_axes(bulk, op); },
+            [&] {
+                // deltas can't follow inserted or deleted rows or columns,
+                // a full save is loaded after them
+                std::ostringstream os;
+                if (!bulk.saveDelta(os)) {
+                    os.str("");
+                    if (!bulk.save(os)) {
+                        return false;
+                    }
+                }
+                if (!bulk_saved.load(std::string_view(os.str()))) {
+                    return false;
+                }
+                bulk = bulk_saved;
+                return true;
+            },
+            [&](CValue* out) {
+                bulk.getValues(CPos(1, 1), FUZZ_WIDTH, FUZZ_HEIGHT, out);
+            },
+        });
+        engines.push_back({
+            "workbook",
+            [&](CPos pos, const std::string& contents) {
+                workbook.setCell("s", pos, contents);
+            },
+            [&](CPos dst, CPos src, int w, int h) {
+                workbook.copyRect("s", dst, src, w, h);
+            },
+            [&](const FuzzOp& op) { change_axes(workbook, op, "s"); },
+            [&] {
+                std::ostringstream os;
+                if (!workbook.save(os)) {
+                    return false;
+                }
+                std::istringstream is(os.str());
+                return workbook.load(is);
+            },
+            [&](CValue* out) {
+                workbook.recalculate();
+                for (int x = 0; x < FUZZ_WIDTH; x++) {
+                    for (int y = 0; y < FUZZ_HEIGHT; y++) {
+                        out[x * FUZZ_HEIGHT + y] =
+                            workbook.getValue("s", CPos(x + 1, y + 1));
+                    }
+                }
+            },
+        });
+        engines.push_back({
+            "versioned",
+            [&](CPos pos, const std::string& contents) {
+                versioned.setCell(pos, contents);
+            },
+            [&](CPos dst, CPos src, int w, int h) {
+                versioned.copyRect(dst, src, w, h);
+            },
+            [&](const FuzzOp& op) {
+                versioned.edit([&](CSpreadsheet& head) {
+                    return change_axes(head, op);
+                });
+            },
+            [&] {
+                return versioned.edit([](CSpreadsheet& head) {
+                    return reload(head);
+                });
+            },
+            [&](CValue* out) {
+                auto snapshot = versioned.pin();
+                snapshot->getValues(CPos(1, 1), FUZZ_WIDTH, FUZZ_HEIGHT, out);
+            },
+        });
+        engines.push_back({
+            "history",
+            // every edit is undone and redone
+            [&](CPos pos, const std::string& contents) {
+                if (history.setCell(pos, contents)) {
+                    history.undo();
+                    history.redo();
+                }
+            },
+            [&](CPos dst, CPos src, int w, int h) {
+                history.copyRect(dst, src, w, h);
+                history.undo();
+                history.redo();
+            },
+            [&](const FuzzOp& op) { change_axes(history, op); },
+            [&] { return reload(history); },
+            [&](CValue* out) { read_cells(history, out); },
+        });
+    }
+
+    void run(const FuzzOp& op) {
+        switch (op.kind) {
+            case FuzzOp::SET_CELL:
+                setCell(op.a, op.b);
+                break;
+            case FuzzOp::COPY_RECT:
+                copyRect(op.a, op.b, op.w, op.h);
+                break;
+            case FuzzOp::ROUND_TRIP:
+                roundTrip();
+                break;
+            case FuzzOp::CHECK:
+                check();
+                break;
+            case FuzzOp::SCENARIO:
+                scenario(op.a, std::stod(op.b));
+                break;
+            case FuzzOp::SET_SHEET_CELL:
+                setSheetCell(op.a, op.b, op.c);
+                break;
+            case FuzzOp::COPY_SHEET_RECT:
+                copySheetRect(op.a, op.b, op.w, op.h);
+                break;
+            case FuzzOp::INSERT_ROWS:
+            case FuzzOp::DELETE_ROWS:
+            case FuzzOp::INSERT_COLUMNS:
+            case FuzzOp::DELETE_COLUMNS:
+                changeAxes(op);
+                break;
+        }
+    }
+
+    void setCell(std::string_view pos, const std::string& contents) {
+        ops++;
+        for (FuzzEngine& engine : engines) {
+            timed(engine.seconds, [&] { engine.set(CPos(pos), contents); });
+        }
+        scenarios.setCell(CPos(pos), contents);
+    }
+
+    void copyRect(std::string_view dst, std::string_view src, int w, int h) {
+        ops++;
+        for (FuzzEngine& engine : engines) {
+            timed(engine.seconds, [&] {
+                engine.copy(CPos(dst), CPos(src), w, h);
+            });
+        }
+        scenarios.copyRect(CPos(dst), CPos(src), w, h);
+    }
+
+    // the second sheet is only in the workbook, its time isn't counted
+    void setSheetCell(
+        std::string_view pos,
+        const std::string& contents,
+        const std::string& reference_contents
+    ) {
+        ops++;
+        workbook.setCell("t", CPos(pos), contents);
+        if (!contents.empty()) {
+            reference.setCell(
+                second_sheet(CPos(pos)),
+                reference_contents
+            );
+        }
+    }
+
+    void copySheetRect(std::string_view dst, std::string_view src, int w,
+                       int h) {
+        ops++;
+        workbook.copyRect("t", CPos(dst), CPos(src), w, h);
+        reference.copyRect(
+            second_sheet(CPos(dst)),
+            second_sheet(CPos(src)),
+            w,
+            h
+        );
+    }
+
+    void changeAxes(const FuzzOp& op) {
+        ops++;
+        if (std::string_view(op.a) == "t") {
+            change_axes(workbook, op, "t");
+            shift_reference(op, true);
+            return;
+        }
+        for (FuzzEngine& engine : engines) {
+            timed(engine.seconds, [&] { engine.axes(op); });
+        }
+        change_axes(scenarios, op);
+    }
+
+    void roundTrip() {
+        ops++;
+        for (FuzzEngine& engine : engines) {
+            bool loaded = false;
+            timed(engine.seconds, [&] { loaded = engine.round_trip(); });
+            if (!loaded) {
+                std::cerr << "seed " << seed << ", op " << ops << ": "
+                          << engine.name << " round trip failed" << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    void check() {
+        checks++;
+        std::vector<std::vector<CValue>> values(engines.size());
+        for (size_t e = 0; e < engines.size(); e++) {
+            values[e].resize(FUZZ_WIDTH * FUZZ_HEIGHT);
+            timed(engines[e].seconds, [&] {
+                engines[e].read(values[e].data());
+            });
+        }
+        // the cells reading cycles are compared with jit
+        Cycles cycles(reference);
+        for (size_t e = 1; e < engines.size(); e++) {
+            compare(engines[e].name, values[0], values[1], values[e], cycles);
+        }
+
+        // nothing but the workbook has the second sheet to compare the cells
+        // reading cycles with
+        std::vector<CValue> expected(FUZZ_WIDTH * FUZZ_HEIGHT);
+        std::vector<CValue> actual(FUZZ_WIDTH * FUZZ_HEIGHT);
+        for (int x = 0; x < FUZZ_WIDTH; x++) {
+            for (int y = 0; y < FUZZ_HEIGHT; y++) {
+                expected[x * FUZZ_HEIGHT + y] =
+                    reference.getValue(second_sheet(CPos(x + 1, y + 1)));
+                actual[x * FUZZ_HEIGHT + y] =
+                    workbook.getValue("t", CPos(x + 1, y + 1));
+            }
+        }
+        compare("workbook t", expected, actual, actual, cycles,
+                FUZZ_SECOND_SHEET);
+    }
+
+    // compare evaluateScenarios with setting input to value on a copy of
+    // the reference
+    void scenario(std::string_view input, double value) {
+        ops++;
+        std::vector<CPos> outputs;
+        for (int x = 0; x < FUZZ_WIDTH; x++) {
+            for (int y = 0; y < FUZZ_HEIGHT; y++) {
+                outputs.push_back(CPos(x + 1, y + 1));
+            }
+        }
+
+        std::vector<CValue> expected(outputs.size());
+        baseline::CSpreadsheet copy = reference;
+        timed(scenario_reference_seconds, [&] {
+            copy.setCell(baseline::CPos(input), std::to_string(value));
+            read_cells<baseline::CSpreadsheet, baseline::CPos>(
+                copy,
+                expected.data()
+            );
+        });
+
+        std::vector<CValue> actual(outputs.size());
+        CValue boxed(value);
+        timed(scenario_seconds, [&] {
+            scenarios.evaluateScenarios(
+                {CPos(input)},
+                outputs,
+                1,
+                &boxed,
+                actual.data()
+            );
+        });
+        // the cells reading cycles are compared with setting the input of
+        // a copy of the engine
+        std::vector<CValue> velka(outputs.size());
+        CSpreadsheet direct = scenarios;
+        direct.setCell(CPos(input), std::to_string(value));
+        read_cells(direct, velka.data());
+        compare("scenarios", expected, velka, actual, Cycles(copy));
+    }
+
+    void print() const {
+        std::cout << "{\n  \"seed\": " << seed << ",\n  \"ops\": " << ops
+                  << ",\n  \"checks\": " << checks << ",\n  \"engines\": [\n";
+        for (const FuzzEngine& engine : engines) {
+            std::cout << "    {\"name\": \"" << engine.name
+                      << "\", \"seconds\": " << engine.seconds << "},\n";
+        }
+        std::cout << "    {\"name\": \"scenarios_reference\", \"seconds\": "
+                  << scenario_reference_seconds << "},\n"
+                  << "    {\"name\": \"scenarios\", \"seconds\": "
+                  << scenario_seconds << "}\n  ]\n}\n";
+    }
+};
+
+// FUZZ_OPS and FUZZ_SEED, generated by fuzz.py into the file velka/fuzz
+// names
+#ifndef VELKA_FUZZ_OPS
+    #error "VELKA_FUZZ_OPS has to name the operations generated by fuzz.py"
+#endif
+#include VELKA_FUZZ_OPS
+
+int main() {
+    FuzzRunner runner(FUZZ_SEED);
+    for (const FuzzOp& op : FUZZ_OPS) {
+        runner.run(op);
+    }
+    runner.print();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+import sys
+import json
+import random
+import re
+
+# generates the operations of a differential test of velka, see velka/fuzz
+#
+# usage: fuzz.py [seed] [ops]
+
+COLUMNS = 'ABCDEFGH'
+ROWS = 12
+DEPTH = 3
+OPS = 2000
+# the second sheet of the workbook, t, reads the first one, s, the reference
+# keeps it right of this column, FUZZ_SECOND_SHEET of fuzz.cpp
+SECOND_SHEET = 1000
+
+# references of the cells of t are local or into s
+SHEET_PREFIXES = ['', 's!']
+
+def make_ref(prefixes: list[str]) -> str:
+    column = random.choice(COLUMNS)
+    row = random.randint(1, ROWS)
+    return (
+        random.choice(prefixes)
+        + ('$' if random.random() < 0.2 else '') + column
+        + ('$' if random.random() < 0.2 else '') + str(row)
+    )
+
+def make_range(prefixes: list[str]) -> str:
+    a = random.randint(0, len(COLUMNS) - 1)
+    b = random.randint(a, min(a + 3, len(COLUMNS) - 1))
+    y = random.randint(1, ROWS)
+    h = random.randint(y, min(y + 3, ROWS))
+    return f'{random.choice(prefixes)}{COLUMNS[a]}{y}:{COLUMNS[b]}{h}'
+
+def make_number() -> str:
+    if random.random() < 0.7:
+        return str(random.randint(-5, 20))
+    return str(round(random.uniform(-10, 10), 2))
+
+def make_atom(prefixes: list[str]) -> str:
+    r = random.random()
+    if r < 0.55:
+        return make_ref(prefixes)
+    if r < 0.9:
+        return make_number()
+    return '"' + random.choice(['a', 'ab', 'x1']) + '"'
+
+def make_expr(depth: int, prefixes: list[str]) -> str:
+    if depth == 0 or random.random() < 0.3:
+        return make_atom(prefixes)
+
+    r = random.random()
+    if r < 0.45:
+        op = random.choice(['+', '+', '-', '*', '*', '/', '^', '=', '<>', '<',
+                            '<=', '>', '>='])
+        a = make_expr(depth - 1, prefixes)
+        b = make_expr(depth - 1, prefixes)
+        return f'({a} {op} {b})'
+    if r < 0.5:
+        return f'-{make_expr(depth - 1, prefixes)}'
+    if r < 0.75:
+        fn = random.choice(['sum', 'count', 'min', 'max'])
+        return f'{fn}({make_range(prefixes)})'
+    if r < 0.85:
+        return f'countval({make_atom(prefixes)}, {make_range(prefixes)})'
+    cond = make_expr(depth - 1, prefixes)
+    a = make_expr(depth - 1, prefixes)
+    b = make_expr(depth - 1, prefixes)
+    return f'if({cond}, {a}, {b})'
+
+def make_contents(prefixes: list[str]) -> str:
+    r = random.random()
+    if r < 0.25:
+        return make_number()
+    if r < 0.3:
+        return random.choice(['text', 'a', ''])
+    return '=' + make_expr(DEPTH, prefixes)
+
+def column_name(x: int) -> str:
+    name = ''
+    while x > 0:
+        x, digit = divmod(x - 1, 26)
+        name = chr(ord('A') + digit) + name
+    return name
+
+# contents of a cell of t as the reference sees it, the strings of make_atom
+# and make_contents are lowercase, so they don't look like references
+def reference_contents(contents: str) -> str:
+    def corner(absolute_x: str, column: str, absolute_y: str, row: str,
+               local: bool) -> str:
+        x = ord(column) - ord('A') + 1 + (SECOND_SHEET if local else 0)
+        return absolute_x + column_name(x) + absolute_y + row
+
+    def move(m: re.Match) -> str:
+        local = m.group(1) is None
+        ref = corner(*m.group(2, 3, 4, 5), local)
+        if m.group(6) is not None:
+            ref += ':' + corner(*m.group(7, 8, 9, 10), local)
+        return ref
+
+    corner_re = r'(\$?)([A-Z])(\$?)(\d+)'
+    return re.sub(f'(s!)?{corner_re}(:{corner_re})?', move, contents)
+
+def make_pos() -> str:
+    return random.choice(COLUMNS) + str(random.randint(1, ROWS))
+
+def emit(kind: str, a: str = '', b: str = '', w: int = 0, h: int = 0,
+         c: str = ''):
+    a = json.dumps(a)
+    b = json.dumps(b)
+    c = json.dumps(c)
+    print(f'    {{FuzzOp::{kind}, {a}, {b}, {w}, {h}, {c}}},')
+
+def set_cell(second: bool, pos: str, contents: str):
+    if second:
+        emit('SET_SHEET_CELL', pos, contents, c=reference_contents(contents))
+    else:
+        emit('SET_CELL', pos, contents)
+
+def make_set():
+    emit('SET_CELL', make_pos(), make_contents(['']))
+
+def make_sheet_set():
+    set_cell(True, make_pos(), make_contents(SHEET_PREFIXES))
+
+def make_cycle():
+    second = random.random() < 0.2
+    a = make_pos()
+    b = make_pos()
+    set_cell(second, a, f'={b}+1')
+    set_cell(second, b, f'={a}*2')
+
+def make_axes():
+    kind = random.choice(['INSERT_ROWS', 'DELETE_ROWS', 'INSERT_COLUMNS',
+                          'DELETE_COLUMNS'])
+    sheet = 't' if random.random() < 0.3 else 's'
+    at = random.randint(1, ROWS if kind.endswith('ROWS') else len(COLUMNS))
+    emit(kind, sheet, '', at, random.randint(1, 2))
+
+def make_copy():
+    w = random.randint(1, 4)
+    h = random.randint(1, 4)
+    src = random.choice(COLUMNS[:len(COLUMNS) - w + 1]) \
+        + str(random.randint(1, ROWS - h + 1))
+    dst = random.choice(COLUMNS[:len(COLUMNS) - w + 1]) \
+        + str(random.randint(1, ROWS - h + 1))
+    emit('COPY_SHEET_RECT' if random.random() < 0.2 else 'COPY_RECT', dst,
+         src, w, h)
+
+def make_scenario():
+    emit('SCENARIO', make_pos(), str(random.randint(-5, 20)))
+
+seed = int(sys.argv[1]) if len(sys.argv) > 1 else random.randrange(1 << 32)
+ops = int(sys.argv[2]) if len(sys.argv) > 2 else OPS
+random.seed(seed)
+
+print(f'// generated by velka/fuzz.py {seed} {ops}')
+print(f'const unsigned FUZZ_SEED = {seed};')
+print()
+print('const FuzzOp FUZZ_OPS[] = {')
+for i in range(ops):
+    r = random.random()
+    if r < 0.6:
+        make_set()
+    elif r < 0.68:
+        make_sheet_set()
+    elif r < 0.72:
+        make_cycle()
+    elif r < 0.84:
+        make_copy()
+    elif r < 0.87:
+        emit('ROUND_TRIP')
+    elif r < 0.9:
+        make_axes()
+    else:
+        make_scenario()
+    if i % 8 == 7:
+        emit('CHECK')
+emit('CHECK')
+print('};')
@@ -1,6 +1,9 @@
 #include <cassert>
 #include <cfloat>
+#include <csignal>
+#include <fstream>
 #include <sstream>
+#include <sys/resource.h>
 
 #include "velka.cpp"
 
@@ -232,5 +235,991 @@ int main() {
     assert(valueMatch(x0.getValue(CPos("H12")), CValue(25.0)));
     assert(valueMatch(x0.getValue(CPos("H13")), CValue(-22.0)));
     assert(valueMatch(x0.getValue(CPos("H14")), CValue(-22.0)));
+
+    CSpreadsheet x2;
+    assert(x2.setCell(CPos("A1"), "1"));
+    assert(x2.setCell(CPos("A2"), "2"));
+    assert(x2.setCell(CPos("A3"), "=A1"));
+    assert(x2.setCell(CPos("A4"), "a"));
+    assert(x2.setCell(CPos("B1"), "=countval(1, $A$1:$A$5)"));
+    assert(x2.setCell(CPos("B2"), "=countval(2, $A$1:$A$5)"));
+    assert(x2.setCell(CPos("B3"), "=countval(\"a\", $A$1:$A$5)"));
+    x2.copyRect(CPos("C4"), CPos("B3"), 1, 1);
+    assert(valueMatch(x2.getValue(CPos("B1")), CValue(2.0)));
+    assert(valueMatch(x2.getValue(CPos("B2")), CValue(1.0)));
+    assert(valueMatch(x2.getValue(CPos("B3")), CValue(1.0)));
+    assert(valueMatch(x2.getValue(CPos("C4")), CValue(1.0)));
+    assert(x2.setCell(CPos("A1"), "2"));
+    assert(valueMatch(x2.getValue(CPos("B1")), CValue(0.0)));
+    assert(valueMatch(x2.getValue(CPos("B2")), CValue(3.0)));
+    x2.copyRect(CPos("A4"), CPos("Z9"), 1, 1);
+    assert(valueMatch(x2.getValue(CPos("B3")), CValue(0.0)));
+    assert(x2.setCell(CPos("A5"), "=countval(2, $A$1:$A$5)"));
+    assert(x2.setCell(CPos("A6"), "=countval(2, $A$1:$A$5)"));
+    assert(valueMatch(x2.getValue(CPos("B2")), CValue(3.0)));
+    assert(valueMatch(x2.getValue(CPos("A6")), CValue(3.0)));
+
+    CSpreadsheet x3;
+    assert(x3.setCell(CPos("A1"), "3"));
+    assert(x3.setCell(CPos("B1"), "4"));
+    assert(x3.setCell(CPos("D1"), "x"));
+    assert(x3.setCell(CPos("C1"), "=2^10*A1"));
+    assert(x3.setCell(CPos("C2"), "=(A1+B1)*(A1+B1)"));
+    assert(x3.setCell(CPos("C3"), "=(A1+B1)*(A1+B1) + (A1+B1)*(A1+B1)"));
+    assert(x3.setCell(CPos("C4"), "=\"a\"*1"));
+    assert(x3.setCell(CPos("C5"), "=-(-D1)"));
+    assert(x3.setCell(CPos("C6"), "=if(1, A1, 1/0)"));
+    assert(x3.setCell(CPos("C7"), "=if(\"a\", A1, B1)"));
+    assert(x3.setCell(CPos("C8"), "=D1*1"));
+    assert(x3.setCell(CPos("C9"), "=-(-(A1*B1))/1 - 0"));
+    assert(valueMatch(x3.getValue(CPos("C1")), CValue(3072.0)));
+    assert(valueMatch(x3.getValue(CPos("C2")), CValue(49.0)));
+    assert(valueMatch(x3.getValue(CPos("C3")), CValue(98.0)));
+    assert(valueMatch(x3.getValue(CPos("C4")), CValue()));
+    assert(valueMatch(x3.getValue(CPos("C5")), CValue()));
+    assert(valueMatch(x3.getValue(CPos("C6")), CValue(3.0)));
+    assert(valueMatch(x3.getValue(CPos("C7")), CValue()));
+    assert(valueMatch(x3.getValue(CPos("C8")), CValue()));
+    assert(valueMatch(x3.getValue(CPos("C9")), CValue(12.0)));
+    assert(x3.setCell(CPos("A1"), "5"));
+    assert(valueMatch(x3.getValue(CPos("C2")), CValue(81.0)));
+    assert(valueMatch(x3.getValue(CPos("C3")), CValue(162.0)));
+    x3.copyRect(CPos("C13"), CPos("C3"), 1, 1);
+    assert(x3.setCell(CPos("A11"), "1"));
+    assert(x3.setCell(CPos("B11"), "2"));
+    assert(valueMatch(x3.getValue(CPos("C13")), CValue(18.0)));
+    oss.clear();
+    oss.str("");
+    assert(x3.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("C3")), CValue(162.0)));
+    assert(valueMatch(x1.getValue(CPos("C13")), CValue(18.0)));
+
+    exprMatch(x3, "=D1+\"y\"", CValue("xy"));
+    exprMatch(x3, "=D1<\"y\"", CValue(1.0));
+    exprMatch(x3, "=D1=D1+\"\"", CValue(1.0));
+    exprMatch(x3, "=1+\"a\"", CValue("1.000000a"));
+    exprMatch(x3, "=countval(D1, D1:D2)", CValue(1.0));
+    exprMatch(x3, "=countval(-0, $E$1:$E$3)", CValue(0.0));
+    assert(x3.setCell(CPos("E1"), "0"));
+    exprMatch(x3, "=countval(-0, $E$1:$E$3)", CValue(1.0));
+
+    CSpreadsheet x4;
+    for (int i = 0; i < 2; i++) {
+        assert(x4.setCell(CPos("A1"), "=count(B1:B1)"));
+        assert(x4.setCell(CPos("B1"), "=A1"));
+        assert(x4.setCell(CPos("C1"), "=A1+1"));
+        assert(x4.setCell(CPos("C2"), "=count(A1:B1)"));
+        assert(x4.setCell(CPos("C3"), "=C3"));
+        // the result doesn't depend on which cell is read first
+        assert(valueMatch(x4.getValue(CPos(i == 0 ? "A1" : "B1")), CValue()));
+        assert(valueMatch(x4.getValue(CPos(i == 0 ? "B1" : "A1")), CValue()));
+        assert(valueMatch(x4.getValue(CPos("C1")), CValue()));
+        assert(valueMatch(x4.getValue(CPos("C2")), CValue(0.0)));
+        assert(valueMatch(x4.getValue(CPos("C3")), CValue()));
+    }
+    assert(x4.setCell(CPos("B1"), "5"));
+    assert(valueMatch(x4.getValue(CPos("A1")), CValue(1.0)));
+    assert(valueMatch(x4.getValue(CPos("C1")), CValue(2.0)));
+    assert(valueMatch(x4.getValue(CPos("C2")), CValue(2.0)));
+    assert(x4.setCell(CPos("B1"), "=C1"));
+    assert(valueMatch(x4.getValue(CPos("C2")), CValue(0.0)));
+    x4.copyRect(CPos("B1"), CPos("Z1"), 1, 1);
+    assert(valueMatch(x4.getValue(CPos("C1")), CValue(1.0)));
+
+    std::string journal_path = "/tmp/velka_journal_" + std::to_string(getpid());
+    auto remove_journal = [&] {
+        std::remove((journal_path + ".snapshot").c_str());
+        std::remove((journal_path + ".journal").c_str());
+    };
+    remove_journal();
+    {
+        JournaledSpreadsheet j1;
+        j1.group_commit_records = 2;
+        assert(j1.open(journal_path));
+        assert(j1.setCell(CPos("A1"), "10"));
+        assert(j1.setCell(CPos("A2"), "=A1*2"));
+        j1.copyRect(CPos("B1"), CPos("A1"), 1, 2);
+        // the copy wasn't synced yet, a crash loses it
+        JournaledSpreadsheet j2;
+        assert(j2.open(journal_path));
+        assert(valueMatch(j2.getValue(CPos("A2")), CValue(20.0)));
+        assert(valueMatch(j2.getValue(CPos("B2")), CValue()));
+        j2.close();
+
+        assert(j1.sync());
+        assert(j2.open(journal_path));
+        assert(valueMatch(j2.getValue(CPos("B2")), CValue(20.0)));
+        j2.close();
+
+        assert(j1.compact());
+        assert(j1.setCell(CPos("A1"), "1"));
+        assert(j1.setCell(CPos("C1"), "=\"x\"+B2"));
+        assert(j1.sync());
+        assert(j2.open(journal_path));
+        assert(valueMatch(j2.getValue(CPos("A2")), CValue(2.0)));
+        assert(valueMatch(j2.getValue(CPos("B2")), CValue(20.0)));
+        assert(valueMatch(j2.getValue(CPos("C1")), CValue("x20.000000")));
+    }
+    {
+        // a torn record at the end is dropped, its header is complete
+        std::ofstream journal(journal_path + ".journal", std::ios::app);
+        const char torn[] = "\x30\0\0\0garbage";
+        journal.write(torn, sizeof(torn) - 1);
+    }
+    {
+        JournaledSpreadsheet j3;
+        assert(j3.open(journal_path));
+        assert(valueMatch(j3.getValue(CPos("A2")), CValue(2.0)));
+        assert(j3.setCell(CPos("A1"), "3"));
+        // edits whose records can't be written aren't applied
+        j3.group_commit_records = 1;
+        rlimit unlimited;
+        assert(getrlimit(RLIMIT_FSIZE, &unlimited) == 0);
+        rlimit full = unlimited;
+        full.rlim_cur = 0;
+        signal(SIGXFSZ, SIG_IGN);
+        assert(setrlimit(RLIMIT_FSIZE, &full) == 0);
+        assert(!j3.setCell(CPos("A1"), "4"));
+        assert(!j3.copyRect(CPos("D1"), CPos("A1")));
+        assert(setrlimit(RLIMIT_FSIZE, &unlimited) == 0);
+        signal(SIGXFSZ, SIG_DFL);
+        assert(valueMatch(j3.getValue(CPos("A2")), CValue(6.0)));
+        assert(valueMatch(j3.getValue(CPos("D1")), CValue()));
+        assert(!j3.setCell(CPos("A1"), "=("));
+        j3.close();
+        assert(j3.open(journal_path));
+        assert(valueMatch(j3.getValue(CPos("A2")), CValue(6.0)));
+        assert(valueMatch(j3.getValue(CPos("D1")), CValue()));
+        assert(valueMatch(j3.getValue(CPos("C1")), CValue("x20.000000")));
+    }
+    remove_journal();
+
+    CSpreadsheet x5;
+    for (int y = 1; y <= 1000; y++) {
+        assert(x5.setCell(CPos(1, y), std::to_string(y)));
+    }
+    assert(x5.setCell(CPos("B1"), "=sum(A1:A1000)"));
+    std::ostringstream base;
+    assert(x5.save(base));
+    std::ostringstream empty_delta;
+    assert(x5.saveDelta(empty_delta));
+    assert(x5.setCell(CPos("A150"), "0"));
+    x5.copyRect(CPos("C1"), CPos("B1"));
+    std::ostringstream delta1;
+    assert(x5.saveDelta(delta1));
+    // only the changed chunks are written
+    assert(delta1.str().size() * 10 < base.str().size());
+    x5.copyRect(CPos("A3"), CPos("Z3"));
+    std::ostringstream delta2;
+    assert(x5.saveDelta(delta2));
+    {
+        CSpreadsheet layered;
+        iss.clear();
+        iss.str(base.str());
+        assert(layered.load(iss));
+        // deltas must be merged in order
+        iss.clear();
+        iss.str(delta1.str());
+        assert(!layered.load(iss));
+        for (auto* delta : {&empty_delta, &delta1, &delta2}) {
+            iss.clear();
+            iss.str(delta->str());
+            assert(layered.load(iss));
+        }
+        assert(valueMatch(layered.getValue(CPos("B1")), CValue(500347.0)));
+        assert(valueMatch(layered.getValue(CPos("C1")), CValue(500347.0)));
+        assert(valueMatch(layered.getValue(CPos("A3")), CValue()));
+        assert(valueMatch(layered.getValue(CPos("A150")), CValue(0.0)));
+    }
+
+    CSpreadsheet x6;
+    for (int y = 1; y <= 3000; y++) {
+        assert(x6.setCell(CPos(1, y), std::to_string(y * 0.5)));
+        assert(x6.setCell(CPos(2, y), "=A" + std::to_string(y) + "*$A$1+-1"));
+    }
+    assert(x6.setCell(CPos("C1"), "str\"ing"));
+    assert(x6.setCell(CPos("C2"), "=sum(B1:B3000)+C1"));
+    assert(x6.setCell(CPos("C3"), "=countval(C1, C1:C1)+countval(C1, C1:C1)"));
+    std::ostringstream plain;
+    assert(x6.save(plain));
+    for (unsigned threads : {1u, 4u}) {
+        std::ostringstream compressed;
+        assert(x6.saveCompressed(compressed, threads));
+        assert(compressed.str().size() * 4 < plain.str().size());
+        std::string data = compressed.str();
+
+        CSpreadsheet loaded;
+        iss.clear();
+        iss.str(data);
+        assert(loaded.load(iss));
+        assert(valueMatch(loaded.getValue(CPos("B3000")), CValue(749.0)));
+        assert(valueMatch(loaded.getValue(CPos("C3")), CValue(2.0)));
+        assert(valueMatch(loaded.getValue(CPos("A2")), CValue(1.0)));
+        assert(valueMatch(
+            loaded.getValue(CPos("C2")),
+            CValue(
+                std::to_string(0.5 * 0.5 * 3000 * 3001 / 2 - 3000)
+                + "str\"ing"
+            )
+        ));
+        // deltas can follow a compressed snapshot
+        assert(x6.setCell(CPos("A1"), "2"));
+        std::ostringstream delta;
+        assert(x6.saveDelta(delta));
+        iss.clear();
+        iss.str(delta.str());
+        assert(loaded.load(iss));
+        assert(valueMatch(loaded.getValue(CPos("B3000")), CValue(2999.0)));
+        assert(x6.setCell(CPos("A1"), "0.5"));
+
+        data[data.size() / 2] ^= 1;
+        iss.clear();
+        iss.str(data);
+        assert(!loaded.load(iss));
+        iss.clear();
+        iss.str(data.substr(0, 40));
+        assert(!loaded.load(iss));
+        // a block count far beyond the size of the index
+        std::string count = data;
+        count.replace(16, 4, "\xff\xff\xff\xff");
+        iss.clear();
+        iss.str(count);
+        assert(!loaded.load(iss));
+        // a cell count of the first block far beyond its size
+        std::string cells = compressed.str();
+        uint64_t total;
+        uint32_t first;
+        std::memcpy(&total, &cells[8], sizeof(total));
+        std::memcpy(&first, &cells[28], sizeof(first));
+        total += 0x7fffffff - first;
+        first = 0x7fffffff;
+        std::memcpy(&cells[8], &total, sizeof(total));
+        std::memcpy(&cells[28], &first, sizeof(first));
+        iss.clear();
+        iss.str(cells);
+        assert(!loaded.load(iss));
+    }
+    {
+        std::ostringstream empty;
+        assert(CSpreadsheet().saveCompressed(empty));
+        iss.clear();
+        iss.str(empty.str());
+        assert(x6.load(iss));
+        assert(valueMatch(x6.getValue(CPos("A1")), CValue()));
+    }
+
+    CSpreadsheet x7;
+    assert(x7.setCell(CPos("A1"), "1"));
+    assert(x7.setCell(CPos("B1"), "=A1*2"));
+    assert(x7.setCell(CPos("C1"), "=B1+1"));
+    assert(x7.setCell(CPos("D1"), "=countval(3, $A$1:$C$1)"));
+    assert(x7.setCell(CPos("D2"), "=countval(5, $A$1:$C$1)"));
+    assert(valueMatch(x7.getValue(CPos("C1")), CValue(3.0)));
+    assert(valueMatch(x7.getValue(CPos("D1")), CValue(1.0)));
+    assert(x7.setCell(CPos("A1"), "1"));
+    assert(valueMatch(x7.getValue(CPos("C1")), CValue(3.0)));
+    // edits which aren't read in between
+    assert(x7.setCell(CPos("A1"), "2"));
+    assert(x7.setCell(CPos("A1"), "3"));
+    assert(valueMatch(x7.getValue(CPos("D2")), CValue(0.0)));
+    assert(valueMatch(x7.getValue(CPos("D1")), CValue(1.0)));
+    assert(valueMatch(x7.getValue(CPos("C1")), CValue(7.0)));
+    x7.copyRect(CPos("A1"), CPos("Z1"));
+    assert(valueMatch(x7.getValue(CPos("C1")), CValue()));
+    assert(valueMatch(x7.getValue(CPos("D1")), CValue(0.0)));
+    assert(x7.setCell(CPos("A1"), "=2"));
+    assert(valueMatch(x7.getValue(CPos("D2")), CValue(1.0)));
+    assert(valueMatch(x7.getValue(CPos("C1")), CValue(5.0)));
+    assert(x7.setCell(CPos("E1"), "=F1"));
+    assert(x7.setCell(CPos("F1"), "=E1"));
+    assert(valueMatch(x7.getValue(CPos("E1")), CValue()));
+    assert(x7.setCell(CPos("G1"), "1"));
+    assert(valueMatch(x7.getValue(CPos("F1")), CValue()));
+    assert(x7.setCell(CPos("F1"), "=G1"));
+    assert(valueMatch(x7.getValue(CPos("E1")), CValue(1.0)));
+    // H1 leaves the cycle when I1 stops referencing it, I1 stays undefined
+    // but H1 has to be computed anyway
+    assert(x7.setCell(CPos("H1"), "=count(I1:I2)"));
+    assert(x7.setCell(CPos("I1"), "=H1+J1"));
+    assert(valueMatch(x7.getValue(CPos("H1")), CValue()));
+    assert(x7.setCell(CPos("I1"), "=J1"));
+    assert(valueMatch(x7.getValue(CPos("I1")), CValue()));
+    assert(valueMatch(x7.getValue(CPos("H1")), CValue(0.0)));
+    // histograms recount the cells depending on the edits since they were
+    // read
+    assert(x7.setCell(CPos("L1"), "1"));
+    for (int i = 1; i <= 50; i++) {
+        std::string row = std::to_string(i);
+        assert(x7.setCell(CPos("K" + row), "=$L$1+" + row));
+    }
+    assert(x7.setCell(CPos("M1"), "=countval(5, K1:K50)"));
+    assert(x7.setCell(CPos("M2"), "=countval(60, K1:K50)"));
+    assert(valueMatch(x7.getValue(CPos("M1")), CValue(1.0)));
+    assert(x7.setCell(CPos("L1"), "5"));
+    assert(x7.setCell(CPos("L1"), "10"));
+    assert(valueMatch(x7.getValue(CPos("M1")), CValue(0.0)));
+    assert(valueMatch(x7.getValue(CPos("M2")), CValue(1.0)));
+    assert(x7.setCell(CPos("K20"), "60"));
+    assert(valueMatch(x7.getValue(CPos("M2")), CValue(2.0)));
+    // removed positions are forgotten once they outnumber the cells, their
+    // dependents still see them become empty
+    for (int i = 1; i <= 3000; i++) {
+        assert(x7.setCell(CPos("N" + std::to_string(i)), "1"));
+    }
+    assert(x7.setCell(CPos("P1"), "=N5"));
+    assert(x7.setCell(CPos("P2"), "=N6"));
+    assert(valueMatch(x7.getValue(CPos("P1")), CValue(1.0)));
+    assert(valueMatch(x7.getValue(CPos("P2")), CValue(1.0)));
+    x7.copyRect(CPos("N1"), CPos("Q1"), 1, 3000);
+    assert(valueMatch(x7.getValue(CPos("P2")), CValue()));
+    assert(x7.setCell(CPos("N5"), "=Q1"));
+    assert(valueMatch(x7.getValue(CPos("P1")), CValue()));
+
+    CSpreadsheet x8;
+    assert(x8.setCell(CPos("A1"), "1"));
+    assert(x8.setCell(CPos("A2"), "2"));
+    assert(x8.setCell(CPos("A3"), "3"));
+    assert(x8.setCell(CPos("A4"), "=sum(A1:A3)"));
+    assert(x8.setCell(CPos("B1"), "=A3*10"));
+    assert(x8.setCell(CPos("C5"), "=A$2+$A1"));
+    assert(valueMatch(x8.getValue(CPos("A4")), CValue(6.0)));
+    assert(x8.insertRows(2));
+    assert(valueMatch(x8.getValue(CPos("A2")), CValue()));
+    assert(valueMatch(x8.getValue(CPos("A4")), CValue(3.0)));
+    assert(valueMatch(x8.getValue(CPos("B1")), CValue(30.0)));
+    assert(valueMatch(x8.getValue(CPos("C6")), CValue(3.0)));
+    assert(x8.setCell(CPos("A2"), "10"));
+    assert(x8.setCell(CPos("A6"), "=A3+A2"));
+    assert(valueMatch(x8.getValue(CPos("A5")), CValue(16.0)));
+    assert(valueMatch(x8.getValue(CPos("A6")), CValue(12.0)));
+    x8.copyRect(CPos("B2"), CPos("B1"));
+    assert(valueMatch(x8.getValue(CPos("B2")), CValue(160.0)));
+    assert(x8.insertColumns(1, 2));
+    assert(valueMatch(x8.getValue(CPos("C5")), CValue(16.0)));
+    assert(valueMatch(x8.getValue(CPos("D2")), CValue(160.0)));
+    assert(x8.setCell(CPos("A1"), "=C1+C2"));
+    assert(valueMatch(x8.getValue(CPos("A1")), CValue(11.0)));
+    std::ostringstream shifted;
+    assert(x8.save(shifted));
+    assert(!x8.saveDelta(shifted));
+    // the deleted row is referenced by D1 and the corner of the sum
+    assert(x8.deleteRows(4));
+    assert(valueMatch(x8.getValue(CPos("D1")), CValue()));
+    assert(valueMatch(x8.getValue(CPos("C4")), CValue()));
+    assert(valueMatch(x8.getValue(CPos("C5")), CValue(12.0)));
+    assert(x8.deleteColumns(1));
+    assert(valueMatch(x8.getValue(CPos("B5")), CValue(12.0)));
+    assert(valueMatch(x8.getValue(CPos("C1")), CValue()));
+    std::ostringstream deleted;
+    assert(x8.save(deleted));
+    for (auto* data : {&shifted, &deleted}) {
+        iss.clear();
+        iss.str(data->str());
+        assert(x8.load(iss));
+        if (data == &shifted) {
+            assert(valueMatch(x8.getValue(CPos("C5")), CValue(16.0)));
+            assert(valueMatch(x8.getValue(CPos("E6")), CValue(3.0)));
+            assert(valueMatch(x8.getValue(CPos("A1")), CValue(11.0)));
+        } else {
+            assert(valueMatch(x8.getValue(CPos("B5")), CValue(12.0)));
+            assert(valueMatch(x8.getValue(CPos("C1")), CValue()));
+            assert(valueMatch(x8.getValue(CPos("B4")), CValue()));
+        }
+    }
+
+    // the deleted A5 makes the condition undefined, which drops the branch
+    // closing the cycle of A1 and B1, in the sheet as after a reload
+    CSpreadsheet x8_cycle;
+    assert(x8_cycle.setCell(CPos("A1"), "=if((\"s\"*A5), B1, 1)"));
+    assert(x8_cycle.setCell(CPos("B1"), "=count(A1:A1)+1"));
+    assert(valueMatch(x8_cycle.getValue(CPos("B1")), CValue()));
+    assert(x8_cycle.deleteRows(5));
+    assert(valueMatch(x8_cycle.getValue(CPos("B1")), CValue(1.0)));
+    std::ostringstream x8_saved;
+    assert(x8_cycle.save(x8_saved));
+    iss.clear();
+    iss.str(x8_saved.str());
+    CSpreadsheet x8_loaded;
+    assert(x8_loaded.load(iss));
+    for (const char* pos : {"A1", "B1"}) {
+        assert(valueMatch(
+            x8_cycle.getValue(CPos(pos)),
+            x8_loaded.getValue(CPos(pos))
+        ));
+    }
+
+    assert(CWorkbook::capabilities() & SPREADSHEET_SHEETS);
+    CWorkbook x9;
+    assert(x9.addSheet("Inputs"));
+    assert(x9.addSheet("Calc"));
+    assert(x9.addSheet("Report"));
+    assert(x9.addSheet("My sheet"));
+    assert(!x9.addSheet("Calc"));
+    assert(!x9.addSheet("A!B"));
+    for (int i = 1; i <= 10; i++) {
+        std::string pos = "A" + std::to_string(i);
+        assert(x9.setCell("Inputs", CPos(pos), std::to_string(i)));
+    }
+    assert(x9.setCell("Calc", CPos("A1"), "=sum(Inputs!A1:A10)"));
+    assert(x9.setCell("Calc", CPos("B1"), "=Inputs!$A$2*10"));
+    assert(x9.setCell("Report", CPos("A1"), "=Calc!A1+Calc!B1"));
+    assert(x9.setCell("My sheet", CPos("A1"), "=Report!A1*2"));
+    assert(valueMatch(x9.getValue("My sheet", CPos("A1")), CValue(150.0)));
+    // sheets may not depend on each other in a cycle
+    assert(!x9.setCell("Report", CPos("B1"), "='My sheet'!A1"));
+    assert(!x9.setCell("Inputs", CPos("C1"), "=Report!A1"));
+    assert(!x9.setCell("Calc", CPos("E1"), "=Missing!A1"));
+    assert(!x9.setCell("Calc", CPos("E1"), "=Inputs!5"));
+    assert(!x9.setCell("Calc", CPos("E1"), "='Inputs!A1"));
+    assert(x9.setCell("Calc", CPos("E1"), "=1e1+Inputs!A2+\"Inputs!A1\""));
+    assert(valueMatch(
+        x9.getValue("Calc", CPos("E1")),
+        CValue("12.000000Inputs!A1")
+    ));
+    assert(x9.setCell(
+        "Calc",
+        CPos("E1"),
+        "=1E+1*Inputs!A2+countval(2, Inputs!A1:A2)"
+    ));
+    assert(valueMatch(x9.getValue("Calc", CPos("E1")), CValue(21.0)));
+    assert(x9.setCell("Calc", CPos("D1"), "=Calc!A1+A1"));
+    assert(valueMatch(x9.getValue("Calc", CPos("D1")), CValue(110.0)));
+    assert(x9.setCell("Inputs", CPos("B1"), "hello"));
+    assert(x9.setCell("Calc", CPos("C1"), "=Inputs!B1+\" world!\""));
+    assert(valueMatch(x9.getValue("Calc", CPos("C1")), CValue("hello world!")));
+    assert(x9.setCell("Calc", CPos("F1"), "=countval(2, Inputs!A1:A10)"));
+    assert(valueMatch(x9.getValue("Calc", CPos("F1")), CValue(1.0)));
+    assert(x9.setCell("Inputs", CPos("A1"), "100"));
+    assert(valueMatch(x9.getValue("Report", CPos("A1")), CValue(174.0)));
+    x9.recalculate(4);
+    assert(valueMatch(x9.getValue("My sheet", CPos("A1")), CValue(348.0)));
+    // references into other sheets follow their rows
+    assert(x9.insertRows("Inputs", 1));
+    assert(valueMatch(x9.getValue("Calc", CPos("B1")), CValue(20.0)));
+    assert(x9.setCell("Inputs", CPos("A1"), "1000"));
+    assert(valueMatch(x9.getValue("Calc", CPos("A1")), CValue(154.0)));
+    assert(x9.deleteRows("Inputs", 5));
+    assert(valueMatch(x9.getValue("Report", CPos("A1")), CValue(170.0)));
+    assert(x9.setCell("Calc", CPos("H1"), "=Inputs!A2"));
+    assert(x9.copyRect("Calc", CPos("H2"), CPos("H1")));
+    assert(valueMatch(x9.getValue("Calc", CPos("H2")), CValue(2.0)));
+    std::ostringstream workbook;
+    assert(x9.save(workbook));
+    iss.clear();
+    iss.str(workbook.str());
+    CWorkbook x10;
+    assert(x10.load(iss));
+    assert(x10.sheetCount() == 4);
+    assert(valueMatch(x10.getValue("Report", CPos("A1")), CValue(170.0)));
+    assert(valueMatch(x10.getValue("Calc", CPos("H2")), CValue(2.0)));
+    assert(valueMatch(
+        x10.getValue("Calc", CPos("C1")),
+        CValue("hello world!")
+    ));
+    assert(!x10.setCell("Inputs", CPos("C1"), "=Report!A1"));
+    assert(x10.setCell("Inputs", CPos("A2"), "0"));
+    assert(valueMatch(x10.getValue("My sheet", CPos("A1")), CValue(140.0)));
+    std::string corrupted = workbook.str();
+    corrupted[corrupted.size() / 2] ^= 1;
+    iss.clear();
+    iss.str(corrupted);
+    assert(!x10.load(iss));
+
+    // independent sheets are recalculated in parallel
+    CWorkbook x11;
+    assert(x11.addSheet("Base"));
+    for (int i = 1; i <= 100; i++) {
+        std::string pos = "A" + std::to_string(i);
+        assert(x11.setCell("Base", CPos(pos), std::to_string(i)));
+    }
+    std::string total = "=0";
+    for (int k = 0; k < 8; k++) {
+        std::string name = "S" + std::to_string(k);
+        assert(x11.addSheet(name));
+        for (int i = 1; i <= 100; i++) {
+            std::string pos = "A" + std::to_string(i);
+            std::string formula = "=Base!" + pos + "*" + std::to_string(k);
+            assert(x11.setCell(name, CPos(pos), formula));
+        }
+        assert(x11.setCell(name, CPos("B1"), "=sum(A1:A100)"));
+        total += "+" + name + "!B1";
+    }
+    assert(x11.addSheet("Total"));
+    assert(x11.setCell("Total", CPos("A1"), total));
+    x11.recalculate(4);
+    assert(valueMatch(x11.getValue("Total", CPos("A1")), CValue(141400.0)));
+    assert(x11.setCell("Base", CPos("A1"), "2"));
+    x11.recalculate(1);
+    assert(valueMatch(x11.getValue("Total", CPos("A1")), CValue(141428.0)));
+    std::vector<CValue> sums(8);
+    assert(x11.getValues("S3", CPos("B1"), 1, 1, sums.data()));
+    assert(valueMatch(sums[0], CValue(15153.0)));
+
+    // the strings of replaced values are released
+    CSpreadsheet edited;
+    assert(edited.setCell(CPos("B1"), "=A1+\"!\""));
+    size_t early_strings = 0;
+    for (int i = 0; i < 5000; i++) {
+        std::string text = "edit number " + std::to_string(i);
+        assert(edited.setCell(CPos("A1"), text));
+        assert(valueMatch(edited.getValue(CPos("B1")), CValue(text + "!")));
+        if (i == 200) {
+            early_strings = edited.memoryUsage().strings;
+        }
+    }
+    assert(edited.memoryUsage().strings <= 2 * early_strings);
+    // NaNs keep their sign
+    assert(edited.setCell(CPos("C1"), "=(-1)^0.5"));
+    assert(edited.setCell(CPos("C2"), "=-C1"));
+    double nan = std::pow(-1.0, 0.5);
+    CValue c1 = edited.getValue(CPos("C1"));
+    CValue c2 = edited.getValue(CPos("C2"));
+    assert(std::signbit(std::get<double>(c1)) == std::signbit(nan));
+    assert(std::signbit(std::get<double>(c2)) != std::signbit(nan));
+
+    CSpreadsheet x12;
+    MemoryUsage empty = x12.memoryUsage();
+    for (int i = 1; i <= 1000; i++) {
+        std::string row = std::to_string(i);
+        assert(x12.setCell(CPos("A" + row), "value number " + row));
+        assert(x12.setCell(CPos("B" + row), "=A" + row + "+\"!\""));
+        std::string count = "=countval(B" + row + ", B1:B1000)";
+        assert(x12.setCell(CPos("C" + row), count));
+    }
+    MemoryUsage loaded = x12.memoryUsage();
+    assert(loaded.cells > empty.cells);
+    assert(loaded.expressions > 0 && loaded.dependencies > 0);
+    assert(loaded.strings == empty.strings && loaded.caches == 0);
+    for (int i = 1; i <= 1000; i++) {
+        x12.getValue(CPos("C" + std::to_string(i)));
+    }
+    MemoryUsage evaluated = x12.memoryUsage();
+    assert(evaluated.strings > loaded.strings && evaluated.caches > 0);
+    assert(evaluated.total()
+           == evaluated.cells + evaluated.expressions + evaluated.strings
+               + evaluated.dependencies + evaluated.caches + evaluated.history);
+    // the rows read last stay cached
+    CValue last("value number 1000!");
+    assert(valueMatch(x12.getValue(CPos("B1000")), last));
+    MemoryUsage evicted = x12.evictCaches(evaluated.total() - evaluated.caches);
+    assert(evicted.caches == 0 && evicted.strings < evaluated.strings);
+    assert(evicted.strings > empty.strings);
+    evicted = x12.evictCaches(0);
+    assert(evicted.strings == empty.strings);
+    assert(evicted.cells == evaluated.cells);
+    assert(valueMatch(x12.getValue(CPos("B7")), CValue("value number 7!")));
+    assert(valueMatch(x12.getValue(CPos("C7")), CValue(1.0)));
+    assert(x12.setCell(CPos("A8"), "value number 7"));
+    assert(valueMatch(x12.getValue(CPos("C7")), CValue(2.0)));
+
+    // a chain too long to be evaluated recursively
+    const int chain = 30000;
+    CSpreadsheet x13;
+    assert(x13.setCell(CPos("A1"), "1"));
+    for (int i = 2; i <= chain; i++) {
+        std::string prev = "A" + std::to_string(i - 1);
+        assert(x13.setCell(CPos("A" + std::to_string(i)), "=" + prev + "+1"));
+    }
+    assert(x13.setCell(CPos("B2"), "text"));
+    assert(x13.setCell(CPos("C1"), "=C2"));
+    assert(x13.setCell(CPos("C2"), "=C1"));
+    std::vector<CValue> values(chain * 3);
+    x13.getValues(CPos("A1"), 3, chain, values.data());
+    assert(valueMatch(values[0], CValue(1.0)));
+    assert(valueMatch(values[chain - 1], CValue((double)chain)));
+    assert(valueMatch(values[chain], CValue()));
+    assert(valueMatch(values[chain + 1], CValue("text")));
+    assert(valueMatch(values[2 * chain], CValue()));
+    assert(x13.setCell(CPos("A1"), "10"));
+    assert(x13.insertRows(3));
+    assert(x13.insertColumns(2));
+    std::vector<CValue> window(3 * 2);
+    x13.getValues(CPos("A2"), 3, 2, window.data());
+    assert(valueMatch(window[0], CValue(11.0)));
+    assert(valueMatch(window[1], CValue()));
+    assert(valueMatch(window[2], CValue()));
+    assert(valueMatch(window[4], CValue("text")));
+    // the last row of the chain moved down by the inserted one
+    x13.getValues(CPos(1, chain), 1, 3, window.data());
+    assert(valueMatch(window[0], CValue((double)chain + 8)));
+    assert(valueMatch(window[1], CValue((double)chain + 9)));
+    assert(valueMatch(window[2], CValue()));
+
+    // compiled formulas give the same values as the interpreter, including
+    // the cases the compiled code leaves to it
+    const std::vector<std::string> formulas = {
+        "=A1+A2*A3",
+        "=(A1-A2)/A3",
+        "=A1/A4",
+        "=A1^A2",
+        "=-A1+-A2",
+        "=if(A1<A2, A3, A4)",
+        "=if(A1, A2/A4, A5)",
+        "=if(A3, A6, 1)",
+        "=if(A1-A1, 1, 2)",
+        "=(A1+A2)*(A1+A2)+(A1+A2)",
+        "=((A1*A2)+1)/((A1*A2)+1)",
+        "=(A1^2+A2^2)^0.5-(A1^2+A2^2)*A4",
+        "=A1<=A2",
+        "=A1>A2",
+        "=A1>=A3",
+        "=A1<>A2",
+        "=A1=A2",
+        "=A5+1",
+        "=A5<A5",
+        "=A6*2",
+        "=(A1-A2)/(A1-A2)",
+    };
+    const std::vector<std::string> inputs = {
+        "3", "-2.5", "0", "1e308", "7", "0.5", "-1e308", "2",
+    };
+    CSpreadsheet jit;
+    CSpreadsheet interpreted;
+    jit.setJit(true);
+    for (size_t i = 0; i < formulas.size(); i++) {
+        CPos pos("C" + std::to_string(i + 1));
+        assert(jit.setCell(pos, formulas[i]));
+        assert(interpreted.setCell(pos, formulas[i]));
+    }
+    auto same = [](const CValue& a, const CValue& b) {
+        if (a.index() == 1 && b.index() == 1) {
+            double x = std::get<double>(a);
+            double y = std::get<double>(b);
+            return std::memcmp(&x, &y, sizeof(x)) == 0
+                || (std::isnan(x) && std::isnan(y));
+        }
+        return a == b;
+    };
+    for (size_t round = 0; round < 12; round++) {
+        for (size_t k = 0; k < 4; k++) {
+            const std::string& input = inputs[(round * 3 + k * 5) % 8];
+            CPos pos("A" + std::to_string(k + 1));
+            assert(jit.setCell(pos, input));
+            assert(interpreted.setCell(pos, input));
+        }
+        std::string text = round % 3 ? "7" : "text";
+        assert(jit.setCell(CPos("A5"), text));
+        assert(interpreted.setCell(CPos("A5"), text));
+        for (size_t i = 0; i < formulas.size(); i++) {
+            CPos pos("C" + std::to_string(i + 1));
+            assert(same(jit.getValue(pos), interpreted.getValue(pos)));
+        }
+    }
+    // a copy keeps working without the code of the original
+    CSpreadsheet jit_copy = jit;
+    assert(jit.setCell(CPos("A1"), "4"));
+    assert(jit_copy.setCell(CPos("A1"), "4"));
+    for (size_t i = 0; i < formulas.size(); i++) {
+        CPos pos("C" + std::to_string(i + 1));
+        assert(same(jit.getValue(pos), jit_copy.getValue(pos)));
+    }
+    assert(jit.memoryUsage().caches > interpreted.memoryUsage().caches);
+
+    // scenarios give the same values as setting the inputs one by one
+    CSpreadsheet x15;
+    const std::vector<std::pair<std::string, std::string>> model = {
+        {"A3", "=B3"},
+        {"B1", "=A1*2+A2"},
+        {"B2", "=sum(A1:B1)"},
+        {"B3", "=A3+1"},
+        {"B4", "=if(A1>A2, \"x\" + A1, A2)"},
+        {"B5", "=countval(A1, A1:A4)"},
+        {"B6", "=min(A1:B3)"},
+        {"B7", "=max(C1:C2) + max(A1:B3)"},
+        {"B8", "=count(A1:A4)"},
+        {"B9", "=A1/A2"},
+        {"B10", "=C1+A1"},
+        {"B11", "=(A1+A2)*(A1+A2)"},
+        {"B12", "=B13+A1"},
+        {"B13", "=B12"},
+        {"B14", "=A1=A2"},
+        {"B15", "=\"lit\"+1.5"},
+        {"B16", "=A1^A2"},
+        {"C1", "10"},
+        {"C2", "=C1*2"},
+    };
+    for (const auto& [pos, contents] : model) {
+        assert(x15.setCell(CPos(pos), contents));
+    }
+    const std::vector<CPos> scenario_inputs = {CPos("A1"), CPos("A2"),
+                                               CPos("A3")};
+    std::vector<CPos> scenario_outputs = {CPos("A1"), CPos("C2"), CPos("D1")};
+    for (int i = 1; i <= 16; i++) {
+        scenario_outputs.push_back(CPos("B" + std::to_string(i)));
+    }
+    const std::vector<CValue> choices = {
+        CValue(3.0), CValue(-2.0), CValue(0.0), CValue(0.5),
+        CValue("abc"), CValue("x3"), CValue(7.0),
+    };
+    const size_t scenarios = 300;
+    std::vector<CValue> scenario_values;
+    for (size_t i = 0; i < scenarios; i++) {
+        for (size_t j = 0; j < scenario_inputs.size(); j++) {
+            scenario_values.push_back(choices[(i * (j + 2) + j) % 7]);
+        }
+    }
+    CValue before = x15.getValue(CPos("B1"));
+    std::vector<CValue> scenario_results(scenarios * scenario_outputs.size());
+    assert(x15.evaluateScenarios(
+        scenario_inputs,
+        scenario_outputs,
+        scenarios,
+        scenario_values.data(),
+        scenario_results.data(),
+        2
+    ));
+    assert(same(x15.getValue(CPos("B1")), before));
+    assert(valueMatch(x15.getValue(CPos("B3")), CValue()));
+
+    CSpreadsheet x15_reference = x15;
+    for (size_t i = 0; i < scenarios; i++) {
+        for (size_t j = 0; j < scenario_inputs.size(); j++) {
+            const CValue& value = scenario_values[i * 3 + j];
+            std::string contents = std::holds_alternative<double>(value)
+                ? std::to_string(std::get<double>(value))
+                : std::get<std::string>(value);
+            assert(x15_reference.setCell(scenario_inputs[j], contents));
+        }
+        for (size_t k = 0; k < scenario_outputs.size(); k++) {
+            CValue expected = x15_reference.getValue(scenario_outputs[k]);
+            const CValue& result =
+                scenario_results[i * scenario_outputs.size() + k];
+            assert(same(result, expected));
+        }
+    }
+    assert(valueMatch(scenario_results[4], CValue(7.0)));
+
+    // long chains are evaluated in narrower batches
+    CSpreadsheet x15_chain;
+    const int links = 20000;
+    assert(x15_chain.setCell(CPos("A1"), "0"));
+    for (int i = 2; i <= links; i++) {
+        std::string contents = "=A" + std::to_string(i - 1) + "+1";
+        assert(x15_chain.setCell(CPos("A" + std::to_string(i)), contents));
+    }
+    std::vector<CValue> chain_starts;
+    for (size_t i = 0; i < scenarios; i++) {
+        chain_starts.push_back(CValue((double)i));
+    }
+    std::vector<CValue> chain_ends(scenarios);
+    assert(x15_chain.evaluateScenarios(
+        {CPos("A1")},
+        {CPos("A" + std::to_string(links))},
+        scenarios,
+        chain_starts.data(),
+        chain_ends.data(),
+        2
+    ));
+    for (size_t i = 0; i < scenarios; i++) {
+        assert(valueMatch(chain_ends[i], CValue((double)(i + links - 1))));
+    }
+
+    // the sum gains the inserted row, scenarios follow its new members
+    CSpreadsheet x15_axes;
+    assert(x15_axes.setCell(CPos("A1"), "1"));
+    assert(x15_axes.setCell(CPos("A2"), "2"));
+    assert(x15_axes.setCell(CPos("B1"), "=sum(A1:A2)"));
+    assert(x15_axes.insertRows(2));
+    assert(x15_axes.setCell(CPos("A2"), "5"));
+    assert(valueMatch(x15_axes.getValue(CPos("B1")), CValue(8.0)));
+    CValue x15_input(100.0);
+    CValue x15_output;
+    assert(x15_axes.evaluateScenarios(
+        {CPos("A2")},
+        {CPos("B1")},
+        1,
+        &x15_input,
+        &x15_output
+    ));
+    assert(valueMatch(x15_output, CValue(103.0)));
+
+    CSpreadsheet x16;
+    assert(!x16.undo());
+    assert(!x16.redo());
+    assert(x16.setCell(CPos("A1"), "1"));
+    assert(x16.setCell(CPos("A2"), "=A1*10"));
+    assert(valueMatch(x16.getValue(CPos("A2")), CValue(10.0)));
+    std::ostringstream x16_saved;
+    assert(x16.save(x16_saved));
+    // size of a delta of the changes since the last save
+    auto x16_delta = [&] {
+        CSpreadsheet copy = x16;
+        std::ostringstream delta;
+        assert(copy.saveDelta(delta));
+        return delta.str().size();
+    };
+    size_t x16_clean = x16_delta();
+    assert(x16.setCell(CPos("A1"), "2"));
+    assert(valueMatch(x16.getValue(CPos("A2")), CValue(20.0)));
+    assert(x16.undo());
+    assert(valueMatch(x16.getValue(CPos("A1")), CValue(1.0)));
+    assert(valueMatch(x16.getValue(CPos("A2")), CValue(10.0)));
+    // undoing every edit since the save leaves nothing to save
+    assert(x16_delta() == x16_clean);
+    assert(x16.redo());
+    assert(valueMatch(x16.getValue(CPos("A2")), CValue(20.0)));
+    assert(!x16.redo());
+    assert(x16_delta() > x16_clean);
+
+    x16.copyRect(CPos("B1"), CPos("A1"), 1, 2);
+    assert(valueMatch(x16.getValue(CPos("B2")), CValue(20.0)));
+    assert(x16.setCell(CPos("B1"), "5"));
+    assert(valueMatch(x16.getValue(CPos("B2")), CValue(50.0)));
+    assert(x16.undo());
+    assert(x16.undo());
+    assert(valueMatch(x16.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x16.getValue(CPos("B2")), CValue()));
+    assert(valueMatch(x16.getValue(CPos("A2")), CValue(20.0)));
+    assert(x16.memoryUsage().history > 0);
+    // a new edit drops the undone ones
+    assert(x16.setCell(CPos("C1"), "=A2+1"));
+    assert(!x16.redo());
+    assert(valueMatch(x16.getValue(CPos("C1")), CValue(21.0)));
+    assert(x16.undo());
+    assert(x16.undo());
+    assert(x16.undo());
+    assert(x16.undo());
+    assert(!x16.undo());
+    assert(valueMatch(x16.getValue(CPos("A1")), CValue()));
+    assert(valueMatch(x16.getValue(CPos("A2")), CValue()));
+    for (int i = 0; i < 4; i++) {
+        assert(x16.redo());
+    }
+    assert(valueMatch(x16.getValue(CPos("C1")), CValue(21.0)));
+    assert(x16.deleteRows(5));
+    assert(!x16.undo());
+    assert(x16.memoryUsage().history == 0);
+
+    VersionedSpreadsheet x17(4);
+    for (int i = 1; i <= 10; i++) {
+        assert(x17.setCell(CPos("A" + std::to_string(i)), "0"));
+    }
+    assert(x17.setCell(CPos("B1"), "=sum(A1:A10)"));
+    auto x17_first = x17.pin();
+    assert(x17_first);
+    {
+        auto same_version = x17.pin();
+        assert(same_version && same_version->epoch() == x17_first->epoch());
+    }
+    assert(x17.versions() == 1);
+    std::atomic<bool> x17_done = false;
+    std::thread x17_writer([&] {
+        for (int round = 1; round <= 200; round++) {
+            x17.edit([&](CSpreadsheet& sheet) {
+                for (int i = 1; i <= 10; i++) {
+                    sheet.setCell(
+                        CPos("A" + std::to_string(i)),
+                        std::to_string(round)
+                    );
+                }
+            });
+        }
+        x17_done = true;
+    });
+    std::vector<std::thread> x17_readers;
+    for (int r = 0; r < 2; r++) {
+        x17_readers.emplace_back([&] {
+            do {
+                auto snapshot = x17.pin();
+                assert(snapshot);
+                CValue a1 = snapshot->getValue(CPos("A1"));
+                CValue values[10];
+                snapshot->getValues(CPos("A1"), 1, 10, values);
+                for (const CValue& value : values) {
+                    assert(valueMatch(value, a1));
+                }
+                assert(valueMatch(
+                    snapshot->getValue(CPos("B1")),
+                    CValue(std::get<double>(a1) * 10)
+                ));
+            } while (!x17_done);
+        });
+    }
+    x17_writer.join();
+    for (auto& reader : x17_readers) {
+        reader.join();
+    }
+    // the first version is still pinned, the edits don't reach it
+    assert(valueMatch(x17_first->getValue(CPos("B1")), CValue(0.0)));
+    assert(valueMatch(x17.getValue(CPos("B1")), CValue(2000.0)));
+    {
+        std::vector<std::optional<VersionedSpreadsheet::Snapshot>> pinned;
+        for (int i = 0; i < 3; i++) {
+            pinned.push_back(x17.pin());
+            assert(pinned.back());
+        }
+        assert(!x17.pin());
+        assert(valueMatch(pinned[0]->getValue(CPos("B1")), CValue(2000.0)));
+    }
+    x17_first.reset();
+    x17.collect();
+    assert(x17.versions() == 1);
+
+    // a version shares the chunks no edit reached with the version before,
+    // edits of the axes publish every cell again
+    VersionedSpreadsheet x17_wide;
+    x17_wide.edit([](CSpreadsheet& sheet) {
+        for (int y = 1; y <= 640; y++) {
+            sheet.setCell(CPos(1, y), std::to_string(y));
+        }
+        sheet.setCell(CPos("B1"), "=A1*2");
+    });
+    auto x17_old = x17_wide.pin();
+    assert(x17_wide.setCell(CPos("A1"), "5"));
+    auto x17_new = x17_wide.pin();
+    assert(x17_wide.sharedChunks() == 10);
+    assert(valueMatch(x17_old->getValue(CPos("B1")), CValue(2.0)));
+    assert(valueMatch(x17_new->getValue(CPos("B1")), CValue(10.0)));
+    x17_wide.edit([](CSpreadsheet& sheet) { return sheet.insertRows(1); });
+    x17_wide.copyRect(CPos("A640"), CPos("Z1"));
+    auto x17_moved = x17_wide.pin();
+    assert(x17_wide.sharedChunks() == 0);
+    assert(valueMatch(x17_new->getValue(CPos("B1")), CValue(10.0)));
+    assert(valueMatch(x17_moved->getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x17_moved->getValue(CPos("B2")), CValue(10.0)));
+    assert(valueMatch(x17_moved->getValue(CPos("A640")), CValue()));
+    assert(valueMatch(x17_moved->getValue(CPos("A641")), CValue(640.0)));
+    assert(x17_wide.setCell(CPos("A2"), "7"));
+    assert(x17_wide.setCell(CPos("C1"), "=B2+1"));
+    auto x17_last = x17_wide.pin();
+    assert(x17_wide.sharedChunks() == 10);
+    assert(valueMatch(x17_last->getValue(CPos("C1")), CValue(15.0)));
+    assert(valueMatch(x17_moved->getValue(CPos("C1")), CValue()));
+    std::ostringstream x17_saved;
+    assert(x17_last->save(x17_saved));
+    CSpreadsheet x17_loaded;
+    std::istringstream x17_source(x17_saved.str());
+    assert(x17_loaded.load(x17_source));
+    assert(valueMatch(x17_loaded.getValue(CPos("C1")), CValue(15.0)));
+    assert(valueMatch(x17_loaded.getValue(CPos("A641")), CValue(640.0)));
+
+    // edits after an insertion are published through the new members of
+    // ranges
+    VersionedSpreadsheet x17_axes;
+    assert(x17_axes.setCell(CPos("A1"), "1"));
+    assert(x17_axes.setCell(CPos("A2"), "2"));
+    assert(x17_axes.setCell(CPos("B1"), "=sum(A1:A2)"));
+    x17_axes.edit([](CSpreadsheet& sheet) { return sheet.insertRows(2); });
+    auto x17_inserted = x17_axes.pin();
+    assert(valueMatch(x17_inserted->getValue(CPos("B1")), CValue(3.0)));
+    assert(x17_axes.setCell(CPos("A2"), "10"));
+    auto x17_edited = x17_axes.pin();
+    assert(valueMatch(x17_edited->getValue(CPos("B1")), CValue(13.0)));
+    assert(valueMatch(x17_axes.getValue(CPos("B1")), CValue(13.0)));
+    assert(valueMatch(x17_inserted->getValue(CPos("B1")), CValue(3.0)));
+
+    // empty contents are rejected before parsing, the parser would pad its
+    // message with an arbitrary number of spaces
+    CSpreadsheet x18;
+    assert(!x18.setCell(CPos("A1"), ""));
+    assert(x18.setCell(CPos("A1"), "1"));
+    assert(!x18.setCell(CPos("A1"), ""));
+    assert(valueMatch(x18.getValue(CPos("A1")), CValue(1.0)));
+    CWorkbook x18_book;
+    x18_book.addSheet("s");
+    assert(!x18_book.setCell("s", CPos("A1"), ""));
     return EXIT_SUCCESS;
 }
@@ -1,18 +1,33 @@
 #ifndef __PROGTEST__
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+
     #include <algorithm>
+    #include <atomic>
     #include <cassert>
+    #include <cctype>
+    #include <climits>
     #include <cmath>
     #include <compare>
+    #include <cstdint>
     #include <cstdio>
     #include <cstdlib>
     #include <cstring>
+    #include <deque>
+    #include <exception>
     #include <iostream>
     #include <map>
     #include <memory>
+    #include <mutex>
+    #include <optional>
     #include <set>
     #include <sstream>
     #include <stdexcept>
     #include <string>
+    #include <thread>
+    #include <unordered_map>
     #include <utility>
     #include <variant>
     #include <vector>
@@ -29,8 +44,236 @@ constexpr unsigned SPREADSHEET_FILE_IO = 0x04;
 constexpr unsigned SPREADSHEET_SPEED = 0x08;
 #endif /* __PROGTEST__ */
 
+// capabilities beyond the ones progtest defines
+constexpr unsigned SPREADSHEET_SHEETS = 0x10;
+constexpr unsigned SPREADSHEET_PARALLEL = 0x20;
+constexpr unsigned SPREADSHEET_JIT = 0x40;
+
+// formulas are compiled into x86-64 code only on Linux, where the code is
+// mapped through memfd_create, elsewhere they are always interpreted
+#if defined(__x86_64__) && defined(__linux__) && !defined(__PROGTEST__)
+    #define VELKA_JIT 1
+#else
+    #define VELKA_JIT 0
+#endif
+
 constexpr CValue UNDEFINED = CValue();
 
+// 8 byte value used by the evaluator instead of CValue
+// numbers are stored as they are (with all NaNs of a sign collapsed into one),
+// undefined and strings are stored in the payload of NaNs which are never
+// produced by arithmetic, strings are handles into a StringPool
+class BoxedValue {
+    uint64_t bits;
+
+    static constexpr uint64_t CANONICAL_NAN = 0x7ff8000000000000;
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+    static constexpr uint64_t TAG_UNDEFINED = 0xfff9000000000000;
+    static constexpr uint64_t TAG_STRING = 0xfffa000000000000;
+    static constexpr uint64_t TAG_MASK = 0xffff000000000000;
+    static constexpr uint64_t PAYLOAD_MASK = 0x0000ffffffffffff;
+
+    explicit constexpr BoxedValue(uint64_t bits, int) : bits(bits) {}
+
+  public:
+    constexpr BoxedValue() : bits(TAG_UNDEFINED) {}
+
+    BoxedValue(double value) {
+        if (std::isnan(value)) {
+            // keeps printing -nan, the negative NaN is below the tags
+            bits = CANONICAL_NAN | (std::signbit(value) ? SIGN_BIT : 0);
+        } else {
+            std::memcpy(&bits, &value, sizeof(double));
+        }
+    }
+
+    static BoxedValue string(uint64_t handle) {
+        assert(handle <= PAYLOAD_MASK);
+        return BoxedValue(TAG_STRING | handle, 0);
+    }
+
+    static BoxedValue from_bits(uint64_t bits) {
+        return BoxedValue(bits, 0);
+    }
+
+    uint64_t to_bits() const {
+        return bits;
+    }
+
+    bool is_undefined() const {
+        return bits == TAG_UNDEFINED;
+    }
+
+    bool is_string() const {
+        return (bits & TAG_MASK) == TAG_STRING;
+    }
+
+    bool is_number() const {
+        return !is_undefined() && !is_string();
+    }
+
+    double number() const {
+        assert(is_number());
+        double value;
+        std::memcpy(&value, &bits, sizeof(double));
+        return value;
+    }
+
+    uint64_t string_handle() const {
+        assert(is_string());
+        return bits & PAYLOAD_MASK;
+    }
+
+    // same semantics as == on CValue, given that equal strings are interned
+    // into the same handle
+    static bool equals(BoxedValue a, BoxedValue b) {
+        if (a.is_number() && b.is_number()) {
+            return a.number() == b.number();
+        }
+        return a.bits == b.bits;
+    }
+};
+
+static_assert(sizeof(BoxedValue) == 8);
+
+constexpr BoxedValue BOXED_UNDEFINED = BoxedValue();
+
+// heap usage estimates for memory accounting, following the allocations of
+// libstdc++ containers and the chunk sizes of the glibc allocator
+
+// size of the chunk malloc uses for an allocation of size bytes
+constexpr size_t allocation_bytes(size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    return std::max<size_t>(32, (size + sizeof(size_t) + 15) & ~(size_t)15);
+}
+
+// a red-black tree node holds the color and three pointers before the value
+template<typename T>
+size_t tree_bytes(const T& tree) {
+    return tree.size()
+        * allocation_bytes(4 * sizeof(void*) + sizeof(typename T::value_type));
+}
+
+// a hash table node holds the next pointer, the value and the hash if it
+// isn't cheap to recompute, a table with a single bucket doesn't allocate it
+template<typename T>
+size_t hash_table_bytes(const T& table, bool cached_hash) {
+    size_t node = sizeof(void*) + sizeof(typename T::value_type)
+        + (cached_hash ? sizeof(size_t) : 0);
+    size_t buckets = table.bucket_count() > 1
+        ? allocation_bytes(table.bucket_count() * sizeof(void*))
+        : 0;
+    return buckets + table.size() * allocation_bytes(node);
+}
+
+template<typename T>
+size_t vector_bytes(const std::vector<T>& vector) {
+    return allocation_bytes(vector.capacity() * sizeof(T));
+}
+
+// short strings are stored inside of the object
+inline size_t string_bytes(const std::string& str) {
+    const char* object = (const char*)&str;
+    if (str.data() >= object && str.data() < object + sizeof(str)) {
+        return 0;
+    }
+    return allocation_bytes(str.capacity() + 1);
+}
+
+// deduplicated storage for strings referenced by BoxedValue
+class StringPool {
+    // deque doesn't move its elements so the views in index stay valid
+    std::deque<std::string> strings;
+    std::unordered_map<std::string_view, uint64_t> index;
+
+  public:
+    StringPool() {}
+
+    StringPool(const StringPool& other) : strings(other.strings) {
+        rebuild_index();
+    }
+
+    StringPool& operator=(const StringPool& other) {
+        strings = other.strings;
+        rebuild_index();
+        return *this;
+    }
+
+    void rebuild_index() {
+        index.clear();
+        for (size_t i = 0; i < strings.size(); i++) {
+            index.insert({strings[i], i});
+        }
+    }
+
+    uint64_t intern(std::string_view str) {
+        auto entry = index.find(str);
+        if (entry != index.end()) {
+            return entry->second;
+        }
+
+        uint64_t handle = strings.size();
+        strings.emplace_back(str);
+        index.insert({strings.back(), handle});
+        return handle;
+    }
+
+    const std::string& get(uint64_t handle) const {
+        return strings[handle];
+    }
+
+    // handle of an interned string, without interning it
+    std::optional<uint64_t> find(std::string_view str) const {
+        auto entry = index.find(str);
+        if (entry == index.end()) {
+            return std::nullopt;
+        }
+        return entry->second;
+    }
+
+    size_t size() const {
+        return strings.size();
+    }
+
+    // keep only the strings whose handles are live, returns the new handle
+    // of every kept string
+    std::vector<uint64_t> compact(const std::vector<bool>& live) {
+        std::vector<uint64_t> handles(strings.size());
+        std::deque<std::string> kept;
+        for (size_t i = 0; i < strings.size(); i++) {
+            if (live[i]) {
+                handles[i] = kept.size();
+                kept.push_back(std::move(strings[i]));
+            }
+        }
+        strings = std::move(kept);
+        // clear() keeps the buckets
+        index = decltype(index)();
+        rebuild_index();
+        return handles;
+    }
+
+    // a deque allocates blocks of 512 bytes and a map of pointers to them
+    size_t memory_bytes() const {
+        size_t per_block = std::max<size_t>(1, 512 / sizeof(std::string));
+        size_t blocks = strings.size() / per_block + 1;
+        size_t block_bytes = per_block * sizeof(std::string);
+        size_t bytes = blocks * allocation_bytes(block_bytes)
+            + allocation_bytes(std::max<size_t>(8, blocks + 2) * sizeof(void*));
+        for (const auto& str : strings) {
+            bytes += string_bytes(str);
+        }
+        return bytes + hash_table_bytes(index, true);
+    }
+
+    void clear() {
+        strings.clear();
+        index.clear();
+    }
+};
+
 enum class FunctionKind {
     SUM,  // (range)
     COUNT,  // (range)
@@ -134,10 +377,15 @@ class CPos {
     std::strong_ordering operator<=>(const CPos& other) const = default;
 };
 
+// sheet of references without a sheet name, the sheet of the formula
+const int LOCAL_SHEET = -1;
+
 struct CellReference {
     CPos pos {0, 0};
     bool x_absolute = false;
     bool y_absolute = false;
+    // index of the sheet in the workbook, ranges have it in both corners
+    int sheet = LOCAL_SHEET;
 
     CellReference() {}
 
@@ -208,13 +456,20 @@ struct CellRange {
 
 struct Function;
 
+// reference to a subexpression shared by multiple places of a formula, see
+// Cell::locals
+struct LocalReference {
+    uint32_t index = 0;
+};
+
 using Expression = std::variant<
     std::monostate,
     double,
     std::string,
     CellReference,
     CellRange,
-    Function>;
+    Function,
+    LocalReference>;
 
 struct Function {
     FunctionKind kind;
@@ -271,6 +526,7 @@ struct Function {
                 break;
         }
         assert(0 && "Missing variant");
+        return 0;
     }
 
     Expression* begin() {
@@ -450,10 +706,268 @@ class ExpressionBuilder: public CExprBuilder {
     }
 };
 
+// remove the sheet names from the references of a formula, the parser
+// rejects them, names gets the sheet name of every reference and range in
+// source order, empty if it has none
+//
+// names are identifiers (Sheet1!A1) or quoted ('My sheet'!A1:B2), they are
+// resolved by SheetExpressionBuilder as the parser reports the references
+std::string
+split_sheet_names(std::string_view str, std::vector<std::string>& names) {
+    if (str.empty() || str[0] != '=') {
+        return std::string(str);
+    }
+
+    auto is_word = [](char c) {
+        return std::isalnum((unsigned char)c) || c == '_' || c == '$';
+    };
+    // length of the reference at i or 0, ranges count as one reference
+    auto reference_length = [&](size_t i) -> size_t {
+        auto single = [&](size_t start) -> size_t {
+            size_t end = start;
+            while (end < str.size() && is_word(str[end])) {
+                end++;
+            }
+            CellReference ref;
+            size_t j = start;
+            if (!CellReference::parse(ref, str.substr(0, end), j) || j != end) {
+                return 0;
+            }
+            return end - start;
+        };
+        size_t len = single(i);
+        if (len > 0 && i + len < str.size() && str[i + len] == ':') {
+            size_t end_len = single(i + len + 1);
+            if (end_len > 0) {
+                len += 1 + end_len;
+            }
+        }
+        return len;
+    };
+
+    std::string result;
+    size_t i = 0;
+    while (i < str.size()) {
+        char c = str[i];
+        if (c == '"') {
+            // "" is a quote inside of a string
+            size_t end = i + 1;
+            while (end < str.size()) {
+                if (str[end] == '"' && end + 1 < str.size()
+                    && str[end + 1] == '"') {
+                    end += 2;
+                } else if (str[end] == '"') {
+                    end++;
+                    break;
+                } else {
+                    end++;
+                }
+            }
+            result.append(str.substr(i, end - i));
+            i = end;
+        } else if (std::isdigit((unsigned char)c) || c == '.') {
+            // numbers may contain letters in the exponent, which are left to
+            // the parser with the rest of the number
+            size_t end = i;
+            while (end < str.size() && (is_word(str[end]) || str[end] == '.')) {
+                end++;
+            }
+            result.append(str.substr(i, end - i));
+            i = end;
+        } else if (c == '\'' || is_word(c)) {
+            std::string name;
+            size_t end = i;
+            if (c == '\'') {
+                end++;
+                while (true) {
+                    if (end >= str.size()) {
+                        throw std::invalid_argument("Unterminated sheet name");
+                    }
+                    if (str[end] == '\'' && end + 1 < str.size()
+                        && str[end + 1] == '\'') {
+                        name += '\'';
+                        end += 2;
+                    } else if (str[end] == '\'') {
+                        end++;
+                        break;
+                    } else {
+                        name += str[end++];
+                    }
+                }
+                if (end >= str.size() || str[end] != '!') {
+                    throw std::invalid_argument("Missing '!' after sheet name");
+                }
+            } else {
+                while (end < str.size() && is_word(str[end])) {
+                    end++;
+                }
+                name = str.substr(i, end - i);
+            }
+
+            if (end < str.size() && str[end] == '!') {
+                size_t len = reference_length(end + 1);
+                if (name.empty() || len == 0) {
+                    throw std::invalid_argument("Invalid sheet reference");
+                }
+                names.push_back(std::move(name));
+                result.append(str.substr(end + 1, len));
+                i = end + 1 + len;
+            } else if (size_t len = reference_length(i)) {
+                names.push_back({});
+                result.append(str.substr(i, len));
+                i += len;
+            } else {
+                // function name
+                result.append(str.substr(i, end - i));
+                i = end;
+            }
+        } else {
+            result += c;
+            i++;
+        }
+    }
+    return result;
+}
+
+// builds references into the sheets named in front of them, resolve maps a
+// name to the index of the sheet, the parser reports references in source
+// order so each takes the next of the names given by split_sheet_names
+template<typename F>
+class SheetExpressionBuilder: public ExpressionBuilder {
+    std::vector<std::string> names;
+    size_t next = 0;
+    F resolve;
+
+    int next_sheet() {
+        if (next >= names.size()) {
+            throw std::invalid_argument("Unmatched sheet reference");
+        }
+        const std::string& name = names[next++];
+        return name.empty() ? LOCAL_SHEET : resolve(std::string_view(name));
+    }
+
+  public:
+    SheetExpressionBuilder(std::vector<std::string> names, F resolve) :
+        names(std::move(names)),
+        resolve(resolve) {}
+
+    virtual void valReference(std::string val) {
+        CellReference ref(val);
+        ref.sheet = next_sheet();
+        rawValReference(ref);
+    }
+
+    virtual void valRange(std::string val) {
+        CellRange range(val);
+        range.start.sheet = range.end.sheet = next_sheet();
+        rawValRange(range);
+    }
+
+    Expression finish() {
+        if (next != names.size()) {
+            throw std::invalid_argument("Unmatched sheet reference");
+        }
+        return ExpressionBuilder::finish();
+    }
+};
+
+enum class CycleState {
+    // not yet computed since the last change of the dependency graph
+    UNKNOWN,
+    ACYCLIC,
+    // the cell is part of a dependency cycle and evaluates to undefined
+    CYCLIC,
+};
+
+// the sheet compiled code runs in, the code calls fetch on the first use of
+// each input, so inputs of IF branches which aren't taken are never
+// evaluated, as in the interpreter
+struct NativeFrame {
+    // bring the input up to date and return its value, which stays in place
+    // while the code runs
+    const BoxedValue* (*fetch)(NativeFrame* frame, uint32_t input);
+};
+
+// machine code of a numeric formula, see NativeCompiler
+struct NativeFormula {
+    // called with room for the values of the inputs, all null, scratch
+    // space, the place of the result and the frame, returns 0 if an input
+    // was not a number or a division by zero happened, in which case the
+    // interpreter evaluates the formula
+    using Entry = int (*)(
+        const BoxedValue** inputs,
+        double* scratch,
+        double* result,
+        NativeFrame* frame
+    );
+
+    Entry entry = nullptr;
+    // references read by the code, in the order of the inputs
+    std::vector<const CellReference*> inputs;
+    // number of doubles of scratch space
+    uint32_t scratch = 0;
+    // bytes taken in the arena
+    uint32_t size = 0;
+};
+
+// compiled code of a cell, the code lives in the arena of the sheet and points
+// into the expression of the cell, so copies of the cell start without it
+struct NativeSlot {
+    std::unique_ptr<NativeFormula> formula;
+    // evaluations so far, counting stops when the cell gets compiled
+    uint32_t evaluations = 0;
+
+    NativeSlot() {}
+
+    NativeSlot(const NativeSlot&) {}
+
+    NativeSlot& operator=(const NativeSlot&) {
+        formula = nullptr;
+        evaluations = 0;
+        return *this;
+    }
+};
+
+// physical positions of the cells edited since the last version of a
+// VersionedSpreadsheet was published, copies start without a log, so a head
+// replaced by a copy is published from scratch
+struct VersionEdits {
+    // std::nullopt while the edits aren't known
+    std::optional<std::vector<CPos>> edits;
+
+    VersionEdits() {}
+
+    VersionEdits(const VersionEdits&) {}
+
+    VersionEdits& operator=(const VersionEdits&) {
+        edits.reset();
+        return *this;
+    }
+};
+
 class Cell {
     Expression expression {};
-    CValue cached_value = UNDEFINED;
-    bool dirty = true;
+    // common subexpressions of the formula, evaluated at most once per
+    // evaluation of the cell
+    std::vector<Expression> locals {};
+    BoxedValue cached_value = BOXED_UNDEFINED;
+    // revision in which cached_value last changed
+    uint64_t changed_at = 0;
+    // revision in which cached_value was last known to be up to date, 0 if it
+    // was never computed
+    uint64_t verified_at = 0;
+    CycleState cycle = CycleState::UNKNOWN;
+    // structure revision in which the cycle state was computed
+    uint64_t cycle_revision = 0;
+    NativeSlot native {};
+
+    // the parser fails on empty contents too, but pads the position in its
+    // message with an arbitrary number of spaces
+    static void reject_empty(const std::string& str) {
+        if (str.empty()) {
+            throw std::invalid_argument("empty contents");
+        }
+    }
 
   public:
     Cell() = delete;
@@ -461,11 +975,24 @@ class Cell {
     Cell(Expression expr) : expression(expr) {}
 
     Cell(const std::string& str) {
+        reject_empty(str);
         ExpressionBuilder builder {};
         parseExpression(str, builder);
         expression = builder.finish();
     }
 
+    // parse a formula whose references may be qualified by sheet names,
+    // resolve maps a name to the index of the sheet
+    template<typename F>
+    Cell(const std::string& str, F resolve) {
+        reject_empty(str);
+        std::vector<std::string> names;
+        std::string unqualified = split_sheet_names(str, names);
+        SheetExpressionBuilder<F> builder(std::move(names), resolve);
+        parseExpression(std::move(unqualified), builder);
+        expression = builder.finish();
+    }
+
     template<typename F>
     static void visit_expression(Expression& expr, F fun) {
         on_variant<Function>(expr, [fun](Function& function) {
@@ -509,21 +1036,34 @@ class Cell {
         }
     }
 
-    // call closure for all cell references in expression
+    // visit the expression and all of its locals
+    template<typename F>
+    void visit_all(F fun) {
+        for (auto& local : locals) {
+            Cell::visit_expression(local, fun);
+        }
+        Cell::visit_expression(expression, fun);
+    }
+
+    // call closure for all cells of the own sheet referenced by expression
     template<typename F>
     void on_cell_references(F fun) {
-        Cell::visit_expression(expression, [fun](Expression& expr) {
+        visit_all([fun](Expression& expr) {
             Cell::on_variant<CellReference>(expr, [fun](auto& c) {
-                fun(c.pos);
+                if (c.sheet == LOCAL_SHEET) {
+                    fun(c.pos);
+                }
             });
             Cell::on_variant<CellRange>(expr, [fun](auto& c) {
-                c.for_cells(fun);
+                if (c.start.sheet == LOCAL_SHEET) {
+                    c.for_cells(fun);
+                }
             });
         });
     }
 
     void apply_offset(std::pair<int, int> offset) {
-        Cell::visit_expression(expression, [&](Expression& expr) {
+        visit_all([&](Expression& expr) {
             Cell::on_variant<CellReference>(expr, [&](auto& c) {
                 c.apply_relative_offset(offset);
             });
@@ -534,162 +1074,428 @@ class Cell {
         });
     }
 
-    friend class CSpreadsheet;
-};
-
-class StreamWriter {
-    std::ostream& os;
-
-  public:
-    StreamWriter(std::ostream& os) : os(os) {}
-
-    std::ostream& get_inner() {
-        return os;
+    // call closure for all ranges of the own sheet counted by COUNT_VAL
+    template<typename F>
+    void on_counted_ranges(F fun) {
+        visit_all([fun](Expression& expr) {
+            Cell::on_variant<Function>(expr, [fun](Function& function) {
+                if (function.kind == FunctionKind::COUNT_VAL) {
+                    Cell::on_variant<CellRange>(
+                        function.arguments[1],
+                        [fun](auto& c) {
+                            if (c.start.sheet == LOCAL_SHEET) {
+                                fun(c);
+                            }
+                        }
+                    );
+                }
+            });
+        });
     }
 
-    void write_i8(int8_t value) {
-        os.write(reinterpret_cast<const char*>(&value), sizeof(int8_t));
+    // heap bytes of an expression, argument arrays are prefixed by their
+    // length since Expression has a destructor
+    static size_t expression_bytes(const Expression& expr) {
+        size_t bytes = 0;
+        Cell::visit_expression(expr, [&](const Expression& e) {
+            Cell::on_variant<std::string>(e, [&](const std::string& str) {
+                bytes += string_bytes(str);
+            });
+            Cell::on_variant<Function>(e, [&](const Function& function) {
+                bytes += allocation_bytes(
+                    sizeof(size_t)
+                    + function.argument_count() * sizeof(Expression)
+                );
+            });
+        });
+        return bytes;
     }
 
-    void write_i32(int32_t value) {
-        os.write(reinterpret_cast<const char*>(&value), sizeof(int32_t));
+    // heap bytes of the formula and its locals
+    size_t memory_bytes() const {
+        size_t bytes =
+            Cell::expression_bytes(expression) + vector_bytes(locals);
+        for (const auto& local : locals) {
+            bytes += Cell::expression_bytes(local);
+        }
+        if (native.formula) {
+            bytes += allocation_bytes(sizeof(NativeFormula))
+                + vector_bytes(native.formula->inputs);
+        }
+        return bytes;
     }
 
-    void write_i64(int64_t value) {
-        os.write(reinterpret_cast<const char*>(&value), sizeof(int64_t));
-    }
+    friend class CSpreadsheet;
+    friend void optimize_cell(Cell& cell);
+};
 
-    void write_double(double value) {
-        os.write(reinterpret_cast<const char*>(&value), sizeof(double));
+using RangeKey = std::pair<CPos, CPos>;
+
+// histogram of the values in a range, shared by all COUNT_VAL cells counting
+// over the same absolute range
+struct RangeIndex {
+    // keyed by the bits of the value, with zero normalized to +0
+    std::unordered_map<uint64_t, unsigned> histogram;
+    // the value counted for each cell of the range in for_cells order
+    std::vector<BoxedValue> counted;
+    bool built = false;
+    // counted holds every cell of the logical rectangle of the range, so the
+    // slot of a cell can be computed from its position
+    bool dense = false;
+    // revision in which the histogram was last brought up to date
+    uint64_t verified_at = 0;
+    // the index is being built or refreshed further up the call stack
+    bool refreshing = false;
+
+    // NaN never compares equal to anything so it is never counted
+    static bool is_countable(BoxedValue value) {
+        return !value.is_number() || !std::isnan(value.number());
     }
 
-    void write_string(std::string_view str) {
-        os.write(str.data(), (std::streamsize)str.size());
-        os.put(0);
+    // -0 == 0 but their bits differ
+    static uint64_t key(BoxedValue value) {
+        if (value.is_number() && value.number() == 0.0) {
+            return BoxedValue(0.0).to_bits();
+        }
+        return value.to_bits();
     }
 
-    void write_cell_pos(CPos pos) {
-        write_i32(pos.x);
-        write_i32(pos.y);
+    void add(BoxedValue value) {
+        if (is_countable(value)) {
+            histogram[key(value)]++;
+        }
     }
 
-    void write_cell_ref(const CellReference& cell) {
-        write_cell_pos(cell.pos);
-        write_i8((int8_t)cell.x_absolute);
-        write_i8((int8_t)cell.y_absolute);
+    void remove(BoxedValue value) {
+        auto entry = histogram.find(key(value));
+        if (entry != histogram.end() && --entry->second == 0) {
+            histogram.erase(entry);
+        }
     }
 
-    void _inner_write_expression(const Expression& expr) {
-        write_i8((int8_t)expr.index());
-        // std::monostate
-        // double
-        // std::string
-        // CellReference
-        // CellRange
-        // Function
-        switch (expr.index()) {
-            case 0:
-                break;
-            case 1:
-                write_double(std::get<double>(expr));
-                break;
-            case 2:
-                write_string(std::get<std::string>(expr));
-                break;
-            case 3: {
-                CellReference ref = std::get<CellReference>(expr);
-                write_cell_ref(ref);
-                break;
-            }
-            case 4: {
-                CellRange range = std::get<CellRange>(expr);
-                write_cell_ref(range.start);
-                write_cell_ref(range.end);
-                break;
-            }
-            case 5: {
-                Function function = std::get<Function>(expr);
-                write_i8((int8_t)function.kind);
-                break;
-            };
-            default:
-                assert(false);
+    unsigned count(BoxedValue value) const {
+        auto entry = histogram.find(key(value));
+        if (entry == histogram.end()) {
+            return 0;
         }
+        return entry->second;
     }
 
-    void write_expression(const Expression& expr) {
-        Cell::visit_expression(expr, [&](const Expression& expr) {
-            _inner_write_expression(expr);
-        });
-        write_i8(-1);
+    size_t memory_bytes() const {
+        return hash_table_bytes(histogram, false) + vector_bytes(counted);
     }
 };
 
-class StreamReader {
-    std::vector<char> buffer;
-    std::istream& os;
+// little endian encoder into a growing buffer
+class ByteWriter {
+    std::string buffer;
 
-  public:
-    StreamReader(std::istream& os) : os(os) {}
+    template<typename T>
+    void write_le(T value) {
+        char bytes[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); i++) {
+            bytes[i] = (char)(value >> (8 * i));
+        }
+        buffer.append(bytes, sizeof(T));
+    }
 
-    int8_t read_i8() {
-        int8_t value = 0;
-        os.read(reinterpret_cast<char*>(&value), sizeof(int8_t));
-        return value;
+  public:
+    std::string& data() {
+        return buffer;
     }
 
-    int32_t read_i32() {
-        int32_t value = 0;
-        os.read(reinterpret_cast<char*>(&value), sizeof(int32_t));
-        return value;
+    void write_u8(uint8_t value) {
+        buffer.push_back((char)value);
     }
 
-    int64_t read_i64() {
-        int64_t value = 0;
-        os.read(reinterpret_cast<char*>(&value), sizeof(int64_t));
-        return value;
+    void write_u32(uint32_t value) {
+        write_le(value);
     }
 
-    double read_double() {
-        double value = 0;
-        os.read(reinterpret_cast<char*>(&value), sizeof(double));
-        return value;
+    void write_u64(uint64_t value) {
+        write_le(value);
     }
 
-    std::string_view read_string() {
-        buffer.clear();
-        if (os.bad()) {
-            return "";
+    // overwrite 8 already written bytes
+    void write_u64_at(size_t offset, uint64_t value) {
+        for (size_t i = 0; i < sizeof(uint64_t); i++) {
+            buffer[offset + i] = (char)(value >> (8 * i));
         }
+    }
 
-        while (true) {
-            int c = os.get();
-            if (c == EOF || c == 0) {
-                break;
-            }
-            buffer.push_back((char)c);
+    void write_varint(uint64_t value) {
+        while (value >= 0x80) {
+            write_u8((uint8_t)(value | 0x80));
+            value >>= 7;
         }
+        write_u8((uint8_t)value);
+    }
 
-        return std::string_view(buffer.data(), buffer.size());
+    // small negative numbers are encoded in few bytes as well
+    void write_zigzag(int64_t value) {
+        write_varint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
     }
 
-    CPos read_cell_pos() {
-        CPos pos {};
-        pos.x = read_i32();
-        pos.y = read_i32();
-        return pos;
+    void write_double(double value) {
+        uint64_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(double));
+        write_u64(bits);
     }
 
-    CellReference read_cell_ref() {
-        CellReference cell {};
+    void write_bytes(std::string_view bytes) {
+        buffer.append(bytes);
+    }
+};
+
+// bounds checked little endian decoder of a buffer in memory, reading past
+// the end returns zeros and sets the failed flag
+class ByteReader {
+    std::string_view data;
+    size_t offset = 0;
+    bool error = false;
+
+    template<typename T>
+    T read_le() {
+        if (data.size() - offset < sizeof(T)) {
+            error = true;
+            offset = data.size();
+            return 0;
+        }
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            value |= (T)(uint8_t)data[offset + i] << (8 * i);
+        }
+        offset += sizeof(T);
+        return value;
+    }
+
+  public:
+    ByteReader(std::string_view data) : data(data) {}
+
+    bool failed() const {
+        return error;
+    }
+
+    bool at_end() const {
+        return offset == data.size();
+    }
+
+    size_t position() const {
+        return offset;
+    }
+
+    uint8_t read_u8() {
+        return read_le<uint8_t>();
+    }
+
+    uint32_t read_u32() {
+        return read_le<uint32_t>();
+    }
+
+    uint64_t read_u64() {
+        return read_le<uint64_t>();
+    }
+
+    uint64_t read_varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = read_u8();
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        error = true;
+        return 0;
+    }
+
+    int64_t read_zigzag() {
+        uint64_t value = read_varint();
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+
+    double read_double() {
+        uint64_t bits = read_u64();
+        double value = 0;
+        std::memcpy(&value, &bits, sizeof(double));
+        return value;
+    }
+
+    // the returned view points into the read buffer
+    std::string_view read_bytes(size_t size) {
+        if (data.size() - offset < size) {
+            error = true;
+            offset = data.size();
+            return "";
+        }
+        std::string_view bytes = data.substr(offset, size);
+        offset += size;
+        return bytes;
+    }
+
+    // read up to the terminator and skip it
+    std::string_view read_terminated(char terminator) {
+        size_t end = data.find(terminator, offset);
+        if (end == std::string_view::npos) {
+            error = true;
+            offset = data.size();
+            return "";
+        }
+        std::string_view bytes = data.substr(offset, end - offset);
+        offset = end + 1;
+        return bytes;
+    }
+};
+
+// encoder of the snapshot format, the data is collected in memory and
+// written out at once
+class StreamWriter: public ByteWriter {
+  public:
+    void write_i8(int8_t value) {
+        write_u8((uint8_t)value);
+    }
+
+    void write_i32(int32_t value) {
+        write_u32((uint32_t)value);
+    }
+
+    void write_i64(int64_t value) {
+        write_u64((uint64_t)value);
+    }
+
+    void write_string(std::string_view str) {
+        write_bytes(str);
+        write_u8(0);
+    }
+
+    void write_cell_pos(CPos pos) {
+        write_i32(pos.x);
+        write_i32(pos.y);
+    }
+
+    // the second bit of the first flag marks a reference into another sheet
+    // of a workbook, the index of the sheet follows the flags
+    void write_cell_ref(const CellReference& cell) {
+        bool external = cell.sheet != LOCAL_SHEET;
+        write_cell_pos(cell.pos);
+        write_i8((int8_t)(cell.x_absolute | external << 1));
+        write_i8((int8_t)cell.y_absolute);
+        if (external) {
+            write_i32(cell.sheet);
+        }
+    }
+
+    void _inner_write_expression(const Expression& expr) {
+        write_i8((int8_t)expr.index());
+        // std::monostate
+        // double
+        // std::string
+        // CellReference
+        // CellRange
+        // Function
+        switch (expr.index()) {
+            case 0:
+                break;
+            case 1:
+                write_double(std::get<double>(expr));
+                break;
+            case 2:
+                write_string(std::get<std::string>(expr));
+                break;
+            case 3: {
+                CellReference ref = std::get<CellReference>(expr);
+                write_cell_ref(ref);
+                break;
+            }
+            case 4: {
+                CellRange range = std::get<CellRange>(expr);
+                write_cell_ref(range.start);
+                write_cell_ref(range.end);
+                break;
+            }
+            case 5: {
+                Function function = std::get<Function>(expr);
+                write_i8((int8_t)function.kind);
+                break;
+            };
+            default:
+                assert(false);
+        }
+    }
+
+    // locals are written inline, the reader recovers them by optimizing
+    void _write_expression_tree(
+        const Expression& expr,
+        const std::vector<Expression>& locals
+    ) {
+        if (std::holds_alternative<LocalReference>(expr)) {
+            LocalReference local = std::get<LocalReference>(expr);
+            _write_expression_tree(locals[local.index], locals);
+            return;
+        }
+        Cell::on_variant<Function>(expr, [&](const Function& function) {
+            for (const auto& arg : function) {
+                _write_expression_tree(arg, locals);
+            }
+        });
+        _inner_write_expression(expr);
+    }
+
+    void write_expression(
+        const Expression& expr,
+        const std::vector<Expression>& locals = {}
+    ) {
+        _write_expression_tree(expr, locals);
+        write_i8(-1);
+    }
+};
+
+// decoder of the snapshot format from a buffer in memory
+class StreamReader: public ByteReader {
+  public:
+    StreamReader(std::string_view data) : ByteReader(data) {}
+
+    int8_t read_i8() {
+        return (int8_t)read_u8();
+    }
+
+    int32_t read_i32() {
+        return (int32_t)read_u32();
+    }
+
+    int64_t read_i64() {
+        return (int64_t)read_u64();
+    }
+
+    // the returned view points into the read buffer
+    std::string_view read_string() {
+        return read_terminated(0);
+    }
+
+    CPos read_cell_pos() {
+        CPos pos {};
+        pos.x = read_i32();
+        pos.y = read_i32();
+        return pos;
+    }
+
+    CellReference read_cell_ref() {
+        CellReference cell {};
         cell.pos = read_cell_pos();
-        cell.x_absolute = (bool)read_i8();
+        int8_t flags = read_i8();
+        cell.x_absolute = flags & 1;
         cell.y_absolute = (bool)read_i8();
+        if (flags & 2) {
+            cell.sheet = read_i32();
+        }
         return cell;
     }
 
     bool _inner_read_expression(ExpressionBuilder& builder) {
         int8_t kind = read_i8();
+        if (failed()) {
+            return false;
+        }
         // std::monostate
         // double
         // std::string
@@ -753,23 +1559,10 @@ class FnvHasher {
         state *= FNV_PRIME;
     }
 
-    void hash_istream(std::istream& is) {
-        if (is.fail()) {
-            return;
-        }
-
-        auto position = is.tellg();
-
-        while (true) {
-            int c = is.get();
-            if (c == EOF) {
-                break;
-            }
-            hash_char((char)c);
+    void hash_bytes(std::string_view bytes) {
+        for (char c : bytes) {
+            hash_char(c);
         }
-
-        is.clear();
-        is.seekg(position);
     }
 
     unsigned int finish() {
@@ -777,542 +1570,5740 @@ class FnvHasher {
     }
 };
 
-class CSpreadsheet {
-    std::map<CPos, Cell> cells;
-    std::set<std::pair<CPos, CPos>> edges;
-    std::set<CPos> call_stack;
-
-  public:
-    CSpreadsheet() {}
+void optimize_cell(Cell& cell);
 
-    CSpreadsheet(const CSpreadsheet& other) = default;
-    CSpreadsheet(CSpreadsheet&& other) = default;
-    CSpreadsheet& operator=(const CSpreadsheet& other) = default;
+// values of the locals of the cell being evaluated
+struct LocalFrame {
+    const std::vector<Expression>& locals;
+    std::vector<std::optional<BoxedValue>> values;
 
-    static unsigned capabilities() {
-        return SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FUNCTIONS
-            | SPREADSHEET_SPEED | SPREADSHEET_FILE_IO;
-    }
+    LocalFrame(const std::vector<Expression>& locals) :
+        locals(locals),
+        values(locals.size()) {}
+};
 
-    bool load(std::istream& is) {
-        StreamReader w(is);
+// executable memory for the native formulas of one sheet, every block is
+// mapped twice, writable and executable, so no page is both
+//
+// copies start empty, the cells they copy don't keep their code
+class NativeArena {
+    struct Block {
+        uint8_t* writable;
+        uint8_t* executable;
+        size_t size;
+        size_t used;
+    };
+
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    // beyond this nothing is compiled until the arena is cleared
+    static constexpr size_t LIMIT = 16 * 1024 * 1024;
+
+    std::vector<Block> blocks;
+    size_t mapped = 0;
+    // bytes of code of cells which were replaced or removed since
+    size_t released = 0;
 
-        int64_t saved_hash = w.read_i64();
+  public:
+    NativeArena() {}
 
-        FnvHasher hasher;
-        hasher.hash_istream(is);
-        unsigned int hash = hasher.finish();
+    NativeArena(const NativeArena&) {}
 
-        if (hash != saved_hash) {
-            return false;
-        }
+    NativeArena(NativeArena&& other) :
+        blocks(std::exchange(other.blocks, {})),
+        mapped(std::exchange(other.mapped, 0)),
+        released(std::exchange(other.released, 0)) {}
 
-        cells.clear();
-        edges.clear();
+    NativeArena& operator=(const NativeArena&) {
+        clear();
+        return *this;
+    }
 
-        ExpressionBuilder builder {};
+    ~NativeArena() {
+        clear();
+    }
 
-        int64_t cells_len = w.read_i64();
-        for (int64_t i = 0; i < cells_len; i++) {
-            CPos pos = w.read_cell_pos();
-            w.read_expression(builder);
-            Cell cell(builder.finish());
+    bool full() const {
+        return mapped >= LIMIT;
+    }
 
-            cells.insert({pos, cell});
-        }
+    void release(size_t bytes) {
+        released += bytes;
+    }
 
-        int64_t edges_len = w.read_i64();
-        for (int64_t i = 0; i < edges_len; i++) {
-            CPos a = w.read_cell_pos();
-            CPos b = w.read_cell_pos();
+    // whether clearing would make room for at least as much code as is live
+    bool reclaimable() const {
+        return full() && 2 * released >= mapped;
+    }
 
-            edges.insert({a, b});
+    // copy code into executable memory, nullptr if that is not possible
+    void* add(const std::vector<uint8_t>& code) {
+#if VELKA_JIT
+        if (blocks.empty() || blocks.back().size - blocks.back().used
+                < code.size()) {
+            if (mapped + BLOCK_SIZE > LIMIT || code.size() > BLOCK_SIZE) {
+                return nullptr;
+            }
+            int fd = memfd_create("velka-jit", MFD_CLOEXEC);
+            if (fd < 0) {
+                return nullptr;
+            }
+            void* writable = MAP_FAILED;
+            void* executable = MAP_FAILED;
+            if (ftruncate(fd, BLOCK_SIZE) == 0) {
+                writable = mmap(
+                    nullptr,
+                    BLOCK_SIZE,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    fd,
+                    0
+                );
+                executable = mmap(
+                    nullptr,
+                    BLOCK_SIZE,
+                    PROT_READ | PROT_EXEC,
+                    MAP_SHARED,
+                    fd,
+                    0
+                );
+            }
+            close(fd);
+            if (writable == MAP_FAILED || executable == MAP_FAILED) {
+                if (writable != MAP_FAILED) {
+                    munmap(writable, BLOCK_SIZE);
+                }
+                if (executable != MAP_FAILED) {
+                    munmap(executable, BLOCK_SIZE);
+                }
+                return nullptr;
+            }
+            blocks.push_back(
+                {(uint8_t*)writable, (uint8_t*)executable, BLOCK_SIZE, 0}
+            );
+            mapped += BLOCK_SIZE;
         }
 
-        return !is.fail();
+        Block& block = blocks.back();
+        std::memcpy(block.writable + block.used, code.data(), code.size());
+        uint8_t* start = block.executable + block.used;
+        // keep functions 16 byte aligned
+        block.used = (block.used + code.size() + 15) & ~(size_t)15;
+        return start;
+#else
+        (void)code;
+        return nullptr;
+#endif
     }
 
-    bool save(std::ostream& os) const {
-        std::stringstream ss;
-
-        StreamWriter w(ss);
-
-        // leave space for hash
-        w.write_i64(0);
-
-        w.write_i64((int64_t)cells.size());
-        for (auto& pair : cells) {
-            w.write_cell_pos(pair.first);
-            w.write_expression(pair.second.expression);
+    void clear() {
+#if VELKA_JIT
+        for (Block& block : blocks) {
+            munmap(block.writable, block.size);
+            munmap(block.executable, block.size);
         }
+#endif
+        blocks = std::vector<Block>();
+        mapped = 0;
+        released = 0;
+    }
 
-        w.write_i64((int64_t)edges.size());
-        for (auto& pair : edges) {
-            w.write_cell_pos(pair.first);
-            w.write_cell_pos(pair.second);
-        }
+    size_t memory_bytes() const {
+        return mapped + vector_bytes(blocks);
+    }
+};
 
-        {
-            FnvHasher hasher;
-            ss.seekp(8);
-            ss.seekg(8);
-            hasher.hash_istream(ss);
-            unsigned int hash = hasher.finish();
+static double native_pow(double a, double b) {
+    return std::pow(a, b);
+}
 
-            w.get_inner().seekp(0);
-            w.write_i64(hash);
-        }
+// compiles formulas built only from numbers, references into the own sheet,
+// arithmetic, comparisons and IF into x86-64 code with the same results as
+// the interpreter
+//
+// inputs are fetched through the frame on their first use, the code gives up
+// when one of them is not a number and leaves the formula to the interpreter
+//
+// intermediate values live in xmm0 and xmm1, left operands are spilled into
+// a scratch slot of their own, so no register but callee saved ones is live
+// when an input is fetched, locals become subroutines which store their
+// value on the first call, registers:
+//   rbx  inputs, null until fetched
+//   r12  scratch, the value and a computed flag of each local come first
+//   r13  result
+//   r14  stack pointer of the body, restored when giving up
+//   r15  frame
+class NativeCompiler {
+    NativeFormula& formula;
+    const std::vector<Expression>& locals;
+    std::vector<uint8_t> code;
+    // scratch slot of the value and flag of the first local
+    uint32_t locals_slot = 0;
+    // positions of rel32 operands of jumps to the exit giving up
+    std::vector<size_t> fail_jumps;
+    // positions of rel32 operands of calls of locals
+    std::vector<std::pair<size_t, uint32_t>> local_calls;
+
+    void emit(std::initializer_list<uint8_t> bytes) {
+        code.insert(code.end(), bytes);
+    }
 
-        ss.seekg(0);
-        os.write(ss.view().data(), (long)ss.view().size());
+    void emit_u32(uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            code.push_back((uint8_t)(value >> (8 * i)));
+        }
+    }
 
-        return !os.fail();
+    void emit_u64(uint64_t value) {
+        emit_u32((uint32_t)value);
+        emit_u32((uint32_t)(value >> 32));
     }
 
-    void remove_cell_dependency(CPos from, CPos to) {
-        edges.erase(std::make_pair(from, to));
+    // emit a jump or call with a rel32 operand, return its position
+    size_t emit_jump(std::initializer_list<uint8_t> opcode) {
+        emit(opcode);
+        size_t at = code.size();
+        emit_u32(0);
+        return at;
     }
 
-    void add_cell_dependency(CPos from, CPos to) {
-        edges.insert(std::make_pair(from, to));
+    void patch(size_t at, size_t target) {
+        int32_t rel = (int32_t)(target - (at + 4));
+        std::memcpy(&code[at], &rel, sizeof(rel));
     }
 
-    // mark the pos and all cells that depend on it as dirty
-    void mark_dirty(CPos pos) {
-        auto entry = call_stack.insert(pos);
+    // movq xmm<reg>, rax after mov rax, bits
+    void emit_constant(uint64_t bits, uint8_t reg) {
+        emit({0x48, 0xb8});
+        emit_u64(bits);
+        emit({0x66, 0x48, 0x0f, 0x6e, (uint8_t)(0xc0 | reg << 3)});
+    }
 
-        if (!entry.second) {
-            return;
-        }
+    // movsd [r12 + 8 * slot], xmm0
+    void emit_store(uint32_t slot) {
+        emit({0xf2, 0x41, 0x0f, 0x11, 0x84, 0x24});
+        emit_u32(slot * 8);
+    }
 
-        {
-            auto entry = cells.find(pos);
-            if (entry == cells.end()) {
-                return;
-            }
+    // movsd xmm0, [r12 + 8 * slot]
+    void emit_load(uint32_t slot) {
+        emit({0xf2, 0x41, 0x0f, 0x10, 0x84, 0x24});
+        emit_u32(slot * 8);
+    }
 
-            Cell& cell_entry = entry->second;
-            cell_entry.dirty = true;
+    // mov qword [r12 + 8 * slot], value
+    void emit_set(uint32_t slot, uint32_t value) {
+        emit({0x49, 0xc7, 0x84, 0x24});
+        emit_u32(slot * 8);
+        emit_u32(value);
+    }
 
-            auto children =
-                edges.lower_bound(std::make_pair(pos, CPos(INT_MIN, INT_MIN)));
+    static bool same_reference(const CellReference& a, const CellReference& b) {
+        return a.pos == b.pos && a.x_absolute == b.x_absolute
+            && a.y_absolute == b.y_absolute;
+    }
 
-            for (; children != edges.end() && children->first == pos;
-                 children++) {
-                mark_dirty(children->second);
-            }
+    uint32_t input_of(const CellReference& ref) const {
+        uint32_t input = 0;
+        while (!same_reference(*formula.inputs[input], ref)) {
+            input++;
         }
-
-        call_stack.erase(entry.first);
+        return input;
     }
 
-    bool setCell_internal(CPos pos, Cell cell) {
-        auto entry = cells.find(pos);
-        if (entry != cells.end()) {
-            entry->second.on_cell_references([&](CPos c) {
-                this->remove_cell_dependency(c, pos);
+    // repeated references share an input, they move together when the
+    // formula is copied
+    bool collect_inputs(const Expression& expr) {
+        bool valid = true;
+        Cell::visit_expression(expr, [&](const Expression& e) {
+            Cell::on_variant<CellReference>(e, [&](const CellReference& ref) {
+                if (ref.sheet != LOCAL_SHEET) {
+                    valid = false;
+                    return;
+                }
+                for (const CellReference* input : formula.inputs) {
+                    if (same_reference(*input, ref)) {
+                        return;
+                    }
+                }
+                formula.inputs.push_back(&ref);
             });
-
-            entry->second = std::move(cell);
-        } else {
-            entry = cells.insert({pos, std::move(cell)}).first;
-        }
-
-        entry->second.on_cell_references([&](CPos c) {
-            this->add_cell_dependency(c, pos);
         });
-
-        mark_dirty(pos);
-
-        return true;
-    }
-
-    bool setCell(CPos pos, std::string contents) {
-        try {
-            return setCell_internal(pos, Cell(contents));
-        } catch (std::invalid_argument& e) {
-            return false;
-        }
+        return valid;
     }
 
-    Cell* get_cell(CPos pos) {
-        try {
-            return &cells.at(pos);
-        } catch (const std::out_of_range& e) {
-            return nullptr;
-        }
+    // value of the input into xmm0, fetched on its first use, giving up on
+    // values which are not numbers
+    void emit_input(uint32_t input) {
+        // undefined and strings have the two tags following each other above
+        // the tag of NaN
+        uint64_t tag = BOXED_UNDEFINED.to_bits() >> 48;
+        assert((BoxedValue::string(0).to_bits() >> 48) == tag + 1);
+
+        // mov rax, [rbx + 8 * input]; test rax, rax; jnz fetched
+        emit({0x48, 0x8b, 0x83});
+        emit_u32(input * 8);
+        emit({0x48, 0x85, 0xc0, 0x75, 0});
+        size_t fetch = code.size();
+        // mov rdi, r15; mov esi, input; call [r15]
+        emit({0x4c, 0x89, 0xff, 0xbe});
+        emit_u32(input);
+        emit({0x41, 0xff, 0x17});
+        // mov [rbx + 8 * input], rax
+        emit({0x48, 0x89, 0x83});
+        emit_u32(input * 8);
+        code[fetch - 1] = (uint8_t)(code.size() - fetch);
+        // fetched: mov rax, [rax]
+        emit({0x48, 0x8b, 0x00});
+        // mov rcx, rax; shr rcx, 48; sub ecx, tag; cmp ecx, 1; jbe fail
+        emit({0x48, 0x89, 0xc1, 0x48, 0xc1, 0xe9, 0x30, 0x81, 0xe9});
+        emit_u32((uint32_t)tag);
+        emit({0x83, 0xf9, 0x01});
+        fail_jumps.push_back(emit_jump({0x0f, 0x86}));
+        // movq xmm0, rax
+        emit({0x66, 0x48, 0x0f, 0x6e, 0xc0});
     }
 
-    // fold a lambda over a cell range, undefined
-    CValue fold_range(
-        CellRange range,
-        double initial,
-        void (*fun)(double* acc, double input)
+    // value of the expression into xmm0
+    bool emit_expression(const Expression& expr) {
+        switch (expr.index()) {
+            case 1: {
+                uint64_t bits;
+                double value = std::get<double>(expr);
+                std::memcpy(&bits, &value, sizeof(bits));
+                emit_constant(bits, 0);
+                return true;
+            }
+            case 3: {
+                const CellReference& ref = std::get<CellReference>(expr);
+                emit_input(input_of(ref));
+                return true;
+            }
+            case 5:
+                return emit_function(std::get<Function>(expr));
+            case 6: {
+                uint32_t index = std::get<LocalReference>(expr).index;
+                if (index >= locals.size()) {
+                    return false;
+                }
+                // call local
+                local_calls.push_back({emit_jump({0xe8}), index});
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    bool emit_function(const Function& fun) {
+        switch (fun.kind) {
+            case FunctionKind::NEG:
+                if (!emit_expression(fun.arguments[0])) {
+                    return false;
+                }
+                // xorpd xmm0, xmm1 with the sign bit
+                emit_constant(0x8000000000000000, 1);
+                emit({0x66, 0x0f, 0x57, 0xc1});
+                return true;
+            case FunctionKind::IF: {
+                if (!emit_expression(fun.arguments[0])) {
+                    return false;
+                }
+                // xorpd xmm1, xmm1; ucomisd xmm0, xmm1, NaN counts as true
+                emit({0x66, 0x0f, 0x57, 0xc9, 0x66, 0x0f, 0x2e, 0xc1});
+                size_t unordered = emit_jump({0x0f, 0x8a});
+                size_t not_equal = emit_jump({0x0f, 0x85});
+                if (!emit_expression(fun.arguments[2])) {
+                    return false;
+                }
+                size_t end = emit_jump({0xe9});
+                patch(unordered, code.size());
+                patch(not_equal, code.size());
+                if (!emit_expression(fun.arguments[1])) {
+                    return false;
+                }
+                patch(end, code.size());
+                return true;
+            }
+            case FunctionKind::POW:
+            case FunctionKind::MUL:
+            case FunctionKind::DIV:
+            case FunctionKind::ADD:
+            case FunctionKind::SUB:
+            case FunctionKind::LT:
+            case FunctionKind::LE:
+            case FunctionKind::GT:
+            case FunctionKind::GE:
+            case FunctionKind::NE:
+            case FunctionKind::EQ:
+                break;
+            default:
+                return false;
+        }
+
+        uint32_t slot = formula.scratch++;
+        if (!emit_expression(fun.arguments[0])) {
+            return false;
+        }
+        emit_store(slot);
+        if (!emit_expression(fun.arguments[1])) {
+            return false;
+        }
+        // movapd xmm1, xmm0
+        emit({0x66, 0x0f, 0x28, 0xc8});
+        emit_load(slot);
+
+        switch (fun.kind) {
+            case FunctionKind::POW:
+                // the stack is kept 16 byte aligned for calls
+                emit({0x48, 0xb8});
+                emit_u64((uint64_t)(uintptr_t)&native_pow);
+                // call rax
+                emit({0xff, 0xd0});
+                break;
+            case FunctionKind::MUL:
+                emit({0xf2, 0x0f, 0x59, 0xc1});
+                break;
+            case FunctionKind::DIV:
+                // xorpd xmm2, xmm2; ucomisd xmm1, xmm2; jp +6; je fail
+                emit({0x66, 0x0f, 0x57, 0xd2, 0x66, 0x0f, 0x2e, 0xca});
+                emit({0x7a, 0x06});
+                fail_jumps.push_back(emit_jump({0x0f, 0x84}));
+                emit({0xf2, 0x0f, 0x5e, 0xc1});
+                break;
+            case FunctionKind::ADD:
+                emit({0xf2, 0x0f, 0x58, 0xc1});
+                break;
+            case FunctionKind::SUB:
+                emit({0xf2, 0x0f, 0x5c, 0xc1});
+                break;
+            default:
+                emit_comparison(fun.kind);
+                break;
+        }
+        return true;
+    }
+
+    // 1.0 or 0.0 into xmm0 from the operands in xmm0 and xmm1
+    void emit_comparison(FunctionKind kind) {
+        // cmpsd predicates, NE is true for NaN like != is
+        uint8_t predicate = 0;
+        bool swap = false;
+        switch (kind) {
+            case FunctionKind::EQ:
+                predicate = 0;
+                break;
+            case FunctionKind::LT:
+                predicate = 1;
+                break;
+            case FunctionKind::LE:
+                predicate = 2;
+                break;
+            case FunctionKind::NE:
+                predicate = 4;
+                break;
+            case FunctionKind::GT:
+                predicate = 1;
+                swap = true;
+                break;
+            case FunctionKind::GE:
+                predicate = 2;
+                swap = true;
+                break;
+            default:
+                assert(0 && "Not a comparison");
+                break;
+        }
+        if (swap) {
+            // cmpsd xmm1, xmm0, predicate; movapd xmm0, xmm1
+            emit({0xf2, 0x0f, 0xc2, 0xc8, predicate, 0x66, 0x0f, 0x28, 0xc1});
+        } else {
+            // cmpsd xmm0, xmm1, predicate
+            emit({0xf2, 0x0f, 0xc2, 0xc1, predicate});
+        }
+        // andpd xmm0, xmm2 with 1.0
+        emit_constant(0x3ff0000000000000, 2);
+        emit({0x66, 0x0f, 0x54, 0xc2});
+    }
+
+  public:
+    NativeCompiler(
+        NativeFormula& formula,
+        const std::vector<Expression>& locals
+    ) :
+        formula(formula),
+        locals(locals) {}
+
+    // machine code of the formula, std::nullopt if it can't be compiled
+    std::optional<std::vector<uint8_t>> compile(const Expression& root) {
+        formula.inputs.clear();
+        for (const auto& local : locals) {
+            if (!collect_inputs(local)) {
+                return std::nullopt;
+            }
+        }
+        if (!collect_inputs(root)) {
+            return std::nullopt;
+        }
+        formula.scratch = (uint32_t)(2 * locals.size());
+
+        // push rbx; push r12; push r13; push r14; push r15
+        emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+        // mov rbx, rdi; mov r12, rsi; mov r13, rdx; mov r15, rcx; mov r14, rsp
+        emit({0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4, 0x49, 0x89, 0xd5});
+        emit({0x49, 0x89, 0xcf, 0x49, 0x89, 0xe6});
+        for (uint32_t i = 0; i < locals.size(); i++) {
+            emit_set(locals_slot + 2 * i + 1, 0);
+        }
+
+        if (!emit_expression(root)) {
+            return std::nullopt;
+        }
+        // movsd [r13], xmm0; mov eax, 1; jmp exit
+        emit({0xf2, 0x41, 0x0f, 0x11, 0x45, 0x00, 0xb8, 1, 0, 0, 0, 0xeb, 5});
+        size_t fail = code.size();
+        // mov rsp, r14; xor eax, eax
+        emit({0x4c, 0x89, 0xf4, 0x31, 0xc0});
+        // pop r15; pop r14; pop r13; pop r12; pop rbx; ret
+        emit({0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3});
+
+        std::vector<size_t> subroutines;
+        for (uint32_t i = 0; i < locals.size(); i++) {
+            subroutines.push_back(code.size());
+            // sub rsp, 8; cmp qword [r12 + 8 * flag], 0; jne computed
+            uint32_t slot = locals_slot + 2 * i;
+            emit({0x48, 0x83, 0xec, 8, 0x49, 0x83, 0xbc, 0x24});
+            emit_u32((slot + 1) * 8);
+            emit({0});
+            size_t computed = emit_jump({0x0f, 0x85});
+            if (!emit_expression(locals[i])) {
+                return std::nullopt;
+            }
+            emit_store(slot);
+            emit_set(slot + 1, 1);
+            patch(computed, code.size());
+            emit_load(slot);
+            // add rsp, 8; ret
+            emit({0x48, 0x83, 0xc4, 8, 0xc3});
+        }
+
+        for (size_t at : fail_jumps) {
+            patch(at, fail);
+        }
+        for (auto [at, index] : local_calls) {
+            patch(at, subroutines[index]);
+        }
+        return std::move(code);
+    }
+};
+
+// compile a formula whose root is a function into the arena
+bool compile_native(
+    const Expression& root,
+    const std::vector<Expression>& locals,
+    NativeFormula& formula,
+    NativeArena& arena
+) {
+#if VELKA_JIT
+    if (!std::holds_alternative<Function>(root)) {
+        return false;
+    }
+    NativeCompiler compiler(formula, locals);
+    auto code = compiler.compile(root);
+    if (!code) {
+        return false;
+    }
+    formula.entry = (NativeFormula::Entry)arena.add(*code);
+    formula.size = (uint32_t)((code->size() + 15) & ~(size_t)15);
+    return formula.entry != nullptr;
+#else
+    (void)root;
+    (void)locals;
+    (void)formula;
+    (void)arena;
+    return false;
+#endif
+}
+
+// LZ77 codec for snapshot blocks, a block is a sequence of
+//   literal count (varint), literals,
+//   match length - MIN_MATCH (varint), match distance (varint)
+// where the last sequence ends after its literals
+class LzCodec {
+    static const size_t MIN_MATCH = 4;
+    static const int HASH_BITS = 14;
+    static const size_t MAX_DISTANCE = 1 << 16;
+
+    static uint32_t hash(const char* data) {
+        uint32_t sequence = 0;
+        std::memcpy(&sequence, data, sizeof(uint32_t));
+        return (sequence * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+  public:
+    static std::string compress(std::string_view input) {
+        ByteWriter w;
+        // last position of each hashed sequence, shifted by one
+        std::vector<uint32_t> table((size_t)1 << HASH_BITS, 0);
+
+        size_t anchor = 0;
+        size_t i = 0;
+        while (i + MIN_MATCH <= input.size()) {
+            uint32_t& slot = table[hash(&input[i])];
+            size_t candidate = slot;
+            slot = (uint32_t)(i + 1);
+
+            if (candidate == 0 || i + 1 - candidate > MAX_DISTANCE
+                || std::memcmp(&input[candidate - 1], &input[i], MIN_MATCH)
+                    != 0) {
+                i++;
+                continue;
+            }
+            candidate--;
+
+            size_t length = MIN_MATCH;
+            while (i + length < input.size()
+                   && input[candidate + length] == input[i + length]) {
+                length++;
+            }
+
+            w.write_varint(i - anchor);
+            w.write_bytes(input.substr(anchor, i - anchor));
+            w.write_varint(length - MIN_MATCH);
+            w.write_varint(i - candidate);
+
+            i += length;
+            anchor = i;
+        }
+
+        w.write_varint(input.size() - anchor);
+        w.write_bytes(input.substr(anchor));
+        return std::move(w.data());
+    }
+
+    static bool
+    decompress(std::string_view input, size_t size, std::string& output) {
+        output.clear();
+        output.reserve(size);
+
+        ByteReader r(input);
+        while (true) {
+            uint64_t literals = r.read_varint();
+            if (literals > size - output.size()) {
+                return false;
+            }
+            output.append(r.read_bytes(literals));
+            if (r.failed()) {
+                return false;
+            }
+            if (r.at_end()) {
+                break;
+            }
+
+            uint64_t length = r.read_varint() + MIN_MATCH;
+            uint64_t distance = r.read_varint();
+            if (r.failed() || distance == 0 || distance > output.size()
+                || length > size - output.size()) {
+                return false;
+            }
+
+            // the match may overlap the bytes it produces
+            size_t from = output.size() - distance;
+            for (size_t i = 0; i < length; i++) {
+                output.push_back(output[from + i]);
+            }
+        }
+        return output.size() == size;
+    }
+};
+
+// run fun(0) .. fun(count - 1) on up to threads threads, the first exception
+// thrown by fun is rethrown once all threads stopped
+template<typename F>
+void parallel_for(size_t count, unsigned threads, F fun) {
+    size_t workers = std::min<size_t>(std::max(threads, 1u), count);
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fun(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex error_lock;
+    auto work = [&] {
+        try {
+            for (size_t i = next++; i < count; i = next++) {
+                fun(i);
+            }
+        } catch (...) {
+            std::lock_guard guard(error_lock);
+            if (!error) {
+                error = std::current_exception();
+            }
+            // the other threads take no new work
+            next = count;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; i++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// encoding of cells in compressed snapshots, positions are stored relative
+// to the previous cell and relative references relative to their cell, so
+// that copied formulas encode into the same bytes
+class CompactWriter: public ByteWriter {
+    CPos previous {0, 0};
+
+  public:
+    void write_cell_pos(CPos pos) {
+        write_zigzag((int64_t)pos.x - previous.x);
+        if (pos.x == previous.x) {
+            write_zigzag((int64_t)pos.y - previous.y);
+        } else {
+            write_zigzag(pos.y);
+        }
+        previous = pos;
+    }
+
+    void write_cell_ref(const CellReference& cell, CPos origin) {
+        bool external = cell.sheet != LOCAL_SHEET;
+        write_u8((uint8_t)(cell.x_absolute | cell.y_absolute << 1
+                           | external << 2));
+        if (external) {
+            write_varint((uint32_t)cell.sheet);
+        }
+        write_zigzag((int64_t)cell.pos.x - (cell.x_absolute ? 0 : origin.x));
+        write_zigzag((int64_t)cell.pos.y - (cell.y_absolute ? 0 : origin.y));
+    }
+
+    // same node order as StreamWriter, integers are stored as varints
+    void write_expression_tree(
+        const Expression& expr,
+        const std::vector<Expression>& locals,
+        CPos origin
     ) {
-        bool empty = true;
-        double acc = initial;
-        range.for_cells([&](CPos pos) {
-            const CValue& value = getValue_internal(pos);
-            if (std::holds_alternative<double>(value)) {
-                empty = false;
-                fun(&acc, std::get<double>(value));
+        switch (expr.index()) {
+            case 0:
+                write_u8(0);
+                break;
+            case 1: {
+                double value = std::get<double>(expr);
+                if (std::trunc(value) == value && std::abs(value) < 0x1p53
+                    && !std::signbit(value)) {
+                    write_u8(6);
+                    write_zigzag((int64_t)value);
+                } else {
+                    write_u8(1);
+                    write_double(value);
+                }
+                break;
+            }
+            case 2: {
+                const std::string& str = std::get<std::string>(expr);
+                write_u8(2);
+                write_varint(str.size());
+                write_bytes(str);
+                break;
+            }
+            case 3:
+                write_u8(3);
+                write_cell_ref(std::get<CellReference>(expr), origin);
+                break;
+            case 4: {
+                const CellRange& range = std::get<CellRange>(expr);
+                write_u8(4);
+                write_cell_ref(range.start, origin);
+                write_cell_ref(range.end, origin);
+                break;
+            }
+            case 5: {
+                const Function& function = std::get<Function>(expr);
+                for (const auto& arg : function) {
+                    write_expression_tree(arg, locals, origin);
+                }
+                write_u8(5);
+                write_u8((uint8_t)function.kind);
+                break;
+            }
+            case 6: {
+                LocalReference local = std::get<LocalReference>(expr);
+                write_expression_tree(locals[local.index], locals, origin);
+                break;
+            }
+            default:
+                assert(false);
+        }
+    }
+
+    void write_expression(
+        const Expression& expr,
+        const std::vector<Expression>& locals,
+        CPos origin
+    ) {
+        write_expression_tree(expr, locals, origin);
+        write_u8(0xff);
+    }
+};
+
+class CompactReader: public ByteReader {
+    CPos previous {0, 0};
+
+  public:
+    CompactReader(std::string_view data) : ByteReader(data) {}
+
+    CPos read_cell_pos() {
+        CPos pos {};
+        pos.x = (int)(previous.x + read_zigzag());
+        if (pos.x == previous.x) {
+            pos.y = (int)(previous.y + read_zigzag());
+        } else {
+            pos.y = (int)read_zigzag();
+        }
+        previous = pos;
+        return pos;
+    }
+
+    CellReference read_cell_ref(CPos origin) {
+        CellReference cell {};
+        uint8_t flags = read_u8();
+        cell.x_absolute = flags & 1;
+        cell.y_absolute = flags & 2;
+        if (flags & 4) {
+            cell.sheet = (int)read_varint();
+        }
+        cell.pos.x = (int)(read_zigzag() + (cell.x_absolute ? 0 : origin.x));
+        cell.pos.y = (int)(read_zigzag() + (cell.y_absolute ? 0 : origin.y));
+        return cell;
+    }
+
+    // returns false if the expression is malformed
+    bool read_expression(ExpressionBuilder& builder, CPos origin) {
+        size_t depth = 0;
+        while (!failed()) {
+            uint8_t kind = read_u8();
+            switch (kind) {
+                case 0:
+                    builder.valUndefined();
+                    break;
+                case 1:
+                    builder.valNumber(read_double());
+                    break;
+                case 2: {
+                    size_t size = read_varint();
+                    builder.valString(std::string(read_bytes(size)));
+                    break;
+                }
+                case 3:
+                    builder.rawValReference(read_cell_ref(origin));
+                    break;
+                case 4: {
+                    CellReference start = read_cell_ref(origin);
+                    CellReference end = read_cell_ref(origin);
+                    builder.rawValRange(CellRange {start, end});
+                    break;
+                }
+                case 5: {
+                    uint8_t function = read_u8();
+                    if (function > (uint8_t)FunctionKind::EQ) {
+                        return false;
+                    }
+                    size_t arguments = Function::static_argument_count(
+                        (FunctionKind)function
+                    );
+                    if (depth < arguments) {
+                        return false;
+                    }
+                    depth -= arguments;
+                    builder.rawFuncCall((FunctionKind)function);
+                    break;
+                }
+                case 6:
+                    builder.valNumber((double)read_zigzag());
+                    break;
+                case 0xff:
+                    return depth == 1;
+                default:
+                    return false;
+            }
+            depth++;
+        }
+        return false;
+    }
+};
+
+// cells are grouped into square chunks for delta snapshots
+using ChunkKey = std::pair<int, int>;
+
+const int CHUNK_BITS = 6;
+
+// written instead of the cell count by saveDelta
+const int64_t DELTA_MAGIC = 0x41544c4544'4b4c56;
+
+// written instead of the hash by saveCompressed, the hash has only 32 bits
+const uint64_t COMPRESSED_MAGIC = 0x31'5a414b4c4556;
+
+// uncompressed size after which a block of a compressed snapshot is closed
+const size_t COMPRESSED_BLOCK_SIZE = 1 << 16;
+
+// maps logical row or column numbers to the physical numbers cells and
+// references are stored with, inserting or deleting rows only changes the map
+// so cells and formulas below stay untouched
+//
+// logical numbers from 0 are covered by runs of consecutive physical numbers,
+// negative numbers above INT_MIN / 2 map to themselves, physical numbers of
+// inserted rows are taken from INT_MIN upwards
+class AxisMap {
+    struct Run {
+        int logical;
+        int physical;
+        int length;
+    };
+
+    // ordered by the logical start
+    std::vector<Run> runs {{0, 0, INT_MAX}};
+    // indices of runs ordered by the physical start
+    std::vector<size_t> by_physical {0};
+    int next_physical = INT_MIN;
+    // no rows were inserted or deleted yet
+    bool is_identity = true;
+
+    // index of the run containing a logical number
+    std::optional<size_t> find_logical(int logical) const {
+        auto it = std::upper_bound(
+            runs.begin(),
+            runs.end(),
+            logical,
+            [](int l, const Run& run) { return l < run.logical; }
+        );
+        if (it == runs.begin()) {
+            return std::nullopt;
+        }
+        it--;
+        if ((int64_t)logical - it->logical >= it->length) {
+            return std::nullopt;
+        }
+        return (size_t)(it - runs.begin());
+    }
+
+    // split runs so that one of them starts at logical, returns its index
+    size_t split(int logical) {
+        for (size_t i = 0; i < runs.size(); i++) {
+            Run& run = runs[i];
+            if (run.logical == logical) {
+                return i;
             }
+            if (run.logical < logical
+                && (int64_t)logical - run.logical < run.length) {
+                int head = logical - run.logical;
+                Run tail {logical, run.physical + head, run.length - head};
+                run.length = head;
+                runs.insert(runs.begin() + (ptrdiff_t)i + 1, tail);
+                return i + 1;
+            }
+        }
+        return runs.size();
+    }
+
+    // shift the logical start of runs from index i, dropping the parts which
+    // end up past INT_MAX
+    void shift(size_t i, int offset) {
+        for (; i < runs.size(); i++) {
+            int64_t start = (int64_t)runs[i].logical + offset;
+            if (start >= INT_MAX) {
+                runs.resize(i);
+                break;
+            }
+            runs[i].logical = (int)start;
+            runs[i].length =
+                (int)std::min<int64_t>(runs[i].length, INT_MAX - start);
+        }
+    }
+
+    void reindex() {
+        // merge neighbours which continue each other physically
+        std::vector<Run> merged;
+        for (const Run& run : runs) {
+            if (!merged.empty()) {
+                Run& last = merged.back();
+                if ((int64_t)last.logical + last.length == run.logical
+                    && (int64_t)last.physical + last.length == run.physical) {
+                    last.length += run.length;
+                    continue;
+                }
+            }
+            merged.push_back(run);
+        }
+        runs = std::move(merged);
+
+        by_physical.resize(runs.size());
+        for (size_t i = 0; i < runs.size(); i++) {
+            by_physical[i] = i;
+        }
+        std::sort(by_physical.begin(), by_physical.end(), [&](auto a, auto b) {
+            return runs[a].physical < runs[b].physical;
         });
 
-        if (empty) {
-            return UNDEFINED;
-        } else {
-            return CValue(acc);
+        is_identity = runs.size() == 1 && runs[0].logical == 0
+            && runs[0].physical == 0 && runs[0].length == INT_MAX;
+    }
+
+  public:
+    size_t memory_bytes() const {
+        return vector_bytes(runs) + vector_bytes(by_physical);
+    }
+
+    bool identity() const {
+        return is_identity;
+    }
+
+    std::optional<int> to_physical(int logical) const {
+        if (logical < 0 || identity()) {
+            return logical;
+        }
+        auto i = find_logical(logical);
+        if (!i) {
+            return std::nullopt;
+        }
+        return runs[*i].physical + (logical - runs[*i].logical);
+    }
+
+    // nullopt if the physical number was deleted
+    std::optional<int> to_logical(int physical) const {
+        if (identity() || (physical < 0 && physical >= next_physical)) {
+            return physical;
+        }
+
+        auto it = std::upper_bound(
+            by_physical.begin(),
+            by_physical.end(),
+            physical,
+            [&](int p, size_t i) { return p < runs[i].physical; }
+        );
+        if (it == by_physical.begin()) {
+            return std::nullopt;
+        }
+        const Run& run = runs[*(it - 1)];
+        if ((int64_t)physical - run.physical >= run.length) {
+            return std::nullopt;
+        }
+        return run.logical + (physical - run.physical);
+    }
+
+    // insert count new numbers before logical, returns false if logical isn't
+    // mapped or there are no unused physical numbers left
+    bool insert(int logical, int count) {
+        if (count <= 0 || !find_logical(logical)
+            || (int64_t)next_physical + count > INT_MIN / 2) {
+            return false;
+        }
+
+        size_t i = split(logical);
+        shift(i, count);
+        runs.insert(
+            runs.begin() + (ptrdiff_t)std::min(i, runs.size()),
+            Run {logical, next_physical, count}
+        );
+        next_physical += count;
+
+        reindex();
+        return true;
+    }
+
+    // delete count numbers from logical, returns the deleted physical numbers
+    // as (start, length) pairs
+    std::vector<std::pair<int, int>> erase(int logical, int count) {
+        std::vector<std::pair<int, int>> erased;
+        if (logical < 0 || count <= 0) {
+            return erased;
+        }
+
+        int64_t end = std::min<int64_t>((int64_t)logical + count, INT_MAX);
+        size_t first = split(logical);
+        size_t last = end < INT_MAX ? split((int)end) : runs.size();
+
+        for (size_t i = first; i < last; i++) {
+            erased.push_back({runs[i].physical, runs[i].length});
+        }
+        runs.erase(
+            runs.begin() + (ptrdiff_t)first,
+            runs.begin() + (ptrdiff_t)last
+        );
+        shift(first, -(int)(end - logical));
+
+        reindex();
+        return erased;
+    }
+};
+
+// strongly connected components of cells found by an iterative version of
+// Tarjan's algorithm, cells visited by an earlier search of the same finder
+// are not visited again
+class ComponentFinder {
+    struct Node {
+        unsigned index;
+        unsigned lowlink;
+        // position in component_stack while the cell is on it
+        size_t stack_position;
+        bool on_stack;
+    };
+
+    struct Frame {
+        CPos pos;
+        std::vector<CPos> successors;
+        size_t next = 0;
+    };
+
+    std::map<CPos, Node> nodes;
+    std::vector<CPos> component_stack;
+    std::vector<Frame> frames;
+
+  public:
+    bool visited(CPos pos) const {
+        return nodes.count(pos) != 0;
+    }
+
+    // successors(pos, out) appends the cells pos depends on to out, all of
+    // them are followed, component(pos, cyclic) is called for every member of
+    // every component in reverse topological order
+    template<typename S, typename C>
+    void search(CPos root, S successors, C component) {
+        auto visit = [&](CPos pos) {
+            unsigned index = (unsigned)nodes.size();
+            size_t position = component_stack.size();
+            nodes.insert({pos, Node {index, index, position, true}});
+            component_stack.push_back(pos);
+
+            Frame frame {pos, {}};
+            successors(pos, frame.successors);
+            frames.push_back(std::move(frame));
+        };
+
+        visit(root);
+
+        while (!frames.empty()) {
+            Frame& frame = frames.back();
+
+            if (frame.next < frame.successors.size()) {
+                CPos successor = frame.successors[frame.next++];
+
+                auto node = nodes.find(successor);
+                if (node == nodes.end()) {
+                    visit(successor);
+                } else if (node->second.on_stack) {
+                    Node& current = nodes.at(frame.pos);
+                    current.lowlink =
+                        std::min(current.lowlink, node->second.index);
+                }
+                continue;
+            }
+
+            CPos pos = frame.pos;
+            bool self_loop = std::find(
+                                 frame.successors.begin(),
+                                 frame.successors.end(),
+                                 pos
+                             )
+                != frame.successors.end();
+            frames.pop_back();
+
+            Node& node = nodes.at(pos);
+            if (!frames.empty()) {
+                Node& parent = nodes.at(frames.back().pos);
+                parent.lowlink = std::min(parent.lowlink, node.lowlink);
+            }
+
+            if (node.lowlink != node.index) {
+                continue;
+            }
+
+            // pos is the root of a component, pop it from the stack
+            auto start = component_stack.begin()
+                + (ptrdiff_t)node.stack_position;
+            bool cyclic = self_loop || component_stack.end() - start > 1;
+
+            for (auto it = start; it != component_stack.end(); it++) {
+                nodes.at(*it).on_stack = false;
+                component(*it, cyclic);
+            }
+            component_stack.erase(start, component_stack.end());
+        }
+    }
+};
+
+// strings of a batch of scenarios, the pool of the sheet is only read while
+// batches run in parallel, new strings get handles past its end
+class ScenarioStrings {
+    const StringPool& base;
+    StringPool added;
+
+  public:
+    ScenarioStrings(const StringPool& base) : base(base) {}
+
+    uint64_t intern(std::string_view str) {
+        if (auto handle = base.find(str)) {
+            return *handle;
+        }
+        return base.size() + added.intern(str);
+    }
+
+    const std::string& get(uint64_t handle) const {
+        if (handle < base.size()) {
+            return base.get(handle);
+        }
+        return added.get(handle - base.size());
+    }
+};
+
+// the cells between the inputs and the outputs of scenarios compiled into
+// nodes which are evaluated for a batch of scenarios at once, every node and
+// cell has an array of values with one lane per scenario
+//
+// columns are the inputs followed by the cells in evaluation order, the
+// nodes of a cell only refer to earlier nodes of the same cell, to columns
+// and to the values of the other cells, which are the same in all scenarios
+//
+// both branches of IF are evaluated, which gives the same values since
+// evaluation has no side effects and every error is an undefined value
+struct ScenarioPlan {
+    static constexpr size_t LANES = 256;
+    // values kept by a batch, plans with many cells run fewer lanes at once
+    static constexpr size_t BATCH_VALUES = 1 << 20;
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    // a column, or a value shared by all scenarios
+    struct Item {
+        uint32_t column;
+        BoxedValue value;
+    };
+
+    // the cells of a range of SUM, COUNT, MIN, MAX or COUNT_VAL
+    struct Range {
+        bool valid = true;
+        // SUM, MIN and MAX fold the numbers before the first column into
+        // prefix, later ones stay in items to keep the order of the fold
+        double prefix = 0;
+        bool empty = true;
+        std::vector<Item> items;
+        // COUNT and COUNT_VAL count the constants up front
+        unsigned defined = 0;
+        RangeIndex constants;
+    };
+
+    enum class NodeKind : uint8_t {
+        CONSTANT,
+        COLUMN,
+        FUNCTION,
+    };
+
+    struct Node {
+        NodeKind kind;
+        FunctionKind function = FunctionKind::SUM;
+        uint32_t arguments[3] = {NONE, NONE, NONE};
+        uint32_t column = NONE;
+        uint32_t range = NONE;
+        BoxedValue value = BOXED_UNDEFINED;
+    };
+
+    // the nodes of a cell, the last one gives its value
+    struct Program {
+        uint32_t first;
+        uint32_t end;
+    };
+
+    size_t inputs = 0;
+    std::vector<Node> nodes;
+    std::vector<Range> ranges;
+    std::vector<Program> programs;
+    std::vector<Item> outputs;
+    uint32_t max_program = 0;
+
+    // scenarios evaluated at once, a batch keeps every column and the nodes
+    // of the longest program for each of them
+    size_t batch_lanes() const {
+        size_t values = inputs + programs.size() + max_program;
+        return std::clamp<size_t>(BATCH_VALUES / (values + 1), 1, LANES);
+    }
+
+    // evaluate scenarios first .. first + lanes, whose inputs are rows of
+    // values, into rows of results, lanes is at most batch_lanes()
+    void run(
+        const BoxedValue* values,
+        size_t first,
+        size_t lanes,
+        ScenarioStrings& strings,
+        CValue* results
+    ) const {
+        std::vector<BoxedValue> columns((inputs + programs.size()) * lanes);
+        for (size_t c = 0; c < inputs; c++) {
+            for (size_t i = 0; i < lanes; i++) {
+                columns[c * lanes + i] = values[(first + i) * inputs + c];
+            }
+        }
+
+        std::vector<BoxedValue> registers((size_t)max_program * lanes);
+        std::vector<const BoxedValue*> lanes_of(max_program);
+        for (size_t p = 0; p < programs.size(); p++) {
+            const Program& program = programs[p];
+            for (uint32_t n = program.first; n < program.end; n++) {
+                const Node& node = nodes[n];
+                size_t local = n - program.first;
+                BoxedValue* out = &registers[local * lanes];
+                auto argument = [&](int i) {
+                    return lanes_of[node.arguments[i] - program.first];
+                };
+
+                switch (node.kind) {
+                    case NodeKind::CONSTANT:
+                        std::fill(out, out + lanes, node.value);
+                        break;
+                    case NodeKind::COLUMN:
+                        out = &columns[node.column * lanes];
+                        break;
+                    case NodeKind::FUNCTION:
+                        if (node.range != NONE) {
+                            run_range(node, argument, lanes, out, columns);
+                        } else {
+                            run_function(node, argument, lanes, out, strings);
+                        }
+                        break;
+                }
+                lanes_of[local] = out;
+            }
+            const BoxedValue* value = lanes_of[program.end - 1 - program.first];
+            std::copy(value, value + lanes, &columns[(inputs + p) * lanes]);
+        }
+
+        for (size_t k = 0; k < outputs.size(); k++) {
+            const Item& item = outputs[k];
+            for (size_t i = 0; i < lanes; i++) {
+                BoxedValue value = item.column == NONE
+                    ? item.value
+                    : columns[item.column * lanes + i];
+                CValue& result = results[(first + i) * outputs.size() + k];
+                if (value.is_number()) {
+                    result = CValue(value.number());
+                } else if (value.is_string()) {
+                    result = CValue(strings.get(value.string_handle()));
+                } else {
+                    result = UNDEFINED;
+                }
+            }
+        }
+    }
+
+    // the same as CSpreadsheet::evaluate_expression_internal, lane by lane
+    template<typename A>
+    static void run_function(
+        const Node& node,
+        A argument,
+        size_t lanes,
+        BoxedValue* out,
+        ScenarioStrings& strings
+    ) {
+        auto numeric = [&](auto fun) {
+            const BoxedValue* a = argument(0);
+            const BoxedValue* b = argument(1);
+            for (size_t i = 0; i < lanes; i++) {
+                if (a[i].is_number() && b[i].is_number()) {
+                    out[i] = fun(a[i].number(), b[i].number());
+                } else {
+                    out[i] = BOXED_UNDEFINED;
+                }
+            }
+        };
+        auto compare = [&](auto fun) {
+            const BoxedValue* a = argument(0);
+            const BoxedValue* b = argument(1);
+            for (size_t i = 0; i < lanes; i++) {
+                if (a[i].is_number() && b[i].is_number()) {
+                    bool result = fun(a[i].number(), b[i].number());
+                    out[i] = BoxedValue((double)result);
+                } else if (a[i].is_string() && b[i].is_string()) {
+                    const std::string& x = strings.get(a[i].string_handle());
+                    const std::string& y = strings.get(b[i].string_handle());
+                    out[i] = BoxedValue((double)fun(x, y));
+                } else {
+                    out[i] = BOXED_UNDEFINED;
+                }
+            }
+        };
+
+        switch (node.function) {
+            case FunctionKind::IF: {
+                const BoxedValue* cond = argument(0);
+                const BoxedValue* then = argument(1);
+                const BoxedValue* otherwise = argument(2);
+                for (size_t i = 0; i < lanes; i++) {
+                    if (!cond[i].is_number()) {
+                        out[i] = BOXED_UNDEFINED;
+                    } else if (cond[i].number() != 0.0) {
+                        out[i] = then[i];
+                    } else {
+                        out[i] = otherwise[i];
+                    }
+                }
+                break;
+            }
+            case FunctionKind::NEG: {
+                const BoxedValue* a = argument(0);
+                for (size_t i = 0; i < lanes; i++) {
+                    out[i] = a[i].is_number() ? BoxedValue(-a[i].number())
+                                              : BOXED_UNDEFINED;
+                }
+                break;
+            }
+            case FunctionKind::POW:
+                numeric([](double a, double b) {
+                    return BoxedValue(std::pow(a, b));
+                });
+                break;
+            case FunctionKind::MUL:
+                numeric([](double a, double b) { return BoxedValue(a * b); });
+                break;
+            case FunctionKind::DIV:
+                numeric([](double a, double b) {
+                    return fabs(b) == 0.0 ? BOXED_UNDEFINED : BoxedValue(a / b);
+                });
+                break;
+            case FunctionKind::SUB:
+                numeric([](double a, double b) { return BoxedValue(a - b); });
+                break;
+            case FunctionKind::ADD: {
+                const BoxedValue* a = argument(0);
+                const BoxedValue* b = argument(1);
+                for (size_t i = 0; i < lanes; i++) {
+                    if (a[i].is_number() && b[i].is_number()) {
+                        out[i] = BoxedValue(a[i].number() + b[i].number());
+                    } else if ((a[i].is_string() || b[i].is_string())
+                               && !a[i].is_undefined()
+                               && !b[i].is_undefined()) {
+                        std::string buf = a[i].is_string()
+                            ? strings.get(a[i].string_handle())
+                            : std::to_string(a[i].number());
+                        buf += b[i].is_string()
+                            ? strings.get(b[i].string_handle())
+                            : std::to_string(b[i].number());
+                        out[i] = BoxedValue::string(strings.intern(buf));
+                    } else {
+                        out[i] = BOXED_UNDEFINED;
+                    }
+                }
+                break;
+            }
+            case FunctionKind::LT:
+                compare([](const auto& a, const auto& b) { return a < b; });
+                break;
+            case FunctionKind::LE:
+                compare([](const auto& a, const auto& b) { return a <= b; });
+                break;
+            case FunctionKind::GT:
+                compare([](const auto& a, const auto& b) { return a > b; });
+                break;
+            case FunctionKind::GE:
+                compare([](const auto& a, const auto& b) { return a >= b; });
+                break;
+            case FunctionKind::NE:
+                compare([](const auto& a, const auto& b) { return a != b; });
+                break;
+            case FunctionKind::EQ:
+                compare([](const auto& a, const auto& b) { return a == b; });
+                break;
+            default:
+                assert(0 && "Not a scalar function");
+                break;
+        }
+    }
+
+    // the range functions fold the items for all lanes at once
+    template<typename A>
+    void run_range(
+        const Node& node,
+        A argument,
+        size_t lanes,
+        BoxedValue* out,
+        const std::vector<BoxedValue>& columns
+    ) const {
+        const Range& range = ranges[node.range];
+        auto item_lanes = [&](const Item& item, auto fun) {
+            if (item.column == NONE) {
+                for (size_t i = 0; i < lanes; i++) {
+                    fun(i, item.value);
+                }
+            } else {
+                const BoxedValue* values = &columns[item.column * lanes];
+                for (size_t i = 0; i < lanes; i++) {
+                    fun(i, values[i]);
+                }
+            }
+        };
+        auto fold = [&](void (*fun)(double* acc, double input)) {
+            std::vector<double> acc(lanes, range.prefix);
+            std::vector<char> empty(lanes, range.empty);
+            for (const Item& item : range.items) {
+                item_lanes(item, [&](size_t i, BoxedValue value) {
+                    if (value.is_number()) {
+                        empty[i] = false;
+                        fun(&acc[i], value.number());
+                    }
+                });
+            }
+            for (size_t i = 0; i < lanes; i++) {
+                out[i] = empty[i] ? BOXED_UNDEFINED : BoxedValue(acc[i]);
+            }
+        };
+
+        switch (node.function) {
+            case FunctionKind::SUM:
+                fold([](double* acc, double in) { *acc += in; });
+                break;
+            case FunctionKind::MIN:
+                fold([](double* acc, double in) { *acc = std::min(*acc, in); });
+                break;
+            case FunctionKind::MAX:
+                fold([](double* acc, double in) { *acc = std::max(*acc, in); });
+                break;
+            case FunctionKind::COUNT: {
+                std::vector<unsigned> count(lanes, range.defined);
+                for (const Item& item : range.items) {
+                    item_lanes(item, [&](size_t i, BoxedValue value) {
+                        count[i] += !value.is_undefined();
+                    });
+                }
+                for (size_t i = 0; i < lanes; i++) {
+                    out[i] = range.valid ? BoxedValue((double)count[i])
+                                         : BOXED_UNDEFINED;
+                }
+                break;
+            }
+            case FunctionKind::COUNT_VAL: {
+                const BoxedValue* value = argument(0);
+                std::vector<unsigned> count(lanes);
+                for (size_t i = 0; i < lanes; i++) {
+                    if (RangeIndex::is_countable(value[i])) {
+                        count[i] = range.constants.count(value[i]);
+                    }
+                }
+                for (const Item& item : range.items) {
+                    item_lanes(item, [&](size_t i, BoxedValue cell) {
+                        count[i] += BoxedValue::equals(value[i], cell);
+                    });
+                }
+                for (size_t i = 0; i < lanes; i++) {
+                    out[i] = range.valid ? BoxedValue((double)count[i])
+                                         : BOXED_UNDEFINED;
+                }
+                break;
+            }
+            default:
+                assert(0 && "Not a range function");
+                break;
+        }
+    }
+};
+
+// heap bytes used by a sheet, by category
+struct MemoryUsage {
+    // cell nodes with their cached values, positions of removed cells,
+    // changed chunks and the row and column maps
+    size_t cells = 0;
+    // argument arrays, string literals and locals of formulas
+    size_t expressions = 0;
+    // strings of cached values
+    size_t strings = 0;
+    // edges of the dependency graph and the users of ranges and sheets
+    size_t dependencies = 0;
+    // value histograms of ranges and compiled formulas
+    size_t caches = 0;
+    // cells kept for undo and redo
+    size_t history = 0;
+
+    size_t total() const {
+        return cells + expressions + strings + dependencies + caches + history;
+    }
+};
+
+class CSpreadsheet {
+    std::map<CPos, Cell> cells;
+    std::set<std::pair<CPos, CPos>> edges;
+    // number of COUNT_VAL cells counting over each range
+    std::map<RangeKey, unsigned> range_users;
+    // value histograms of ranges counted by more than one cell
+    std::map<RangeKey, RangeIndex> range_indices;
+    LocalFrame* frame = nullptr;
+    // strings referenced by cached values
+    StringPool strings;
+    // size of the pool after the strings of replaced values were released
+    size_t strings_kept = 0;
+    // chunks with cells changed since the last save, written by saveDelta
+    mutable std::set<ChunkKey> dirty_chunks;
+    // hash of the last saved or loaded snapshot, deltas are chained to it
+    mutable int64_t layer_hash = 0;
+    // incremented by every edit, a cell is up to date if none of its inputs
+    // changed after the revision it was verified in
+    uint64_t revision = 1;
+    // incremented by edits which change the dependency graph
+    uint64_t structure_revision = 1;
+    // revisions in which the cells at now empty positions were removed
+    std::map<CPos, uint64_t> removed_at;
+    // removed_at was cleared in this revision, empty positions may have lost
+    // their cells at any earlier one
+    uint64_t removals_forgotten_at = 0;
+    // revision of the last edit of a cell or of the axes
+    uint64_t edited_at = 0;
+    // cells edited while range_indices weren't empty, with the revisions of
+    // the edits, histograms recount only the cells depending on the edits
+    // made after they were brought up to date
+    std::vector<std::pair<uint64_t, CPos>> range_edits;
+    VersionEdits version_edits;
+    // cells and references are stored at physical positions, the public
+    // interface works with logical ones
+    AxisMap columns;
+    AxisMap rows;
+    // revision of the last insertion or deletion of rows or columns, ranges
+    // may have gained or lost cells so older cached values are recomputed
+    uint64_t axes_changed_at = 0;
+    // sheets of the workbook the sheet belongs to, references qualified by a
+    // sheet name point into them
+    std::vector<std::unique_ptr<CSpreadsheet>>* workbook = nullptr;
+    // number of cells referencing each other sheet of the workbook
+    std::map<int, unsigned> sheet_users;
+
+    // the cells an edit replaced, applying a step undoes the edit and gives
+    // the step which redoes it
+    struct HistoryStep {
+        // physical positions with the cells before the edit, in edit order
+        std::vector<std::pair<CPos, std::optional<Cell>>> cells;
+        // chunks which were not dirty before the edit, they are clean again
+        // after undoing it unless the sheet was saved or loaded in between
+        std::vector<ChunkKey> clean;
+        int64_t layer_hash;
+        uint64_t axes_changed_at;
+    };
+
+    static constexpr size_t HISTORY_LIMIT = 1000;
+
+    std::deque<HistoryStep> undo_steps;
+    std::deque<HistoryStep> redo_steps;
+    // step collecting the cells replaced by the current edit
+    HistoryStep* recording = nullptr;
+
+    // code of the formulas compiled after being evaluated NATIVE_THRESHOLD
+    // times
+    NativeArena native_code;
+    bool native_enabled = false;
+
+    static constexpr uint32_t NATIVE_THRESHOLD = 4;
+
+    friend class CWorkbook;
+    friend class VersionedSpreadsheet;
+
+  public:
+    CSpreadsheet() {}
+
+    CSpreadsheet(const CSpreadsheet& other) = default;
+    CSpreadsheet(CSpreadsheet&& other) = default;
+    CSpreadsheet& operator=(const CSpreadsheet& other) = default;
+
+    static unsigned capabilities() {
+        unsigned capabilities = SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FUNCTIONS
+            | SPREADSHEET_SPEED | SPREADSHEET_FILE_IO;
+#if VELKA_JIT
+        capabilities |= SPREADSHEET_JIT;
+#endif
+        return capabilities;
+    }
+
+    // compile hot numeric formulas into machine code where supported, off by
+    // default, turning it off drops the compiled code
+    void setJit(bool enabled) {
+        native_enabled = enabled;
+        if (!enabled) {
+            drop_native_code();
+        }
+    }
+
+    bool load(std::istream& is) {
+        std::string data;
+        char chunk[1 << 16];
+        while (is.read(chunk, sizeof(chunk)) || is.gcount() > 0) {
+            data.append(chunk, (size_t)is.gcount());
+        }
+        if (is.bad()) {
+            return false;
+        }
+        return load(std::string_view(data));
+    }
+
+    // load a full snapshot written by save, or merge a delta written by
+    // saveDelta into the snapshot it was saved after, data may be a mapped
+    // file and has to stay valid only during the call
+    bool load(std::string_view data) {
+        StreamReader w(data);
+
+        int64_t saved_hash = w.read_i64();
+        if (w.failed()) {
+            return false;
+        }
+        if ((uint64_t)saved_hash == COMPRESSED_MAGIC) {
+            // sizes in a corrupt snapshot may ask for more memory than there
+            // is, the sheet is only changed once all blocks are decoded, on
+            // any thread
+            try {
+                return load_compressed(
+                    data.substr(w.position()),
+                    std::thread::hardware_concurrency()
+                );
+            } catch (std::bad_alloc& e) {
+                return false;
+            }
+        }
+
+        FnvHasher hasher;
+        hasher.hash_bytes(data.substr(w.position()));
+        unsigned int hash = hasher.finish();
+
+        if (hash != saved_hash) {
+            return false;
+        }
+
+        int64_t cells_len = w.read_i64();
+        if (cells_len == DELTA_MAGIC) {
+            return load_delta(w, saved_hash);
+        }
+
+        clear();
+
+        ExpressionBuilder builder {};
+
+        for (int64_t i = 0; i < cells_len && !w.failed(); i++) {
+            CPos pos = w.read_cell_pos();
+            w.read_expression(builder);
+            if (w.failed()) {
+                break;
+            }
+            Cell cell(builder.finish());
+            optimize_cell(cell);
+
+            // cells are saved in order
+            auto entry = cells.emplace_hint(cells.end(), pos, std::move(cell));
+            add_cell_users(entry->second);
+        }
+
+        int64_t edges_len = w.read_i64();
+        for (int64_t i = 0; i < edges_len && !w.failed(); i++) {
+            CPos a = w.read_cell_pos();
+            CPos b = w.read_cell_pos();
+
+            edges.emplace_hint(edges.end(), a, b);
+        }
+
+        dirty_chunks.clear();
+        layer_hash = saved_hash;
+
+        return !w.failed();
+    }
+
+    void clear() {
+        cells.clear();
+        native_code.clear();
+        forget_history();
+        removed_at.clear();
+        removals_forgotten_at = 0;
+        range_edits.clear();
+        version_edits.edits.reset();
+        columns = AxisMap();
+        rows = AxisMap();
+        edges.clear();
+        range_users.clear();
+        range_indices.clear();
+        sheet_users.clear();
+        strings.clear();
+        strings_kept = 0;
+    }
+
+    // load the rest of a snapshot written by saveCompressed after its magic,
+    // blocks are decoded on up to threads threads into sorted runs of cells
+    // and edges which are then merged into the sheet
+    bool load_compressed(std::string_view data, unsigned threads) {
+        struct Block {
+            uint32_t compressed_size;
+            uint32_t size;
+            uint32_t cells_len;
+            uint32_t hash;
+            std::string_view compressed;
+            std::vector<std::pair<CPos, Cell>> cells;
+            std::vector<std::pair<CPos, CPos>> edges;
+            bool valid = false;
+        };
+
+        ByteReader header(data);
+        uint64_t cells_len = header.read_u64();
+        uint32_t blocks_len = header.read_u32();
+        // every block has 16 bytes in the index
+        if (header.failed()
+            || blocks_len > (data.size() - header.position()) / 16) {
+            return false;
+        }
+        std::vector<Block> blocks(blocks_len);
+
+        uint64_t indexed_cells = 0;
+        for (auto& block : blocks) {
+            block.compressed_size = header.read_u32();
+            block.size = header.read_u32();
+            block.cells_len = header.read_u32();
+            block.hash = header.read_u32();
+            indexed_cells += block.cells_len;
+        }
+        for (auto& block : blocks) {
+            block.compressed = header.read_bytes(block.compressed_size);
+        }
+        if (header.failed() || !header.at_end()
+            || indexed_cells != cells_len) {
+            return false;
+        }
+
+        parallel_for(blocks.size(), threads, [&](size_t i) {
+            Block& block = blocks[i];
+
+            // blocks which didn't compress are stored as they are
+            std::string raw;
+            if (block.compressed.size() == block.size) {
+                raw = block.compressed;
+            } else if (!LzCodec::decompress(
+                           block.compressed,
+                           block.size,
+                           raw
+                       )) {
+                return;
+            }
+
+            FnvHasher hasher;
+            hasher.hash_bytes(raw);
+            if (hasher.finish() != block.hash) {
+                return;
+            }
+
+            // a cell takes at least two bytes for its position and two for
+            // its expression
+            if (block.cells_len > raw.size() / 4) {
+                return;
+            }
+
+            ExpressionBuilder builder {};
+            CompactReader r(raw);
+            block.cells.reserve(block.cells_len);
+            for (uint32_t j = 0; j < block.cells_len; j++) {
+                CPos pos = r.read_cell_pos();
+                if (!r.read_expression(builder, pos)
+                    || (!block.cells.empty()
+                        && block.cells.back().first >= pos)) {
+                    return;
+                }
+
+                Cell cell(builder.finish());
+                optimize_cell(cell);
+                cell.on_cell_references([&](CPos c) {
+                    block.edges.push_back({c, pos});
+                });
+                block.cells.push_back({pos, std::move(cell)});
+            }
+            std::sort(block.edges.begin(), block.edges.end());
+            block.valid = r.at_end();
+        });
+
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if (!blocks[i].valid) {
+                return false;
+            }
+            // the runs of cells must follow each other
+            if (i > 0 && !blocks[i].cells.empty()
+                && !blocks[i - 1].cells.empty()
+                && blocks[i - 1].cells.back().first
+                    >= blocks[i].cells.front().first) {
+                return false;
+            }
+        }
+
+        // merge the sorted runs of edges pairwise
+        std::vector<std::pair<CPos, CPos>> all_edges;
+        std::vector<size_t> bounds {0};
+        for (auto& block : blocks) {
+            all_edges.insert(
+                all_edges.end(),
+                block.edges.begin(),
+                block.edges.end()
+            );
+            bounds.push_back(all_edges.size());
+            block.edges = {};
+        }
+        while (bounds.size() > 2) {
+            std::vector<size_t> merged {0};
+            for (size_t i = 2; i < bounds.size(); i += 2) {
+                std::inplace_merge(
+                    all_edges.begin() + (ptrdiff_t)bounds[i - 2],
+                    all_edges.begin() + (ptrdiff_t)bounds[i - 1],
+                    all_edges.begin() + (ptrdiff_t)bounds[i]
+                );
+                merged.push_back(bounds[i]);
+            }
+            if (bounds.size() % 2 == 0) {
+                merged.push_back(bounds.back());
+            }
+            bounds = std::move(merged);
+        }
+
+        FnvHasher layer_hasher;
+        for (auto& block : blocks) {
+            for (int i = 0; i < 4; i++) {
+                layer_hasher.hash_char((char)(block.hash >> (8 * i)));
+            }
+        }
+
+        // both are built from sorted input in linear time
+        clear();
+        edges = std::set<std::pair<CPos, CPos>>(
+            all_edges.begin(),
+            all_edges.end()
+        );
+        for (auto& block : blocks) {
+            for (auto& [pos, cell] : block.cells) {
+                auto entry =
+                    cells.emplace_hint(cells.end(), pos, std::move(cell));
+                add_cell_users(entry->second);
+            }
+        }
+
+        dirty_chunks.clear();
+        layer_hash = layer_hasher.finish();
+
+        return true;
+    }
+
+    bool load_delta(StreamReader& r, int64_t hash) {
+        if (r.read_i64() != layer_hash || !references_identity()) {
+            return false;
+        }
+
+        // parse the whole delta before changing anything
+        std::vector<std::pair<ChunkKey, std::vector<std::pair<CPos, Cell>>>>
+            chunks;
+        ExpressionBuilder builder {};
+
+        int64_t chunks_len = r.read_i64();
+        for (int64_t i = 0; i < chunks_len && !r.failed(); i++) {
+            ChunkKey key;
+            key.first = r.read_i32();
+            key.second = r.read_i32();
+
+            std::vector<std::pair<CPos, Cell>> chunk_cells;
+            int64_t cells_len = r.read_i64();
+            for (int64_t j = 0; j < cells_len && !r.failed(); j++) {
+                CPos pos = r.read_cell_pos();
+                r.read_expression(builder);
+                if (r.failed() || chunk_of(pos) != key) {
+                    return false;
+                }
+                chunk_cells.push_back({pos, Cell(builder.finish())});
+            }
+            chunks.push_back({key, std::move(chunk_cells)});
+        }
+
+        if (r.failed()) {
+            return false;
+        }
+
+        // a chunk in the delta replaces the whole chunk
+        for (auto& [key, chunk_cells] : chunks) {
+            std::vector<CPos> removed;
+            for_chunk_cells(key, [&](CPos pos, const Cell&) {
+                removed.push_back(pos);
+            });
+            for (CPos pos : removed) {
+                removeCell_internal(pos);
+            }
+
+            for (auto& [pos, cell] : chunk_cells) {
+                optimize_cell(cell);
+                setCell_internal(pos, std::move(cell));
+            }
+        }
+
+        forget_history();
+        dirty_chunks.clear();
+        layer_hash = hash;
+
+        return true;
+    }
+
+    bool save(std::ostream& os) const {
+        if (!references_identity()) {
+            return normalized().save(os);
+        }
+
+        return save_hashed(os, [&](StreamWriter& w) {
+            w.write_i64((int64_t)cells.size());
+            for (auto& pair : cells) {
+                w.write_cell_pos(pair.first);
+                w.write_expression(pair.second.expression, pair.second.locals);
+            }
+
+            w.write_i64((int64_t)edges.size());
+            for (auto& pair : edges) {
+                w.write_cell_pos(pair.first);
+                w.write_cell_pos(pair.second);
+            }
+        });
+    }
+
+    // save only the chunks changed since the last save, saveDelta or load,
+    // load merges the result into the sheet that was saved last
+    //
+    // fails once rows or columns were inserted or deleted, since then every
+    // cell below may have moved and a full save is needed
+    bool saveDelta(std::ostream& os) const {
+        if (!references_identity()) {
+            return false;
+        }
+
+        return save_hashed(os, [&](StreamWriter& w) {
+            w.write_i64(DELTA_MAGIC);
+            w.write_i64(layer_hash);
+
+            w.write_i64((int64_t)dirty_chunks.size());
+            for (ChunkKey key : dirty_chunks) {
+                w.write_i32(key.first);
+                w.write_i32(key.second);
+
+                int64_t count = 0;
+                for_chunk_cells(key, [&](CPos, const Cell&) { count++; });
+
+                w.write_i64(count);
+                for_chunk_cells(key, [&](CPos pos, const Cell& cell) {
+                    w.write_cell_pos(pos);
+                    w.write_expression(cell.expression, cell.locals);
+                });
+            }
+        });
+    }
+
+    // save a snapshot of independently decodable blocks of cells, each block
+    // is compressed on one of up to threads threads, load reads it as well
+    //
+    // layout: magic, cell count (u64), block count (u32), index of the blocks
+    // with the compressed size, uncompressed size, cell count and fnv hash of
+    // the uncompressed data (4 x u32), compressed blocks
+    bool saveCompressed(
+        std::ostream& os,
+        unsigned threads = std::thread::hardware_concurrency()
+    ) const {
+        if (!references_identity()) {
+            return normalized().saveCompressed(os, threads);
+        }
+
+        // runs of cells encoded into roughly COMPRESSED_BLOCK_SIZE bytes
+        std::vector<std::string> raw;
+        std::vector<uint32_t> block_cells;
+
+        CompactWriter w;
+        uint32_t count = 0;
+        for (auto& [pos, cell] : cells) {
+            w.write_cell_pos(pos);
+            w.write_expression(cell.expression, cell.locals, pos);
+            count++;
+
+            if (w.data().size() >= COMPRESSED_BLOCK_SIZE) {
+                raw.push_back(std::move(w.data()));
+                block_cells.push_back(count);
+                w = CompactWriter();
+                count = 0;
+            }
+        }
+        if (count != 0) {
+            raw.push_back(std::move(w.data()));
+            block_cells.push_back(count);
+        }
+
+        std::vector<std::string> compressed(raw.size());
+        std::vector<uint32_t> hashes(raw.size());
+
+        parallel_for(raw.size(), threads, [&](size_t i) {
+            FnvHasher hasher;
+            hasher.hash_bytes(raw[i]);
+            hashes[i] = hasher.finish();
+
+            compressed[i] = LzCodec::compress(raw[i]);
+            if (compressed[i].size() >= raw[i].size()) {
+                compressed[i] = raw[i];
+            }
+        });
+
+        ByteWriter header;
+        header.write_u64(COMPRESSED_MAGIC);
+        header.write_u64(cells.size());
+        header.write_u32((uint32_t)raw.size());
+        FnvHasher layer_hasher;
+        for (size_t i = 0; i < raw.size(); i++) {
+            header.write_u32((uint32_t)compressed[i].size());
+            header.write_u32((uint32_t)raw[i].size());
+            header.write_u32(block_cells[i]);
+            header.write_u32(hashes[i]);
+            for (int j = 0; j < 4; j++) {
+                layer_hasher.hash_char((char)(hashes[i] >> (8 * j)));
+            }
+        }
+
+        os.write(header.data().data(), (std::streamsize)header.data().size());
+        for (auto& block : compressed) {
+            os.write(block.data(), (std::streamsize)block.size());
+        }
+
+        if (os.fail()) {
+            return false;
+        }
+
+        dirty_chunks.clear();
+        layer_hash = layer_hasher.finish();
+        return true;
+    }
+
+    // write the hash of the data followed by the data, the written data
+    // becomes the base of the next delta
+    template<typename F>
+    bool save_hashed(std::ostream& os, F write_data) const {
+        StreamWriter w;
+
+        // leave space for hash
+        w.write_i64(0);
+
+        write_data(w);
+
+        std::string& data = w.data();
+
+        FnvHasher hasher;
+        hasher.hash_bytes(std::string_view(data).substr(sizeof(int64_t)));
+        unsigned int hash = hasher.finish();
+        w.write_u64_at(0, hash);
+
+        os.write(data.data(), (std::streamsize)data.size());
+
+        if (os.fail()) {
+            return false;
+        }
+
+        dirty_chunks.clear();
+        layer_hash = hash;
+        return true;
+    }
+
+    static ChunkKey chunk_of(CPos pos) {
+        return {pos.x >> CHUNK_BITS, pos.y >> CHUNK_BITS};
+    }
+
+    // call fun on all cells in a chunk
+    template<typename F>
+    void for_chunk_cells(ChunkKey key, F fun) const {
+        int x_start = key.first << CHUNK_BITS;
+        int y_start = key.second << CHUNK_BITS;
+        int y_end = y_start + (1 << CHUNK_BITS);
+
+        for (int x = x_start; x < x_start + (1 << CHUNK_BITS); x++) {
+            auto it = cells.lower_bound(CPos(x, y_start));
+            for (; it != cells.end() && it->first.x == x && it->first.y < y_end;
+                 it++) {
+                fun(it->first, it->second);
+            }
+        }
+    }
+
+    void remove_cell_dependency(CPos from, CPos to) {
+        edges.erase(std::make_pair(from, to));
+    }
+
+    void add_cell_dependency(CPos from, CPos to) {
+        edges.insert(std::make_pair(from, to));
+    }
+
+    static RangeKey range_key(const CellRange& range) {
+        return {range.start.pos, range.end.pos};
+    }
+
+    // other sheets of the workbook referenced by the cell, each once
+    static std::vector<int> external_sheets(Cell& cell) {
+        std::vector<int> sheets;
+        auto add = [&](const CellReference& ref) {
+            if (ref.sheet != LOCAL_SHEET
+                && std::find(sheets.begin(), sheets.end(), ref.sheet)
+                    == sheets.end()) {
+                sheets.push_back(ref.sheet);
+            }
+        };
+        cell.visit_all([&](Expression& expr) {
+            Cell::on_variant<CellReference>(expr, add);
+            Cell::on_variant<CellRange>(expr, [&](CellRange& range) {
+                add(range.start);
+            });
+        });
+        return sheets;
+    }
+
+    // account the ranges counted by a cell and the sheets it references
+    void add_cell_users(Cell& cell) {
+        cell.on_counted_ranges([&](const CellRange& range) {
+            this->add_range_user(range);
+        });
+        for (int sheet : external_sheets(cell)) {
+            sheet_users[sheet]++;
+        }
+    }
+
+    void remove_cell_users(Cell& cell) {
+        cell.on_counted_ranges([&](const CellRange& range) {
+            this->remove_range_user(range);
+        });
+        for (int sheet : external_sheets(cell)) {
+            auto entry = sheet_users.find(sheet);
+            if (entry != sheet_users.end() && --entry->second == 0) {
+                sheet_users.erase(entry);
+            }
+        }
+    }
+
+    void add_range_user(const CellRange& range) {
+        range_users[range_key(range)]++;
+    }
+
+    void remove_range_user(const CellRange& range) {
+        auto entry = range_users.find(range_key(range));
+        if (entry == range_users.end()) {
+            return;
+        }
+        if (--entry->second < 2) {
+            range_indices.erase(entry->first);
+        }
+        if (entry->second == 0) {
+            range_users.erase(entry);
+        }
+    }
+
+    // cycle states computed before the last change of the graph are unknown
+    CycleState cycle_state(const Cell& cell) const {
+        if (cell.cycle_revision != structure_revision) {
+            return CycleState::UNKNOWN;
+        }
+        return cell.cycle;
+    }
+
+    // find the strongly connected components of the cells with unknown cycle
+    // state reachable from root and flag all members of cyclic components
+    //
+    // cells with a known state are never part of a component with an unknown
+    // cell since any edit which could join them resets the state of all cells
+    void resolve_cycles(CPos root) {
+        ComponentFinder finder;
+        auto successors = [&](CPos pos, std::vector<CPos>& out) {
+            on_references(*get_cell(pos), [&](CPos c) {
+                Cell* cell = get_cell(c);
+                if (cell && cycle_state(*cell) == CycleState::UNKNOWN) {
+                    out.push_back(c);
+                }
+            });
+        };
+        finder.search(root, successors, [&](CPos pos, bool cyclic) {
+            Cell* cell = get_cell(pos);
+            // the value of a cell leaving a cycle wasn't computed from its
+            // inputs, so unchanged inputs don't mean it is up to date
+            if (cell->cycle == CycleState::CYCLIC && !cyclic) {
+                cell->verified_at = 0;
+            }
+            cell->cycle = cyclic ? CycleState::CYCLIC : CycleState::ACYCLIC;
+            cell->cycle_revision = structure_revision;
+        });
+    }
+
+    // edits only bump the revision, the cells depending on pos find out that
+    // pos changed once they are read
+    bool setCell_internal(CPos pos, Cell cell) {
+        record_chunk(pos);
+        dirty_chunks.insert(chunk_of(pos));
+        revision++;
+        cell_edited(pos);
+
+        // the new cell starts from the last value at pos, so that dependents
+        // are recomputed only if it evaluates to something else
+        cell.cached_value = BOXED_UNDEFINED;
+        cell.changed_at = 0;
+        cell.verified_at = 0;
+
+        // a cell without references can't be part of a cycle
+        CycleState old_cycle = CycleState::ACYCLIC;
+        uint64_t old_cycle_revision = structure_revision;
+        std::vector<CPos> old_references;
+
+        auto entry = cells.find(pos);
+        if (entry != cells.end()) {
+            cell.cached_value = entry->second.cached_value;
+            cell.changed_at = entry->second.changed_at;
+            old_cycle = entry->second.cycle;
+            old_cycle_revision = entry->second.cycle_revision;
+            on_references(entry->second, [&](CPos c) {
+                old_references.push_back(c);
+                this->remove_cell_dependency(c, pos);
+            });
+            remove_cell_users(entry->second);
+            release_native(entry->second);
+
+            Cell previous = std::exchange(entry->second, std::move(cell));
+            if (recording) {
+                recording->cells.push_back({pos, std::move(previous)});
+            }
+        } else {
+            auto removed = removed_at.find(pos);
+            if (removed != removed_at.end()) {
+                cell.changed_at = removed->second;
+                removed_at.erase(removed);
+            } else {
+                cell.changed_at = removals_forgotten_at;
+            }
+            entry = cells.insert({pos, std::move(cell)}).first;
+            if (recording) {
+                recording->cells.push_back({pos, std::nullopt});
+            }
+        }
+
+        std::vector<CPos> new_references;
+        on_references(entry->second, [&](CPos c) {
+            new_references.push_back(c);
+            this->add_cell_dependency(c, pos);
+        });
+        add_cell_users(entry->second);
+
+        // edits which only change values keep the cycle states
+        if (old_references != new_references) {
+            structure_revision++;
+        } else {
+            entry->second.cycle = old_cycle;
+            entry->second.cycle_revision = old_cycle_revision;
+        }
+
+        return true;
+    }
+
+    void removeCell_internal(CPos pos) {
+        auto entry = cells.find(pos);
+        if (entry == cells.end()) {
+            return;
+        }
+
+        record_chunk(pos);
+        dirty_chunks.insert(chunk_of(pos));
+        revision++;
+
+        bool graph_changed = false;
+        on_references(entry->second, [&](CPos c) {
+            graph_changed = true;
+            this->remove_cell_dependency(c, pos);
+        });
+        remove_cell_users(entry->second);
+        release_native(entry->second);
+
+        if (graph_changed) {
+            structure_revision++;
+        }
+
+        // dependents need to see the cell become empty, the positions are
+        // forgotten once they outnumber the cells
+        if (removed_at.size() > cells.size() + 1024) {
+            removed_at.clear();
+            removals_forgotten_at = revision;
+        }
+        removed_at[pos] = revision;
+        cell_edited(pos);
+        if (recording) {
+            recording->cells.push_back({pos, std::move(entry->second)});
+        }
+        cells.erase(entry);
+    }
+
+    void record_chunk(CPos pos) {
+        ChunkKey key = chunk_of(pos);
+        if (recording && !dirty_chunks.count(key)) {
+            recording->clean.push_back(key);
+        }
+    }
+
+    HistoryStep start_step() const {
+        return HistoryStep {{}, {}, layer_hash, axes_changed_at};
+    }
+
+    // run an edit, keeping the cells it replaces for undo
+    template<typename F>
+    void record(F edit) {
+        HistoryStep step = start_step();
+        recording = &step;
+        edit();
+        recording = nullptr;
+
+        if (step.cells.empty()) {
+            return;
+        }
+        redo_steps.clear();
+        undo_steps.push_back(std::move(step));
+        if (undo_steps.size() > HISTORY_LIMIT) {
+            undo_steps.pop_front();
+        }
+    }
+
+    // put the cells of a step back in reverse order, returns the step which
+    // reverts that
+    HistoryStep apply_step(HistoryStep& step) {
+        HistoryStep inverse = start_step();
+        recording = &inverse;
+        for (auto it = step.cells.rbegin(); it != step.cells.rend(); it++) {
+            auto& [pos, cell] = *it;
+            if (cell) {
+                setCell_internal(pos, std::move(*cell));
+            } else {
+                removeCell_internal(pos);
+            }
+        }
+        recording = nullptr;
+
+        if (step.layer_hash == layer_hash
+            && step.axes_changed_at == axes_changed_at) {
+            for (ChunkKey key : step.clean) {
+                dirty_chunks.erase(key);
+            }
+        }
+        return inverse;
+    }
+
+    // drop the history, edits which aren't recorded make it invalid
+    void forget_history() {
+        undo_steps.clear();
+        redo_steps.clear();
+    }
+
+    // revert the last setCell or copyRect not reverted yet, cells are
+    // recomputed as after any other edit, only where values changed
+    bool undo() {
+        if (undo_steps.empty()) {
+            return false;
+        }
+        HistoryStep step = std::move(undo_steps.back());
+        undo_steps.pop_back();
+        redo_steps.push_back(apply_step(step));
+        return true;
+    }
+
+    // apply the last undone edit again, any other edit drops the edits which
+    // can be redone
+    bool redo() {
+        if (redo_steps.empty()) {
+            return false;
+        }
+        HistoryStep step = std::move(redo_steps.back());
+        redo_steps.pop_back();
+        undo_steps.push_back(apply_step(step));
+        return true;
+    }
+
+    bool setCell(CPos pos, std::string contents) {
+        // the code of replaced cells is reclaimed once the arena fills up
+        if (native_code.reclaimable()) {
+            drop_native_code();
+        }
+        try {
+            return set_cell(pos, Cell(contents));
+        } catch (std::invalid_argument& e) {
+            return false;
+        }
+    }
+
+    // setCell with the contents already parsed
+    bool set_cell(CPos pos, Cell cell) {
+        bool set = false;
+        record([&] { set = set_parsed(pos, std::move(cell)); });
+        return set;
+    }
+
+    // set a parsed cell with references at logical positions
+    bool set_parsed(CPos pos, Cell cell) {
+        auto physical = to_physical(pos);
+        if (!physical || !references_to_physical(cell)) {
+            return false;
+        }
+        optimize_cell(cell);
+        return setCell_internal(*physical, std::move(cell));
+    }
+
+    // insert count empty rows before row, the cells below move down without
+    // being touched and references to them keep pointing at them
+    bool insertRows(int row, int count = 1) {
+        return change_axes([&] { return rows.insert(row, count); });
+    }
+
+    // delete count rows starting at row, references to deleted cells and
+    // ranges with a deleted corner evaluate to undefined
+    bool deleteRows(int row, int count = 1) {
+        if (row < 0 || count <= 0) {
+            return false;
+        }
+        change_axes([&] {
+            for (auto [start, length] : rows.erase(row, count)) {
+                remove_physical_rows(start, length);
+            }
+            // the deleted physical rows can't be restored into
+            forget_history();
+            return true;
+        });
+        forget_deleted_references();
+        return true;
+    }
+
+    bool insertColumns(int column, int count = 1) {
+        return change_axes([&] { return columns.insert(column, count); });
+    }
+
+    bool deleteColumns(int column, int count = 1) {
+        if (column < 0 || count <= 0) {
+            return false;
+        }
+        change_axes([&] {
+            for (auto [start, length] : columns.erase(column, count)) {
+                remove_physical_columns(start, length);
+            }
+            forget_history();
+            return true;
+        });
+        forget_deleted_references();
+        return true;
+    }
+
+    // references to deleted cells and ranges with a deleted corner become
+    // undefined in the formulas of the workbook, as save writes them, and the
+    // formulas are optimized again, so they don't keep dependencies which
+    // load(save()) wouldn't have
+    void forget_deleted_references() {
+        if (!workbook) {
+            forget_deleted_cells();
+            return;
+        }
+        // the sheets of a workbook share the revision
+        for (auto& sheet : *workbook) {
+            sheet->revision = revision;
+            sheet->forget_deleted_cells();
+            revision = sheet->revision;
+        }
+    }
+
+    void forget_deleted_cells() {
+        std::vector<CPos> deleted;
+        for (auto& [pos, cell] : cells) {
+            bool found = false;
+            cell.visit_all([&](Expression& expr) {
+                found |= deleted_reference(expr);
+            });
+            if (found) {
+                deleted.push_back(pos);
+            }
+        }
+
+        for (CPos pos : deleted) {
+            Cell cell = cells.at(pos);
+            cell.visit_all([&](Expression& expr) {
+                if (deleted_reference(expr)) {
+                    expr = std::monostate {};
+                }
+            });
+            optimize_cell(cell);
+            setCell_internal(pos, std::move(cell));
+        }
+    }
+
+    // insert or delete rows or columns with change, the ranges of the sheet
+    // span other physical cells afterwards, so the edges of the cells with
+    // ranges are computed again
+    template<typename F>
+    bool change_axes(F change) {
+        std::vector<CPos> ranged;
+        for (auto& [pos, cell] : cells) {
+            if (has_local_range(cell)) {
+                ranged.push_back(pos);
+                on_references(cell, [&, pos = pos](CPos c) {
+                    this->remove_cell_dependency(c, pos);
+                });
+            }
+        }
+
+        bool changed = change();
+        for (CPos pos : ranged) {
+            if (Cell* cell = get_cell(pos)) {
+                on_references(*cell, [&](CPos c) {
+                    this->add_cell_dependency(c, pos);
+                });
+            }
+        }
+        if (changed) {
+            axes_changed();
+        }
+        return changed;
+    }
+
+    static bool has_local_range(Cell& cell) {
+        bool found = false;
+        cell.visit_all([&](Expression& expr) {
+            Cell::on_variant<CellRange>(expr, [&](CellRange& range) {
+                found |= range.start.sheet == LOCAL_SHEET;
+            });
+        });
+        return found;
+    }
+
+    void axes_changed() {
+        revision++;
+        structure_revision++;
+        axes_changed_at = revision;
+        edited_at = revision;
+        // every cell below may have moved
+        version_edits.edits.reset();
+
+        // the cells of the ranges are counted again in the new order
+        for (auto& [key, index] : range_indices) {
+            index = RangeIndex();
+        }
+        range_edits.clear();
+    }
+
+    // note the edit of the cell at pos for the histograms of range_indices,
+    // edits of histograms nobody reads are dropped with the histograms
+    void cell_edited(CPos pos) {
+        edited_at = revision;
+        if (auto& edits = version_edits.edits) {
+            if (edits->size() > cells.size() + 1024) {
+                edits.reset();
+            } else {
+                edits->push_back(pos);
+            }
+        }
+        if (range_indices.empty()) {
+            return;
+        }
+        if (range_edits.size() > cells.size() + 1024) {
+            for (auto& [key, index] : range_indices) {
+                index = RangeIndex();
+            }
+            range_edits.clear();
+            return;
+        }
+        range_edits.push_back({revision, pos});
+    }
+
+    // drop the edits all histograms have seen
+    void trim_range_edits() {
+        uint64_t oldest = revision;
+        for (const auto& [key, index] : range_indices) {
+            if (index.built) {
+                oldest = std::min(oldest, index.verified_at);
+            }
+        }
+        auto seen = std::find_if(
+            range_edits.begin(), range_edits.end(),
+            [&](const auto& edit) { return edit.first > oldest; }
+        );
+        range_edits.erase(range_edits.begin(), seen);
+    }
+
+    // the cells edited after revision since and the cells depending on them,
+    // directly or through others
+    std::set<CPos> edited_since(uint64_t since) const {
+        auto first = std::upper_bound(
+            range_edits.begin(), range_edits.end(), since,
+            [](uint64_t since, const auto& edit) { return since < edit.first; }
+        );
+        std::vector<CPos> edited;
+        for (auto it = first; it != range_edits.end(); ++it) {
+            edited.push_back(it->second);
+        }
+        return with_dependents(std::move(edited));
+    }
+
+    // the positions in queue and the cells depending on them, directly or
+    // through others
+    std::set<CPos> with_dependents(std::vector<CPos> queue) const {
+        std::set<CPos> affected(queue.begin(), queue.end());
+        while (!queue.empty()) {
+            CPos pos = queue.back();
+            queue.pop_back();
+            auto it = edges.lower_bound({pos, CPos(INT_MIN, INT_MIN)});
+            for (; it != edges.end() && it->first == pos; ++it) {
+                if (affected.insert(it->second).second) {
+                    queue.push_back(it->second);
+                }
+            }
+        }
+        return affected;
+    }
+
+    // whether a sheet the cells of this one read, directly or through other
+    // sheets, was edited after revision since
+    bool sheets_edited_since(uint64_t since) const {
+        if (!workbook) {
+            return false;
+        }
+        std::vector<bool> seen(workbook->size());
+        std::vector<const CSpreadsheet*> stack {this};
+        while (!stack.empty()) {
+            const CSpreadsheet* sheet = stack.back();
+            stack.pop_back();
+            for (const auto& [index, users] : sheet->sheet_users) {
+                if (index < 0 || (size_t)index >= seen.size() || seen[index]) {
+                    continue;
+                }
+                seen[index] = true;
+                const CSpreadsheet* other = (*workbook)[index].get();
+                if (other->edited_at > since) {
+                    return true;
+                }
+                stack.push_back(other);
+            }
+        }
+        return false;
+    }
+
+    void remove_physical_rows(int start, int length) {
+        std::vector<CPos> removed;
+        auto column = cells.begin();
+        while (column != cells.end()) {
+            int x = column->first.x;
+            auto it = cells.lower_bound(CPos(x, start));
+            for (; it != cells.end() && it->first.x == x
+                 && (int64_t)it->first.y - start < length;
+                 it++) {
+                removed.push_back(it->first);
+            }
+            if (x == INT_MAX) {
+                break;
+            }
+            column = cells.lower_bound(CPos(x + 1, INT_MIN));
+        }
+
+        for (CPos pos : removed) {
+            removeCell_internal(pos);
+        }
+    }
+
+    void remove_physical_columns(int start, int length) {
+        std::vector<CPos> removed;
+        auto it = cells.lower_bound(CPos(start, INT_MIN));
+        for (; it != cells.end() && (int64_t)it->first.x - start < length;
+             it++) {
+            removed.push_back(it->first);
+        }
+
+        for (CPos pos : removed) {
+            removeCell_internal(pos);
+        }
+    }
+
+    bool identity_axes() const {
+        return columns.identity() && rows.identity();
+    }
+
+    // whether all sheets references may point into have identity axes
+    bool references_identity() const {
+        if (!identity_axes()) {
+            return false;
+        }
+        if (workbook) {
+            for (const auto& sheet : *workbook) {
+                if (!sheet->identity_axes()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // sheet a reference points into, nullptr if it names a sheet outside of
+    // the workbook
+    const CSpreadsheet* sheet_of(const CellReference& ref) const {
+        if (ref.sheet == LOCAL_SHEET) {
+            return this;
+        }
+        if (!workbook || (size_t)ref.sheet >= workbook->size()) {
+            return nullptr;
+        }
+        return (*workbook)[ref.sheet].get();
+    }
+
+    CSpreadsheet* sheet_of(const CellReference& ref) {
+        return const_cast<CSpreadsheet*>(std::as_const(*this).sheet_of(ref));
+    }
+
+    std::optional<CPos> to_physical(CPos pos) const {
+        auto x = columns.to_physical(pos.x);
+        auto y = rows.to_physical(pos.y);
+        if (!x || !y) {
+            return std::nullopt;
+        }
+        return CPos(*x, *y);
+    }
+
+    // nullopt if the position was deleted
+    std::optional<CPos> to_logical(CPos pos) const {
+        auto x = columns.to_logical(pos.x);
+        auto y = rows.to_logical(pos.y);
+        if (!x || !y) {
+            return std::nullopt;
+        }
+        return CPos(*x, *y);
+    }
+
+    // translate the references of a parsed cell to physical positions,
+    // returns false if one of them isn't mapped
+    bool references_to_physical(Cell& cell) const {
+        if (references_identity()) {
+            return true;
+        }
+
+        bool mapped = true;
+        auto translate = [&](CellReference& ref) {
+            const CSpreadsheet* sheet = sheet_of(ref);
+            auto physical =
+                sheet ? sheet->to_physical(ref.pos) : std::nullopt;
+            if (physical) {
+                ref.pos = *physical;
+            } else {
+                mapped = false;
+            }
+        };
+        cell.visit_all([&](Expression& expr) {
+            Cell::on_variant<CellReference>(expr, translate);
+            Cell::on_variant<CellRange>(expr, [&](CellRange& range) {
+                translate(range.start);
+                translate(range.end);
+            });
+        });
+        return mapped;
+    }
+
+    // move the relative references of a cell by a logical offset, references
+    // to deleted cells stay deleted
+    void apply_offset(Cell& cell, std::pair<int, int> offset) const {
+        if (references_identity()) {
+            cell.apply_offset(offset);
+            return;
+        }
+
+        auto move = [&](CellReference& ref) {
+            const CSpreadsheet* sheet = sheet_of(ref);
+            auto logical = sheet ? sheet->to_logical(ref.pos) : std::nullopt;
+            if (!logical) {
+                return;
+            }
+            CellReference moved = ref;
+            moved.pos = *logical;
+            moved.apply_relative_offset(offset);
+            ref.pos = sheet->to_physical(moved.pos).value_or(moved.pos);
+        };
+        cell.visit_all([&](Expression& expr) {
+            Cell::on_variant<CellReference>(expr, move);
+            Cell::on_variant<CellRange>(expr, [&](CellRange& range) {
+                move(range.start);
+                move(range.end);
+            });
+        });
+    }
+
+    // a range is valid unless one of its corners was deleted
+    bool range_valid(const CellRange& range) const {
+        const CSpreadsheet* sheet = sheet_of(range.start);
+        return sheet
+            && (sheet->identity_axes()
+                || (sheet->to_logical(range.start.pos)
+                    && sheet->to_logical(range.end.pos)));
+    }
+
+    // call fun on the physical positions of the logical rectangle spanned by
+    // the range in the sheet it points into, returns false if the range isn't
+    // valid
+    template<typename F>
+    bool for_range(const CellRange& range, F fun) const {
+        const CSpreadsheet* sheet = sheet_of(range.start);
+        if (!sheet) {
+            return false;
+        }
+        if (sheet->identity_axes()) {
+            range.for_cells(fun);
+            return true;
+        }
+
+        auto start = sheet->to_logical(range.start.pos);
+        auto end = sheet->to_logical(range.end.pos);
+        if (!start || !end) {
+            return false;
+        }
+
+        std::vector<int> xs;
+        for (int x = start->x; x <= end->x; x++) {
+            if (auto physical = sheet->columns.to_physical(x)) {
+                xs.push_back(*physical);
+            }
+        }
+        for (int y = start->y; y <= end->y; y++) {
+            auto physical = sheet->rows.to_physical(y);
+            if (!physical) {
+                continue;
+            }
+            for (int x : xs) {
+                fun(CPos(x, *physical));
+            }
+        }
+        return true;
+    }
+
+    // call fun on the physical positions of all cells of this sheet
+    // referenced by cell
+    template<typename F>
+    void on_references(Cell& cell, F fun) const {
+        if (identity_axes()) {
+            cell.on_cell_references(fun);
+            return;
+        }
+
+        cell.visit_all([&](Expression& expr) {
+            Cell::on_variant<CellReference>(expr, [&](CellReference& ref) {
+                if (ref.sheet == LOCAL_SHEET) {
+                    fun(ref.pos);
+                }
+            });
+            Cell::on_variant<CellRange>(expr, [&](CellRange& range) {
+                if (range.start.sheet == LOCAL_SHEET) {
+                    for_range(range, fun);
+                }
+            });
+        });
+    }
+
+    // copy of the sheet at logical positions, references to deleted cells
+    // become undefined, references into other sheets are translated by their
+    // axes
+    CSpreadsheet normalized() const {
+        CSpreadsheet copy;
+        for (const auto& [pos, cell] : cells) {
+            auto logical = to_logical(pos);
+            if (!logical) {
+                continue;
+            }
+            copy.setCell_internal(*logical, logical_cell(cell));
+        }
+        return copy;
+    }
+
+    // whether the expression references a deleted cell or a range with a
+    // deleted corner, or points outside of the workbook
+    bool deleted_reference(Expression& expr) const {
+        bool deleted = false;
+        Cell::on_variant<CellReference>(expr, [&](CellReference& ref) {
+            const CSpreadsheet* sheet = sheet_of(ref);
+            deleted = !sheet || !sheet->to_logical(ref.pos);
+        });
+        Cell::on_variant<CellRange>(expr, [&](CellRange& range) {
+            deleted = !range_valid(range);
+        });
+        return deleted;
+    }
+
+    // copy of the cell with its references at logical positions, references
+    // to deleted cells become undefined
+    Cell logical_cell(const Cell& cell) const {
+        Cell moved = cell;
+        moved.visit_all([&](Expression& expr) {
+            if (deleted_reference(expr)) {
+                expr = std::monostate {};
+                return;
+            }
+            Cell::on_variant<CellReference>(expr, [&](CellReference& ref) {
+                ref.pos = *sheet_of(ref)->to_logical(ref.pos);
+            });
+            Cell::on_variant<CellRange>(expr, [&](CellRange& range) {
+                const CSpreadsheet* sheet = sheet_of(range.start);
+                range.start.pos = *sheet->to_logical(range.start.pos);
+                range.end.pos = *sheet->to_logical(range.end.pos);
+            });
+        });
+        return moved;
+    }
+
+    Cell* get_cell(CPos pos) {
+        auto entry = cells.find(pos);
+        if (entry == cells.end()) {
+            return nullptr;
+        }
+        return &entry->second;
+    }
+
+    // fold a lambda over a cell range, undefined
+    BoxedValue fold_range(
+        CellRange range,
+        double initial,
+        void (*fun)(double* acc, double input)
+    ) {
+        bool empty = true;
+        double acc = initial;
+        CSpreadsheet* sheet = sheet_of(range.start);
+        for_range(range, [&](CPos pos) {
+            BoxedValue value = value_in(sheet, pos);
+            if (value.is_number()) {
+                empty = false;
+                fun(&acc, value.number());
+            }
+        });
+
+        if (empty) {
+            return BOXED_UNDEFINED;
+        } else {
+            return BoxedValue(acc);
+        }
+    }
+
+    // count cells in range equal to value by scanning the whole range
+    unsigned count_value_scan(const CellRange& range, BoxedValue value) {
+        unsigned count = 0;
+        CSpreadsheet* sheet = sheet_of(range.start);
+        for_range(range, [&](CPos pos) {
+            if (BoxedValue::equals(value, value_in(sheet, pos))) {
+                count++;
+            }
+        });
+        return count;
+    }
+
+    // index of the physical position pos in the for_range order of a range of
+    // this sheet, nullopt if pos lies outside of it
+    std::optional<size_t> range_slot(const CellRange& range, CPos pos) const {
+        auto start = to_logical(range.start.pos);
+        auto end = to_logical(range.end.pos);
+        auto at = to_logical(pos);
+        if (!start || !end || !at
+            || at->x < start->x || at->x > end->x
+            || at->y < start->y || at->y > end->y) {
+            return std::nullopt;
+        }
+        size_t width = (size_t)((int64_t)end->x - start->x + 1);
+        return (size_t)((int64_t)at->y - start->y) * width
+            + (size_t)((int64_t)at->x - start->x);
+    }
+
+    // count cells in range equal to value, ranges shared by multiple COUNT_VAL
+    // cells are counted once into a histogram which is then kept up to date
+    unsigned count_value(const CellRange& range, BoxedValue value) {
+        // only ranges of this sheet are indexed
+        if (range.start.sheet != LOCAL_SHEET) {
+            return count_value_scan(range, value);
+        }
+
+        RangeKey key = range_key(range);
+        auto users = range_users.find(key);
+        if (users == range_users.end() || users->second < 2) {
+            return count_value_scan(range, value);
+        }
+
+        RangeIndex& index = range_indices[key];
+        if (index.refreshing) {
+            return count_value_scan(range, value);
+        }
+
+        // recount the cells whose value differs from the counted one, once
+        // per revision
+        if (index.verified_at != revision) {
+            index.refreshing = true;
+            auto recount = [&](size_t i, CPos pos) {
+                const BoxedValue& current = getValue_internal(pos);
+                if (current.to_bits() != index.counted[i].to_bits()) {
+                    index.remove(index.counted[i]);
+                    index.add(current);
+                    index.counted[i] = current;
+                }
+            };
+            if (!index.built) {
+                for_range(range, [&](CPos pos) {
+                    const BoxedValue& current = getValue_internal(pos);
+                    index.counted.push_back(current);
+                    index.add(current);
+                });
+                auto last = range_slot(range, range.end.pos);
+                index.dense = last && *last + 1 == index.counted.size();
+                index.built = true;
+            } else if (index.dense
+                       && !sheets_edited_since(index.verified_at)) {
+                // only cells depending on the edits of this sheet changed
+                for (CPos pos : edited_since(index.verified_at)) {
+                    if (auto i = range_slot(range, pos)) {
+                        recount(*i, pos);
+                    }
+                }
+            } else {
+                size_t i = 0;
+                for_range(range, [&](CPos pos) { recount(i++, pos); });
+            }
+            index.refreshing = false;
+            index.verified_at = revision;
+            trim_range_edits();
+        }
+
+        if (!RangeIndex::is_countable(value)) {
+            return 0;
+        }
+        return index.count(value);
+    }
+
+    // call lambda on two number arguments, otherwise return undefined
+    static BoxedValue numeric_binary_operator(
+        BoxedValue a,
+        BoxedValue b,
+        double (*fun)(double a, double b)
+    ) {
+        if (!a.is_number() || !b.is_number()) {
+            return BOXED_UNDEFINED;
+        }
+
+        return BoxedValue(fun(a.number(), b.number()));
+    }
+
+    static BoxedValue comparison_binary_operator(
+        BoxedValue a,
+        BoxedValue b,
+        bool (*number_fun)(double a, double b),
+        bool (*string_fun)(const std::string& a, const std::string& b),
+        const StringPool& strings
+    ) {
+        bool compare = false;
+        if (a.is_number() && b.is_number()) {
+            compare = number_fun(a.number(), b.number());
+        } else if (a.is_string() && b.is_string()) {
+            compare = string_fun(
+                strings.get(a.string_handle()),
+                strings.get(b.string_handle())
+            );
+        } else {
+            return BOXED_UNDEFINED;
+        }
+
+        return BoxedValue((double)compare);
+    }
+
+    // value of NEG, the arithmetic and the comparisons on the values of their
+    // arguments, b is ignored by NEG, strings are looked up in and added to
+    // strings, constants are folded with this too
+    static BoxedValue apply_function(
+        FunctionKind kind,
+        BoxedValue a,
+        BoxedValue b,
+        StringPool& strings
+    ) {
+        auto compare = [&](auto number_fun, auto string_fun) {
+            return comparison_binary_operator(
+                a,
+                b,
+                number_fun,
+                string_fun,
+                strings
+            );
+        };
+
+        switch (kind) {
+            case FunctionKind::NEG:
+                if (!a.is_number()) {
+                    return BOXED_UNDEFINED;
+                }
+                return BoxedValue(-a.number());
+            case FunctionKind::POW:
+                return numeric_binary_operator(a, b, [](double a, double b) {
+                    return std::pow(a, b);
+                });
+            case FunctionKind::MUL:
+                return numeric_binary_operator(a, b, [](double a, double b) {
+                    return a * b;
+                });
+            case FunctionKind::DIV:
+                if (b.is_number() && fabs(b.number()) == 0.0) {
+                    return BOXED_UNDEFINED;
+                }
+                return numeric_binary_operator(a, b, [](double a, double b) {
+                    return a / b;
+                });
+            case FunctionKind::ADD: {
+                if (a.is_string() || b.is_string()) {
+                    std::string buf;
+
+                    if (a.is_string()) {
+                        buf = strings.get(a.string_handle());
+                    } else if (a.is_number()) {
+                        buf = std::to_string(a.number());
+                    } else {
+                        return BOXED_UNDEFINED;
+                    }
+
+                    if (b.is_string()) {
+                        buf += strings.get(b.string_handle());
+                    } else if (b.is_number()) {
+                        buf += std::to_string(b.number());
+                    } else {
+                        return BOXED_UNDEFINED;
+                    }
+
+                    return BoxedValue::string(strings.intern(buf));
+                }
+
+                return numeric_binary_operator(a, b, [](double a, double b) {
+                    return a + b;
+                });
+            }
+            case FunctionKind::SUB:
+                return numeric_binary_operator(a, b, [](double a, double b) {
+                    return a - b;
+                });
+            case FunctionKind::LT:
+                return compare(
+                    [](double a, double b) { return a < b; },
+                    [](const std::string& a, const std::string& b) {
+                        return a < b;
+                    }
+                );
+            case FunctionKind::LE:
+                return compare(
+                    [](double a, double b) { return a <= b; },
+                    [](const std::string& a, const std::string& b) {
+                        return a <= b;
+                    }
+                );
+            case FunctionKind::GT:
+                return compare(
+                    [](double a, double b) { return a > b; },
+                    [](const std::string& a, const std::string& b) {
+                        return a > b;
+                    }
+                );
+            case FunctionKind::GE:
+                return compare(
+                    [](double a, double b) { return a >= b; },
+                    [](const std::string& a, const std::string& b) {
+                        return a >= b;
+                    }
+                );
+            case FunctionKind::NE:
+                return compare(
+                    [](double a, double b) { return a != b; },
+                    [](const std::string& a, const std::string& b) {
+                        return a != b;
+                    }
+                );
+            case FunctionKind::EQ:
+                return compare(
+                    [](double a, double b) { return a == b; },
+                    [](const std::string& a, const std::string& b) {
+                        return a == b;
+                    }
+                );
+            default:
+                assert(0 && "Not a scalar function");
+                return BOXED_UNDEFINED;
+        }
+    }
+
+    BoxedValue make_string(std::string_view str) {
+        return BoxedValue::string(strings.intern(str));
+    }
+
+    // value of a cell of this or another sheet, strings of other sheets are
+    // interned into this one
+    BoxedValue value_in(CSpreadsheet* sheet, CPos pos) {
+        if (sheet == this) {
+            return getValue_internal(pos);
+        }
+        if (!sheet) {
+            return BOXED_UNDEFINED;
+        }
+        BoxedValue value = sheet->getValue_internal(pos);
+        if (value.is_string()) {
+            return make_string(sheet->strings.get(value.string_handle()));
+        }
+        return value;
+    }
+
+    CValue to_cvalue(BoxedValue value) const {
+        if (value.is_number()) {
+            return CValue(value.number());
+        } else if (value.is_string()) {
+            return CValue(strings.get(value.string_handle()));
+        } else {
+            return UNDEFINED;
+        }
+    }
+
+    BoxedValue evaluate_expression_internal(const Expression& expr) {
+        // 0 std::monostate
+        // 1 double
+        // 2 std::string
+        // 3 CellReference
+        // 4 CellRange
+        // 5 Function
+        // 6 LocalReference
+        switch (expr.index()) {
+            case 0:
+                return BOXED_UNDEFINED;
+            case 1:
+                return BoxedValue(std::get<double>(expr));
+            case 2:
+                return make_string(std::get<std::string>(expr));
+            case 3: {
+                const CellReference& ref = std::get<CellReference>(expr);
+                if (ref.sheet == LOCAL_SHEET) {
+                    return getValue_internal(ref.pos);
+                }
+                return value_in(sheet_of(ref), ref.pos);
+            }
+            case 4:
+                throw std::invalid_argument("Unexpected cell range");
+            case 5: {
+                const Function& fun = std::get<Function>(expr);
+                switch (fun.kind) {
+                    case FunctionKind::SUM: {
+                        CellRange range = std::get<CellRange>(fun.arguments[0]);
+                        return fold_range(
+                            range,
+                            0.0,
+                            [](double* acc, double in) { *acc += in; }
+                        );
+                    }
+                    case FunctionKind::COUNT: {
+                        CellRange range = std::get<CellRange>(fun.arguments[0]);
+                        CSpreadsheet* sheet = sheet_of(range.start);
+                        int count = 0;
+                        bool valid = for_range(range, [&](CPos pos) {
+                            if (!value_in(sheet, pos).is_undefined()) {
+                                count++;
+                            }
+                        });
+                        if (!valid) {
+                            return BOXED_UNDEFINED;
+                        }
+                        return BoxedValue((double)count);
+                    }
+                    case FunctionKind::COUNT_VAL: {
+                        BoxedValue val = evaluate_expression(fun.arguments[0]);
+                        CellRange range = std::get<CellRange>(fun.arguments[1]);
+                        if (!range_valid(range)) {
+                            return BOXED_UNDEFINED;
+                        }
+                        return BoxedValue((double)count_value(range, val));
+                    }
+                    case FunctionKind::IF: {
+                        BoxedValue cond = evaluate_expression(fun.arguments[0]);
+                        if (!cond.is_number()) {
+                            return BOXED_UNDEFINED;
+                        }
+                        if (cond.number() != 0.0) {
+                            return evaluate_expression(fun.arguments[1]);
+                        } else {
+                            return evaluate_expression(fun.arguments[2]);
+                        }
+                    }
+                    case FunctionKind::MIN: {
+                        CellRange range = std::get<CellRange>(fun.arguments[0]);
+                        return fold_range(
+                            range,
+                            std::numeric_limits<double>::infinity(),
+                            [](double* acc, double in) {
+                                *acc = std::min(*acc, in);
+                            }
+                        );
+                    }
+                    case FunctionKind::MAX: {
+                        CellRange range = std::get<CellRange>(fun.arguments[0]);
+                        return fold_range(
+                            range,
+                            -std::numeric_limits<double>::infinity(),
+                            [](double* acc, double in) {
+                                *acc = std::max(*acc, in);
+                            }
+                        );
+                    }
+                    case FunctionKind::NEG:
+                    case FunctionKind::POW:
+                    case FunctionKind::MUL:
+                    case FunctionKind::DIV:
+                    case FunctionKind::ADD:
+                    case FunctionKind::SUB:
+                    case FunctionKind::LT:
+                    case FunctionKind::LE:
+                    case FunctionKind::GT:
+                    case FunctionKind::GE:
+                    case FunctionKind::NE:
+                    case FunctionKind::EQ: {
+                        BoxedValue a = evaluate_expression(fun.arguments[0]);
+                        BoxedValue b = BOXED_UNDEFINED;
+                        if (fun.kind != FunctionKind::NEG) {
+                            b = evaluate_expression(fun.arguments[1]);
+                        }
+                        return apply_function(fun.kind, a, b, strings);
+                    }
+                    default:
+                        break;
+                }
+                break;
+            }
+            case 6: {
+                LocalReference local = std::get<LocalReference>(expr);
+                std::optional<BoxedValue>& value =
+                    frame->values[local.index];
+                if (!value) {
+                    value = evaluate_expression(frame->locals[local.index]);
+                }
+                return *value;
+            }
+            default:
+                break;
+        }
+        assert(0 && "Unhandled variant");
+        return BOXED_UNDEFINED;
+    }
+
+    BoxedValue evaluate_expression(const Expression& expr) {
+        try {
+            return evaluate_expression_internal(expr);
+        } catch (...) {
+            return BOXED_UNDEFINED;
+        }
+    }
+
+    // check whether an input of the cell changed after the cell was verified,
+    // the inputs are brought up to date first
+    bool inputs_changed(Cell& cell) {
+        if (cell.verified_at == 0 || cell.verified_at < axes_changed_at) {
+            return true;
+        }
+
+        bool changed = false;
+        on_references(cell, [&](CPos c) {
+            if (!changed) {
+                changed = input_changed(c, cell.verified_at);
+            }
+        });
+        if (changed || !workbook) {
+            return changed;
+        }
+
+        // inputs in other sheets, whose rows and columns may have moved too
+        auto check = [&](const CellReference& ref, auto fun) {
+            CSpreadsheet* sheet = sheet_of(ref);
+            if (changed || ref.sheet == LOCAL_SHEET || !sheet) {
+                return;
+            }
+            if (sheet->axes_changed_at > cell.verified_at) {
+                changed = true;
+                return;
+            }
+            // nothing the sheet reads was edited since, its values are the same
+            if (sheet->edited_at <= cell.verified_at
+                && !sheet->sheets_edited_since(cell.verified_at)) {
+                return;
+            }
+            fun(sheet);
+        };
+        cell.visit_all([&](Expression& expr) {
+            Cell::on_variant<CellReference>(expr, [&](CellReference& ref) {
+                check(ref, [&](CSpreadsheet* sheet) {
+                    changed = sheet->input_changed(ref.pos, cell.verified_at);
+                });
+            });
+            Cell::on_variant<CellRange>(expr, [&](CellRange& range) {
+                check(range.start, [&](CSpreadsheet* sheet) {
+                    for_range(range, [&](CPos c) {
+                        if (!changed) {
+                            changed = sheet->input_changed(c, cell.verified_at);
+                        }
+                    });
+                });
+            });
+        });
+        return changed;
+    }
+
+    // bring the cell at c up to date and check whether it changed after the
+    // revision since
+    bool input_changed(CPos c, uint64_t since) {
+        Cell* input = get_cell(c);
+        if (input) {
+            getValue_internal(c);
+            return input->changed_at > since;
+        }
+        return removed_after(c, since);
+    }
+
+    // whether the cell at the empty position c may have been removed after
+    // the revision since
+    bool removed_after(CPos c, uint64_t since) const {
+        auto removed = removed_at.find(c);
+        if (removed != removed_at.end()) {
+            return removed->second > since;
+        }
+        return since < removals_forgotten_at;
+    }
+
+    // getValue but returns a reference
+    const BoxedValue& getValue_internal(CPos pos) {
+        static const BoxedValue STATIC_UNDEFINED = BoxedValue {};
+
+        Cell* cell = get_cell(pos);
+        if (!cell) {
+            return STATIC_UNDEFINED;
+        }
+        return refresh_cell(pos, *cell);
+    }
+
+    // bring a cell up to date, whether its inputs changed since it was last
+    // verified is found out unless the caller already knows
+    const BoxedValue& refresh_cell(
+        CPos pos,
+        Cell& cell,
+        std::optional<bool> changed = std::nullopt
+    ) {
+        if (cell.verified_at == revision) {
+            return cell.cached_value;
+        }
+
+        if (cycle_state(cell) == CycleState::UNKNOWN) {
+            resolve_cycles(pos);
+        }
+
+        // cells in a cycle are undefined, so the evaluation of acyclic cells
+        // never comes back to a cell on the stack
+        BoxedValue value = BOXED_UNDEFINED;
+        if (cell.cycle == CycleState::ACYCLIC) {
+            if (changed ? !*changed : !inputs_changed(cell)) {
+                cell.verified_at = revision;
+                return cell.cached_value;
+            }
+
+            value = evaluate_cell(cell);
+        }
+
+        if (value.to_bits() != cell.cached_value.to_bits()) {
+            cell.cached_value = value;
+            cell.changed_at = revision;
+        }
+        cell.verified_at = revision;
+
+        return cell.cached_value;
+    }
+
+    BoxedValue evaluate_cell(Cell& cell) {
+        NativeSlot& native = cell.native;
+        if (native_enabled && native.evaluations < NATIVE_THRESHOLD
+            && ++native.evaluations == NATIVE_THRESHOLD) {
+            compile_cell(cell);
+        }
+        if (native.formula) {
+            if (auto value = run_native(*native.formula)) {
+                return *value;
+            }
+        }
+
+        LocalFrame locals(cell.locals);
+        LocalFrame* previous_frame = frame;
+        frame = &locals;
+
+        BoxedValue value = evaluate_expression(cell.expression);
+
+        frame = previous_frame;
+        return value;
+    }
+
+    void compile_cell(Cell& cell) {
+        if (native_code.full()) {
+            return;
+        }
+        auto formula = std::make_unique<NativeFormula>();
+        bool compiled = compile_native(
+            cell.expression,
+            cell.locals,
+            *formula,
+            native_code
+        );
+        if (compiled) {
+            cell.native.formula = std::move(formula);
+        }
+    }
+
+    // frame of compiled code running in this sheet
+    struct NativeRun: NativeFrame {
+        CSpreadsheet* sheet;
+        const NativeFormula* formula;
+    };
+
+    static const BoxedValue* fetch_native_input(
+        NativeFrame* frame,
+        uint32_t input
+    ) {
+        static const BoxedValue STATIC_UNDEFINED = BoxedValue {};
+
+        NativeRun* run = static_cast<NativeRun*>(frame);
+        // the values stay in place, evaluating inputs never adds or removes
+        // cells, exceptions can't unwind through the compiled code, the
+        // interpreter takes over and meets them again
+        try {
+            CPos pos = run->formula->inputs[input]->pos;
+            return &run->sheet->getValue_internal(pos);
+        } catch (...) {
+            return &STATIC_UNDEFINED;
+        }
+    }
+
+    // run compiled code, which brings its inputs up to date as it uses them,
+    // std::nullopt if the interpreter has to take over
+    std::optional<BoxedValue> run_native(const NativeFormula& formula) {
+        const BoxedValue* inputs_buffer[32];
+        double scratch_buffer[32];
+        std::vector<const BoxedValue*> inputs_heap;
+        std::vector<double> scratch_heap;
+
+        const BoxedValue** inputs = inputs_buffer;
+        if (formula.inputs.size() > std::size(inputs_buffer)) {
+            inputs_heap.resize(formula.inputs.size());
+            inputs = inputs_heap.data();
+        }
+        double* scratch = scratch_buffer;
+        if (formula.scratch > std::size(scratch_buffer)) {
+            scratch_heap.resize(formula.scratch);
+            scratch = scratch_heap.data();
+        }
+
+        std::fill_n(inputs, formula.inputs.size(), nullptr);
+
+        NativeRun run;
+        run.fetch = fetch_native_input;
+        run.sheet = this;
+        run.formula = &formula;
+        double result;
+        if (!formula.entry(inputs, scratch, &result, &run)) {
+            return std::nullopt;
+        }
+        return BoxedValue(result);
+    }
+
+    void release_native(const Cell& cell) {
+        if (cell.native.formula) {
+            native_code.release(cell.native.formula->size);
+        }
+    }
+
+    // forget all compiled code, hot cells are compiled again
+    void drop_native_code() {
+        for (auto& entry : cells) {
+            entry.second.native = NativeSlot();
+        }
+        native_code.clear();
+    }
+
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        usage.cells = tree_bytes(cells) + tree_bytes(removed_at)
+            + tree_bytes(dirty_chunks) + columns.memory_bytes()
+            + rows.memory_bytes();
+        for (const auto& entry : cells) {
+            usage.expressions += entry.second.memory_bytes();
+        }
+        usage.strings = strings.memory_bytes();
+        usage.dependencies = tree_bytes(edges) + tree_bytes(range_users)
+            + tree_bytes(sheet_users);
+        usage.caches = tree_bytes(range_indices) + native_code.memory_bytes();
+        for (const auto& entry : range_indices) {
+            usage.caches += entry.second.memory_bytes();
+        }
+        for (const auto* steps : {&undo_steps, &redo_steps}) {
+            for (const HistoryStep& step : *steps) {
+                usage.history += allocation_bytes(sizeof(HistoryStep))
+                    + vector_bytes(step.cells) + vector_bytes(step.clean);
+                for (const auto& entry : step.cells) {
+                    if (entry.second) {
+                        usage.history += entry.second->memory_bytes();
+                    }
+                }
+            }
+        }
+        return usage;
+    }
+
+    // drop the cached values of the least recently read chunks until the
+    // memory usage falls to limit or nothing is left to drop, the values are
+    // recomputed when they are read again
+    //
+    // every round drops the colder half of the remaining chunks together with
+    // the histograms of ranges not read after them, then releases the strings
+    // no cached value refers to anymore
+    MemoryUsage evictCaches(size_t limit) {
+        MemoryUsage usage = memoryUsage();
+        if (usage.total() <= limit) {
+            return usage;
+        }
+
+        // a chunk was last read in the last revision one of its cells was
+        // verified in
+        std::map<ChunkKey, uint64_t> read_at;
+        for (const auto& [pos, cell] : cells) {
+            if (cell.verified_at != 0) {
+                uint64_t& last = read_at[chunk_of(pos)];
+                last = std::max(last, cell.verified_at);
+            }
+        }
+        std::vector<std::pair<uint64_t, ChunkKey>> order;
+        for (auto [key, last] : read_at) {
+            order.push_back({last, key});
+        }
+        std::sort(order.begin(), order.end());
+
+        // compiled code is cheap to rebuild for the cells which stay hot
+        drop_native_code();
+
+        // the dependents of dropped values see them change, in other sheets
+        // of the workbook too
+        revision++;
+        share_revision();
+
+        size_t next = 0;
+        while (true) {
+            size_t end = std::min(
+                order.size(),
+                next + std::max<size_t>(1, (order.size() - next + 1) / 2)
+            );
+            uint64_t read_before =
+                end < order.size() ? order[end - 1].first : UINT64_MAX;
+
+            std::set<ChunkKey> cold;
+            for (; next < end; next++) {
+                cold.insert(order[next].second);
+            }
+            for (auto& [pos, cell] : cells) {
+                if (cell.verified_at != 0 && cold.count(chunk_of(pos))) {
+                    cell.cached_value = BOXED_UNDEFINED;
+                    cell.verified_at = 0;
+                    cell.changed_at = revision;
+                }
+            }
+            std::erase_if(range_indices, [&](const auto& entry) {
+                return entry.second.verified_at <= read_before;
+            });
+            collect_strings();
+
+            usage = memoryUsage();
+            if (usage.total() <= limit || next == order.size()) {
+                return usage;
+            }
+        }
+    }
+
+    // the revisions of cells are compared across the sheets of a workbook, so
+    // all of them take the revision of the last edit or eviction in any sheet
+    void share_revision() {
+        if (!workbook) {
+            return;
+        }
+        for (auto& other : *workbook) {
+            other->revision = revision;
+        }
+    }
+
+    // release the strings of replaced values once the pool outgrew the cells
+    // and the strings kept last time, so releasing is paid for by the strings
+    // interned in between, only called when no handles are held outside of
+    // the cells
+    void release_strings() {
+        if (strings.size() > 2 * (strings_kept + cells.size()) + 64) {
+            collect_strings();
+        }
+    }
+
+    // release the strings no cached value refers to
+    void collect_strings() {
+        std::vector<bool> live(strings.size());
+        auto mark = [&](BoxedValue value) {
+            if (value.is_string()) {
+                live[value.string_handle()] = true;
+            }
+        };
+        for (const auto& entry : cells) {
+            mark(entry.second.cached_value);
+        }
+        for (const auto& entry : range_indices) {
+            for (BoxedValue value : entry.second.counted) {
+                mark(value);
+            }
+        }
+
+        std::vector<uint64_t> handles = strings.compact(live);
+        strings_kept = strings.size();
+        auto remap = [&](BoxedValue& value) {
+            if (value.is_string()) {
+                value = BoxedValue::string(handles[value.string_handle()]);
+            }
+        };
+        for (auto& entry : cells) {
+            remap(entry.second.cached_value);
+        }
+        for (auto& entry : range_indices) {
+            RangeIndex& index = entry.second;
+            index.histogram.clear();
+            for (BoxedValue& value : index.counted) {
+                remap(value);
+                index.add(value);
+            }
+        }
+    }
+
+    // bring all cells up to date
+    void recalculate() {
+        for (auto& entry : cells) {
+            getValue_internal(entry.first);
+        }
+        release_strings();
+    }
+
+    CValue getValue(CPos pos) {
+        auto physical = to_physical(pos);
+        if (!physical) {
+            return UNDEFINED;
+        }
+        CValue value = to_cvalue(getValue_internal(*physical));
+        release_strings();
+        return value;
+    }
+
+    // fill out with the values of the w x h rectangle at corner in column
+    // major order, out[x * h + y] is the value at corner + (x, y)
+    //
+    // the cells which aren't up to date are refreshed first, each after its
+    // stale inputs, so no evaluation recurses deeply, then the values are
+    // copied out of the cells column by column
+    void getValues(CPos corner, int w, int h, CValue* out) {
+        assert(w >= 0);
+        assert(h >= 0);
+
+        std::vector<StaleCell> stack;
+        for_rect_cells(corner, w, h, [&](size_t, CPos pos, Cell& cell) {
+            if (cell.verified_at != revision) {
+                refresh_inputs_first(pos, cell, stack);
+            }
+        });
+
+        std::fill(out, out + (size_t)w * h, UNDEFINED);
+        for_rect_cells(corner, w, h, [&](size_t i, CPos, Cell& cell) {
+            out[i] = to_cvalue(cell.cached_value);
+        });
+        release_strings();
+    }
+
+    // evaluate count scenarios without changing the sheet, scenario i gives
+    // the cells at inputs the values values[i * inputs.size() + j] and reads
+    // the outputs into results[i * outputs.size() + k], as if by setCell and
+    // getValue
+    //
+    // the cells between the inputs and the outputs are compiled once, then
+    // batches of scenarios are evaluated on up to threads threads, returns
+    // false if a position is deleted or the batches run out of memory
+    bool evaluateScenarios(
+        const std::vector<CPos>& inputs,
+        const std::vector<CPos>& outputs,
+        size_t count,
+        const CValue* values,
+        CValue* results,
+        unsigned threads = 1
+    ) {
+        std::vector<CPos> physical_inputs;
+        std::vector<CPos> physical_outputs;
+        for (CPos pos : inputs) {
+            auto physical = to_physical(pos);
+            if (!physical) {
+                return false;
+            }
+            physical_inputs.push_back(*physical);
+        }
+        for (CPos pos : outputs) {
+            auto physical = to_physical(pos);
+            if (!physical) {
+                return false;
+            }
+            physical_outputs.push_back(*physical);
+        }
+
+        ScenarioPlan plan = plan_scenarios(physical_inputs, physical_outputs);
+
+        // strings are interned before the pool is shared by the batches
+        std::vector<BoxedValue> boxed(count * inputs.size());
+        for (size_t i = 0; i < boxed.size(); i++) {
+            const CValue& value = values[i];
+            if (std::holds_alternative<double>(value)) {
+                boxed[i] = BoxedValue(std::get<double>(value));
+            } else if (std::holds_alternative<std::string>(value)) {
+                boxed[i] = make_string(std::get<std::string>(value));
+            }
+        }
+
+        size_t lanes = plan.batch_lanes();
+        size_t batches = (count + lanes - 1) / lanes;
+        try {
+            parallel_for(batches, threads, [&](size_t batch) {
+                size_t first = batch * lanes;
+                ScenarioStrings strings(this->strings);
+                plan.run(
+                    boxed.data(),
+                    first,
+                    std::min(lanes, count - first),
+                    strings,
+                    results
+                );
+            });
+        } catch (std::bad_alloc& e) {
+            return false;
+        }
+        release_strings();
+        return true;
+    }
+
+    struct StaleCell {
+        CPos pos;
+        Cell* cell;
+        // the stale inputs of the cell were pushed above it
+        bool expanded;
+    };
+
+    // refresh_cell in topological order of the stale inputs of root, the
+    // inputs of a cell are looked up once to find both the stale ones and
+    // whether the others changed
+    void refresh_inputs_first(
+        CPos root,
+        Cell& cell,
+        std::vector<StaleCell>& stack
+    ) {
+        stack.push_back({root, &cell, false});
+        while (!stack.empty()) {
+            StaleCell top = stack.back();
+            stack.pop_back();
+
+            Cell& current = *top.cell;
+            if (current.verified_at == revision) {
+                continue;
+            }
+            if (top.expanded) {
+                refresh_cell(top.pos, current);
+                continue;
+            }
+
+            if (cycle_state(current) == CycleState::UNKNOWN) {
+                resolve_cycles(top.pos);
+            }
+            // cells in a cycle don't read their inputs
+            if (current.cycle != CycleState::ACYCLIC) {
+                refresh_cell(top.pos, current);
+                continue;
+            }
+
+            size_t size = stack.size();
+            stack.push_back({top.pos, &current, true});
+            bool changed = current.verified_at == 0
+                || current.verified_at < axes_changed_at;
+            on_references(current, [&](CPos c) {
+                Cell* input = get_cell(c);
+                if (input && input->verified_at != revision) {
+                    stack.push_back({c, input, false});
+                } else if (input) {
+                    changed |= input->changed_at > current.verified_at;
+                } else if (!changed) {
+                    changed = removed_after(c, current.verified_at);
+                }
+            });
+
+            // all inputs are up to date, inputs in other sheets are checked
+            // by refresh_cell
+            if (stack.size() == size + 1) {
+                stack.pop_back();
+                refresh_cell(
+                    top.pos,
+                    current,
+                    workbook ? std::nullopt : std::optional<bool>(changed)
+                );
+            }
+        }
+    }
+
+    // compile the cells which depend on the inputs and which the outputs
+    // depend on, in evaluation order, the other cells they reference keep
+    // their current values
+    //
+    // the inputs lose their formulas in the scenarios, so the cycles among
+    // the compiled cells are found again with the inputs as sources
+    ScenarioPlan plan_scenarios(
+        const std::vector<CPos>& inputs,
+        const std::vector<CPos>& outputs
+    ) {
+        ScenarioPlan plan;
+        plan.inputs = inputs.size();
+
+        // later duplicates win, like later calls of setCell
+        std::map<CPos, uint32_t> columns;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            columns[inputs[i]] = (uint32_t)i;
+        }
+
+        std::set<CPos> affected(inputs.begin(), inputs.end());
+        std::vector<CPos> queue(affected.begin(), affected.end());
+        while (!queue.empty()) {
+            CPos pos = queue.back();
+            queue.pop_back();
+            auto edge = edges.lower_bound({pos, CPos(INT_MIN, INT_MIN)});
+            for (; edge != edges.end() && edge->first == pos; edge++) {
+                if (affected.insert(edge->second).second) {
+                    queue.push_back(edge->second);
+                }
+            }
+        }
+
+        auto compiled = [&](CPos pos) {
+            return affected.count(pos) && !columns.count(pos) && get_cell(pos);
+        };
+
+        ComponentFinder finder;
+        std::vector<std::pair<CPos, bool>> order;
+        for (CPos root : outputs) {
+            if (!compiled(root) || finder.visited(root)) {
+                continue;
+            }
+            auto successors = [&](CPos pos, std::vector<CPos>& out) {
+                on_references(*get_cell(pos), [&](CPos c) {
+                    if (compiled(c)) {
+                        out.push_back(c);
+                    }
+                });
+            };
+            finder.search(root, successors, [&](CPos pos, bool cyclic) {
+                order.push_back({pos, cyclic});
+            });
+        }
+
+        for (size_t i = 0; i < order.size(); i++) {
+            columns[order[i].first] = (uint32_t)(inputs.size() + i);
+        }
+        for (auto [pos, cyclic] : order) {
+            uint32_t first = (uint32_t)plan.nodes.size();
+            Cell& cell = *get_cell(pos);
+            if (cyclic) {
+                plan.nodes.push_back({ScenarioPlan::NodeKind::CONSTANT});
+            } else {
+                std::vector<uint32_t> locals(
+                    cell.locals.size(),
+                    ScenarioPlan::NONE
+                );
+                compile_scenario_node(
+                    plan,
+                    columns,
+                    cell,
+                    cell.expression,
+                    locals
+                );
+            }
+            uint32_t end = (uint32_t)plan.nodes.size();
+            plan.programs.push_back({first, end});
+            plan.max_program = std::max(plan.max_program, end - first);
+        }
+
+        for (CPos pos : outputs) {
+            auto column = columns.find(pos);
+            if (column != columns.end()) {
+                plan.outputs.push_back({column->second, BOXED_UNDEFINED});
+            } else {
+                BoxedValue value = getValue_internal(pos);
+                plan.outputs.push_back({ScenarioPlan::NONE, value});
+            }
+        }
+        return plan;
+    }
+
+    // append the nodes of an expression of a compiled cell, returns the node
+    // giving its value
+    uint32_t compile_scenario_node(
+        ScenarioPlan& plan,
+        const std::map<CPos, uint32_t>& columns,
+        Cell& cell,
+        const Expression& expr,
+        std::vector<uint32_t>& locals
+    ) {
+        using Node = ScenarioPlan::Node;
+        using NodeKind = ScenarioPlan::NodeKind;
+
+        auto add = [&](Node node) {
+            plan.nodes.push_back(node);
+            return (uint32_t)plan.nodes.size() - 1;
+        };
+        auto constant = [&](BoxedValue value) {
+            Node node {NodeKind::CONSTANT};
+            node.value = value;
+            return add(node);
+        };
+
+        switch (expr.index()) {
+            case 1:
+                return constant(BoxedValue(std::get<double>(expr)));
+            case 2:
+                return constant(make_string(std::get<std::string>(expr)));
+            case 3: {
+                const CellReference& ref = std::get<CellReference>(expr);
+                if (ref.sheet != LOCAL_SHEET) {
+                    return constant(value_in(sheet_of(ref), ref.pos));
+                }
+                auto column = columns.find(ref.pos);
+                if (column == columns.end()) {
+                    return constant(getValue_internal(ref.pos));
+                }
+                Node node {NodeKind::COLUMN};
+                node.column = column->second;
+                return add(node);
+            }
+            case 5:
+                break;
+            case 6: {
+                uint32_t index = std::get<LocalReference>(expr).index;
+                if (locals[index] == ScenarioPlan::NONE) {
+                    locals[index] = compile_scenario_node(
+                        plan,
+                        columns,
+                        cell,
+                        cell.locals[index],
+                        locals
+                    );
+                }
+                return locals[index];
+            }
+            default:
+                return constant(BOXED_UNDEFINED);
+        }
+
+        const Function& fun = std::get<Function>(expr);
+        Node node {NodeKind::FUNCTION};
+        node.function = fun.kind;
+        switch (fun.kind) {
+            case FunctionKind::SUM:
+            case FunctionKind::COUNT:
+            case FunctionKind::MIN:
+            case FunctionKind::MAX:
+            case FunctionKind::COUNT_VAL:
+                break;
+            default:
+                for (size_t i = 0; i < fun.argument_count(); i++) {
+                    node.arguments[i] = compile_scenario_node(
+                        plan,
+                        columns,
+                        cell,
+                        fun.arguments[i],
+                        locals
+                    );
+                }
+                return add(node);
+        }
+
+        bool counted = fun.kind == FunctionKind::COUNT_VAL;
+        const Expression& argument = fun.arguments[counted ? 1 : 0];
+        if (!std::holds_alternative<CellRange>(argument)) {
+            return constant(BOXED_UNDEFINED);
+        }
+        if (counted) {
+            node.arguments[0] = compile_scenario_node(
+                plan,
+                columns,
+                cell,
+                fun.arguments[0],
+                locals
+            );
+        }
+
+        const CellRange& cell_range = std::get<CellRange>(argument);
+        CSpreadsheet* sheet = sheet_of(cell_range.start);
+        bool local = cell_range.start.sheet == LOCAL_SHEET;
+        ScenarioPlan::Range range;
+        range.prefix = fun.kind == FunctionKind::MIN
+            ? std::numeric_limits<double>::infinity()
+            : fun.kind == FunctionKind::MAX
+            ? -std::numeric_limits<double>::infinity()
+            : 0.0;
+        bool valid = for_range(cell_range, [&](CPos pos) {
+            auto column = local ? columns.find(pos) : columns.end();
+            if (column != columns.end()) {
+                range.items.push_back({column->second, BOXED_UNDEFINED});
+                return;
+            }
+            BoxedValue value = value_in(sheet, pos);
+            switch (fun.kind) {
+                case FunctionKind::COUNT:
+                    range.defined += !value.is_undefined();
+                    break;
+                case FunctionKind::COUNT_VAL:
+                    range.constants.add(value);
+                    break;
+                default:
+                    if (!value.is_number()) {
+                        break;
+                    }
+                    if (range.items.empty()) {
+                        // the same fold as fold_range
+                        range.empty = false;
+                        range.prefix = fun.kind == FunctionKind::SUM
+                            ? range.prefix + value.number()
+                            : fun.kind == FunctionKind::MIN
+                            ? std::min(range.prefix, value.number())
+                            : std::max(range.prefix, value.number());
+                    } else {
+                        range.items.push_back({ScenarioPlan::NONE, value});
+                    }
+                    break;
+            }
+        });
+        range.valid = counted ? range_valid(cell_range) : valid;
+
+        node.range = (uint32_t)plan.ranges.size();
+        plan.ranges.push_back(std::move(range));
+        return add(node);
+    }
+
+    // call fun(index into the column major buffer, physical position, cell)
+    // for the cells of a logical rectangle, a column of cells is a run of
+    // the map unless rows were inserted or deleted
+    template<typename F>
+    void for_rect_cells(CPos corner, int w, int h, F fun) {
+        for (int i = 0; i < w; i++) {
+            auto x = columns.to_physical(corner.x + i);
+            if (!x) {
+                continue;
+            }
+            size_t column = (size_t)i * h;
+
+            if (rows.identity()) {
+                auto it = cells.lower_bound(CPos(*x, corner.y));
+                for (; it != cells.end() && it->first.x == *x
+                       && it->first.y < corner.y + h;
+                     it++) {
+                    size_t j = (size_t)(it->first.y - corner.y);
+                    fun(column + j, it->first, it->second);
+                }
+                continue;
+            }
+
+            for (int j = 0; j < h; j++) {
+                auto y = rows.to_physical(corner.y + j);
+                if (!y) {
+                    continue;
+                }
+                auto entry = cells.find(CPos(*x, *y));
+                if (entry != cells.end()) {
+                    fun(column + j, entry->first, entry->second);
+                }
+            }
+        }
+    }
+
+    // copy between logical positions
+    void copyCell(CPos src, CPos dst) {
+        if (dst == src) {
+            return;
+        }
+
+        auto physical_src = to_physical(src);
+        auto physical_dst = to_physical(dst);
+        if (!physical_dst) {
+            return;
+        }
+
+        auto entry = physical_src ? cells.find(*physical_src) : cells.end();
+        if (entry == cells.end()) {
+            removeCell_internal(*physical_dst);
+        } else {
+            Cell copy = entry->second;
+            auto offset = CPos::make_relative_offset(src, dst);
+            apply_offset(copy, offset);
+
+            setCell_internal(*physical_dst, std::move(copy));
+        }
+    }
+
+    void copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
+        record([&] { copy_rect(dst, src, w, h); });
+    }
+
+    void copy_rect(CPos dst, CPos src, int w, int h) {
+        assert(w >= 0);
+        assert(h >= 0);
+
+        if (src == dst || w == 0 || h == 0) {
+            return;
+        }
+
+        int x_start = src.x;
+        int x_end = src.x + w - 1;  // end inclusive
+        int x_d = 1;
+
+        // the copy ranges may overlap so we need to reverse the copy direction
+        if (dst.x > src.x) {
+            std::swap(x_start, x_end);
+            x_d = -1;
+        }
+
+        int y_start = src.y;
+        int y_end = src.y + h - 1;
+        int y_d = 1;
+
+        if (dst.y > src.y) {
+            std::swap(y_start, y_end);
+            y_d = -1;
+        }
+
+        auto offset = CPos::make_relative_offset(src, dst);
+
+        for (int y = y_start;; y += y_d) {
+            for (int x = x_start;; x += x_d) {
+                CPos src_(x, y);
+                CPos dst_ = src_ + offset;
+                copyCell(src_, dst_);
+                if (x == x_end) {
+                    break;
+                }
+            }
+            if (y == y_end) {
+                break;
+            }
+        }
+    }
+};
+
+// simplifies a formula when a cell is set:
+//  * folds subexpressions with constant arguments
+//  * replaces IF with a constant condition by the taken branch
+//  * simplifies identities which hold for all values the operand may take
+//  * moves repeated subexpressions into locals which are evaluated once
+class ExpressionOptimizer {
+    struct Node {
+        Expression* expr;
+        size_t hash;
+        size_t size;
+    };
+
+    std::vector<Expression>& locals;
+
+  public:
+    ExpressionOptimizer(std::vector<Expression>& locals) : locals(locals) {}
+
+    void optimize(Expression& expr) {
+        fold(expr);
+        eliminate_common(expr);
+    }
+
+    static bool is_constant(const Expression& expr) {
+        return std::holds_alternative<std::monostate>(expr)
+            || std::holds_alternative<double>(expr)
+            || std::holds_alternative<std::string>(expr);
+    }
+
+    // exact match including the sign of zero
+    static bool is_number(const Expression& expr, double value) {
+        return std::holds_alternative<double>(expr)
+            && std::get<double>(expr) == value
+            && std::signbit(std::get<double>(expr)) == std::signbit(value);
+    }
+
+    // a constant or a function of constants other than IF and the range
+    // functions, which need nothing of a sheet but a pool for the strings
+    static BoxedValue constant_value(
+        const Expression& expr,
+        StringPool& strings
+    ) {
+        switch (expr.index()) {
+            case 1:
+                return BoxedValue(std::get<double>(expr));
+            case 2:
+                return BoxedValue::string(
+                    strings.intern(std::get<std::string>(expr))
+                );
+            case 5: {
+                const Function& fun = std::get<Function>(expr);
+                BoxedValue a = constant_value(fun.arguments[0], strings);
+                BoxedValue b = BOXED_UNDEFINED;
+                if (fun.kind != FunctionKind::NEG) {
+                    b = constant_value(fun.arguments[1], strings);
+                }
+                return CSpreadsheet::apply_function(fun.kind, a, b, strings);
+            }
+            default:
+                return BOXED_UNDEFINED;
+        }
+    }
+
+    static CValue evaluate_constant(const Expression& expr) {
+        StringPool strings;
+        BoxedValue value = constant_value(expr, strings);
+        if (value.is_number()) {
+            return CValue(value.number());
+        } else if (value.is_string()) {
+            return CValue(strings.get(value.string_handle()));
+        }
+        return UNDEFINED;
+    }
+
+    static Expression from_value(CValue value) {
+        switch (value.index()) {
+            case 1:
+                return Expression(std::get<double>(value));
+            case 2:
+                return Expression(std::get<std::string>(std::move(value)));
+            default:
+                return Expression();
+        }
+    }
+
+    // whether the expression may evaluate to a string, identities such as
+    // x * 1 = x do not hold for strings since x * 1 is undefined
+    bool may_be_string(const Expression& expr) const {
+        switch (expr.index()) {
+            case 0:
+            case 1:
+                return false;
+            case 5: {
+                const Function& fun = std::get<Function>(expr);
+                switch (fun.kind) {
+                    case FunctionKind::ADD:
+                        return may_be_string(fun.arguments[0])
+                            || may_be_string(fun.arguments[1]);
+                    case FunctionKind::IF:
+                        return may_be_string(fun.arguments[1])
+                            || may_be_string(fun.arguments[2]);
+                    default:
+                        return false;
+                }
+            }
+            case 6: {
+                LocalReference local = std::get<LocalReference>(expr);
+                return may_be_string(locals[local.index]);
+            }
+            default:
+                return true;
+        }
+    }
+
+    void fold(Expression& expr) {
+        if (!std::holds_alternative<Function>(expr)) {
+            return;
+        }
+
+        Function& fun = std::get<Function>(expr);
+        for (auto& arg : fun) {
+            fold(arg);
+        }
+
+        Expression* args = fun.arguments.get();
+        switch (fun.kind) {
+            case FunctionKind::SUM:
+            case FunctionKind::COUNT:
+            case FunctionKind::MIN:
+            case FunctionKind::MAX:
+            case FunctionKind::COUNT_VAL:
+                return;
+            case FunctionKind::IF: {
+                if (!is_constant(args[0])) {
+                    return;
+                }
+                CValue cond = evaluate_constant(args[0]);
+                if (!std::holds_alternative<double>(cond)) {
+                    expr = Expression();
+                    return;
+                }
+                Expression taken =
+                    std::move(args[std::get<double>(cond) != 0.0 ? 1 : 2]);
+                expr = std::move(taken);
+                return;
+            }
+            default:
+                break;
+        }
+
+        if (std::all_of(fun.begin(), fun.end(), is_constant)) {
+            expr = from_value(evaluate_constant(expr));
+            return;
+        }
+
+        simplify_identity(expr);
+    }
+
+    void simplify_identity(Expression& expr) {
+        Function& fun = std::get<Function>(expr);
+        Expression* args = fun.arguments.get();
+
+        Expression* replacement = nullptr;
+        switch (fun.kind) {
+            case FunctionKind::MUL:
+                if (is_number(args[1], 1.0)) {
+                    replacement = &args[0];
+                } else if (is_number(args[0], 1.0)) {
+                    replacement = &args[1];
+                }
+                break;
+            case FunctionKind::DIV:
+            case FunctionKind::POW:
+                if (is_number(args[1], 1.0)) {
+                    replacement = &args[0];
+                }
+                break;
+            case FunctionKind::SUB:
+                // x + 0 would turn -0 into 0
+                if (is_number(args[1], 0.0)) {
+                    replacement = &args[0];
+                }
+                break;
+            case FunctionKind::NEG:
+                Cell::on_variant<Function>(args[0], [&](Function& inner) {
+                    if (inner.kind == FunctionKind::NEG) {
+                        replacement = &inner.arguments[0];
+                    }
+                });
+                break;
+            default:
+                break;
+        }
+
+        if (replacement && !may_be_string(*replacement)) {
+            Expression taken = std::move(*replacement);
+            expr = std::move(taken);
+        }
+    }
+
+    static size_t hash_combine(size_t seed, size_t value) {
+        return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+    }
+
+    static size_t hash_cell_ref(const CellReference& ref) {
+        size_t hash = std::hash<int>()(ref.pos.x);
+        hash = hash_combine(hash, std::hash<int>()(ref.pos.y));
+        hash = hash_combine(hash, std::hash<int>()(ref.sheet));
+        return hash_combine(hash, ref.x_absolute | (ref.y_absolute << 1));
+    }
+
+    static bool cell_ref_equal(const CellReference& a, const CellReference& b) {
+        return a.pos == b.pos && a.x_absolute == b.x_absolute
+            && a.y_absolute == b.y_absolute && a.sheet == b.sheet;
+    }
+
+    static bool expression_equal(const Expression& a, const Expression& b) {
+        if (a.index() != b.index()) {
+            return false;
+        }
+        switch (a.index()) {
+            case 0:
+                return true;
+            case 1: {
+                double a_ = std::get<double>(a);
+                double b_ = std::get<double>(b);
+                return std::memcmp(&a_, &b_, sizeof(double)) == 0;
+            }
+            case 2:
+                return std::get<std::string>(a) == std::get<std::string>(b);
+            case 3:
+                return cell_ref_equal(
+                    std::get<CellReference>(a),
+                    std::get<CellReference>(b)
+                );
+            case 4: {
+                const CellRange& a_ = std::get<CellRange>(a);
+                const CellRange& b_ = std::get<CellRange>(b);
+                return cell_ref_equal(a_.start, b_.start)
+                    && cell_ref_equal(a_.end, b_.end);
+            }
+            case 5: {
+                const Function& a_ = std::get<Function>(a);
+                const Function& b_ = std::get<Function>(b);
+                if (a_.kind != b_.kind) {
+                    return false;
+                }
+                for (size_t i = 0; i < a_.argument_count(); i++) {
+                    if (!expression_equal(a_.arguments[i], b_.arguments[i])) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            case 6:
+                return std::get<LocalReference>(a).index
+                    == std::get<LocalReference>(b).index;
+            default:
+                assert(false);
+                return false;
+        }
+    }
+
+    // collect all functions in the expression, returns its hash and size
+    static std::pair<size_t, size_t>
+    collect(Expression& expr, std::vector<Node>& nodes) {
+        size_t hash = expr.index();
+        size_t size = 1;
+        switch (expr.index()) {
+            case 1: {
+                double value = std::get<double>(expr);
+                uint64_t bits = 0;
+                std::memcpy(&bits, &value, sizeof(double));
+                hash = hash_combine(hash, std::hash<uint64_t>()(bits));
+                break;
+            }
+            case 2:
+                hash = hash_combine(
+                    hash,
+                    std::hash<std::string>()(std::get<std::string>(expr))
+                );
+                break;
+            case 3:
+                hash = hash_combine(
+                    hash,
+                    hash_cell_ref(std::get<CellReference>(expr))
+                );
+                break;
+            case 4: {
+                const CellRange& range = std::get<CellRange>(expr);
+                hash = hash_combine(hash, hash_cell_ref(range.start));
+                hash = hash_combine(hash, hash_cell_ref(range.end));
+                break;
+            }
+            case 5: {
+                Function& fun = std::get<Function>(expr);
+                hash = hash_combine(hash, (size_t)fun.kind);
+                for (auto& arg : fun) {
+                    auto child = collect(arg, nodes);
+                    hash = hash_combine(hash, child.first);
+                    size += child.second;
+                }
+                nodes.push_back({&expr, hash, size});
+                break;
+            }
+            case 6:
+                hash = hash_combine(hash, std::get<LocalReference>(expr).index);
+                break;
+            default:
+                break;
+        }
+        return {hash, size};
+    }
+
+    // repeatedly move the largest repeated subexpression into a local
+    void eliminate_common(Expression& root) {
+        while (true) {
+            std::vector<Node> nodes;
+            for (auto& local : locals) {
+                collect(local, nodes);
+            }
+            collect(root, nodes);
+
+            std::sort(nodes.begin(), nodes.end(), [](auto& a, auto& b) {
+                return std::make_pair(a.size, a.hash)
+                    > std::make_pair(b.size, b.hash);
+            });
+
+            std::vector<Expression*> repeated;
+            for (size_t i = 0; i < nodes.size() && repeated.size() < 2; i++) {
+                repeated.clear();
+                repeated.push_back(nodes[i].expr);
+                for (size_t j = i + 1; j < nodes.size()
+                     && nodes[j].size == nodes[i].size
+                     && nodes[j].hash == nodes[i].hash;
+                     j++) {
+                    if (expression_equal(*nodes[i].expr, *nodes[j].expr)) {
+                        repeated.push_back(nodes[j].expr);
+                    }
+                }
+            }
+
+            if (repeated.size() < 2) {
+                return;
+            }
+
+            Expression local = *repeated[0];
+            LocalReference reference {(uint32_t)locals.size()};
+            for (Expression* expr : repeated) {
+                *expr = reference;
+            }
+            // pointers into locals are not used past this point
+            locals.push_back(std::move(local));
+        }
+    }
+};
+
+void optimize_cell(Cell& cell) {
+    ExpressionOptimizer optimizer(cell.locals);
+    optimizer.optimize(cell.expression);
+    // compiled code points into the old expression
+    cell.native = NativeSlot();
+}
+
+// written before the hash of a saved workbook
+const int64_t WORKBOOK_MAGIC = 0x4b4f4f42'4b4c56;
+
+// named sheets whose formulas may reference cells of each other as Sheet!A1,
+// Sheet!$A$1:B2 or 'Sheet name'!A1, unqualified references point into the
+// sheet of the formula
+//
+// a sheet depends on the sheets its cells reference, this graph is kept
+// acyclic by rejecting formulas which would close a cycle, so a cycle of
+// cells never spans sheets and recalculate can evaluate the sheets in levels,
+// each level in parallel after all sheets it depends on
+class CWorkbook {
+    // owned through pointers, since the sheets point into the vector
+    std::vector<std::unique_ptr<CSpreadsheet>> sheets;
+    std::vector<std::string> names;
+
+    std::optional<size_t> find(std::string_view name) const {
+        auto it = std::find(names.begin(), names.end(), name);
+        if (it == names.end()) {
+            return std::nullopt;
+        }
+        return (size_t)(it - names.begin());
+    }
+
+    void edited(CSpreadsheet& sheet) {
+        sheet.share_revision();
+    }
+
+    template<typename F>
+    bool edit_axes(std::string_view sheet, F fun) {
+        auto index = find(sheet);
+        if (!index || !fun(*sheets[*index])) {
+            return false;
+        }
+        edited(*sheets[*index]);
+        return true;
+    }
+
+    // whether sheet from references sheet to, directly or through others
+    bool depends_on(size_t from, size_t to) const {
+        std::vector<bool> seen(sheets.size());
+        std::vector<size_t> stack {from};
+        while (!stack.empty()) {
+            size_t sheet = stack.back();
+            stack.pop_back();
+            if (sheet == to) {
+                return true;
+            }
+            if (seen[sheet]) {
+                continue;
+            }
+            seen[sheet] = true;
+            for (auto [other, users] : sheets[sheet]->sheet_users) {
+                stack.push_back((size_t)other);
+            }
+        }
+        return false;
+    }
+
+    // group the sheets into levels which depend only on earlier levels,
+    // returns false if the sheets depend on each other in a cycle
+    bool levels(std::vector<std::vector<size_t>>& result) const {
+        std::vector<size_t> waiting(sheets.size());
+        std::vector<std::vector<size_t>> dependents(sheets.size());
+        std::vector<size_t> level;
+        for (size_t i = 0; i < sheets.size(); i++) {
+            for (auto [other, users] : sheets[i]->sheet_users) {
+                if (other < 0 || (size_t)other >= sheets.size()) {
+                    return false;
+                }
+                dependents[other].push_back(i);
+            }
+            waiting[i] = sheets[i]->sheet_users.size();
+            if (waiting[i] == 0) {
+                level.push_back(i);
+            }
+        }
+
+        size_t done = 0;
+        result.clear();
+        while (!level.empty()) {
+            std::vector<size_t> next;
+            for (size_t sheet : level) {
+                for (size_t dependent : dependents[sheet]) {
+                    if (--waiting[dependent] == 0) {
+                        next.push_back(dependent);
+                    }
+                }
+            }
+            done += level.size();
+            result.push_back(std::move(level));
+            level = std::move(next);
+        }
+        return done == sheets.size();
+    }
+
+    // the sheets read through references from the sheet being read intern
+    // strings too
+    void release_strings() {
+        for (auto& sheet : sheets) {
+            sheet->release_strings();
+        }
+    }
+
+  public:
+    CWorkbook() {}
+
+    CWorkbook(const CWorkbook&) = delete;
+    CWorkbook& operator=(const CWorkbook&) = delete;
+
+    static unsigned capabilities() {
+        return CSpreadsheet::capabilities() | SPREADSHEET_SHEETS
+            | SPREADSHEET_PARALLEL;
+    }
+
+    // names are unique, non-empty and may not contain '!'
+    bool addSheet(const std::string& name) {
+        if (name.empty() || name.find('!') != std::string::npos
+            || find(name)) {
+            return false;
+        }
+        auto sheet = std::make_unique<CSpreadsheet>();
+        sheet->workbook = &sheets;
+        sheet->revision = sheets.empty() ? 1 : sheets[0]->revision;
+        sheets.push_back(std::move(sheet));
+        names.push_back(name);
+        return true;
+    }
+
+    size_t sheetCount() const {
+        return sheets.size();
+    }
+
+    bool setCell(std::string_view sheet, CPos pos, std::string contents) {
+        auto index = find(sheet);
+        if (!index) {
+            return false;
+        }
+
+        try {
+            Cell cell(contents, [&](std::string_view name) {
+                auto other = find(name);
+                if (!other) {
+                    throw std::invalid_argument("Unknown sheet");
+                }
+                return *other == *index ? LOCAL_SHEET : (int)*other;
+            });
+            for (int other : CSpreadsheet::external_sheets(cell)) {
+                if (depends_on((size_t)other, *index)) {
+                    return false;
+                }
+            }
+            if (!sheets[*index]->set_parsed(pos, std::move(cell))) {
+                return false;
+            }
+        } catch (std::invalid_argument& e) {
+            return false;
+        }
+        edited(*sheets[*index]);
+        return true;
+    }
+
+    CValue getValue(std::string_view sheet, CPos pos) {
+        auto index = find(sheet);
+        if (!index) {
+            return UNDEFINED;
+        }
+        CValue value = sheets[*index]->getValue(pos);
+        release_strings();
+        return value;
+    }
+
+    bool getValues(
+        std::string_view sheet,
+        CPos corner,
+        int w,
+        int h,
+        CValue* out
+    ) {
+        auto index = find(sheet);
+        if (!index) {
+            return false;
+        }
+        sheets[*index]->getValues(corner, w, h, out);
+        release_strings();
+        return true;
+    }
+
+    // copies within a sheet reference the same sheets as their source, so
+    // they can't close a cycle
+    bool copyRect(
+        std::string_view sheet,
+        CPos dst,
+        CPos src,
+        int w = 1,
+        int h = 1
+    ) {
+        auto index = find(sheet);
+        if (!index) {
+            return false;
+        }
+        sheets[*index]->copy_rect(dst, src, w, h);
+        edited(*sheets[*index]);
+        return true;
+    }
+
+    bool insertRows(std::string_view sheet, int row, int count = 1) {
+        return edit_axes(sheet, [&](CSpreadsheet& s) {
+            return s.insertRows(row, count);
+        });
+    }
+
+    bool deleteRows(std::string_view sheet, int row, int count = 1) {
+        return edit_axes(sheet, [&](CSpreadsheet& s) {
+            return s.deleteRows(row, count);
+        });
+    }
+
+    bool insertColumns(std::string_view sheet, int column, int count = 1) {
+        return edit_axes(sheet, [&](CSpreadsheet& s) {
+            return s.insertColumns(column, count);
+        });
+    }
+
+    bool deleteColumns(std::string_view sheet, int column, int count = 1) {
+        return edit_axes(sheet, [&](CSpreadsheet& s) {
+            return s.deleteColumns(column, count);
+        });
+    }
+
+    // bring all cells up to date, the sheets of a level are evaluated on up
+    // to threads threads, they only read the already evaluated sheets of
+    // earlier levels
+    void recalculate(unsigned threads = std::thread::hardware_concurrency()) {
+        std::vector<std::vector<size_t>> order;
+        levels(order);
+        for (const auto& level : order) {
+            parallel_for(level.size(), threads, [&](size_t i) {
+                sheets[level[i]]->recalculate();
+            });
+        }
+    }
+
+    // layout: magic, fnv hash of the rest (i64), sheet count (i32), for every
+    // sheet its name and CSpreadsheet::save() prefixed by its length (i64)
+    bool save(std::ostream& os) const {
+        StreamWriter body;
+        body.write_i32((int32_t)sheets.size());
+        for (size_t i = 0; i < sheets.size(); i++) {
+            std::ostringstream snapshot;
+            if (!sheets[i]->save(snapshot)) {
+                return false;
+            }
+            body.write_string(names[i]);
+            body.write_i64((int64_t)snapshot.str().size());
+            body.write_bytes(snapshot.str());
+        }
+
+        FnvHasher hasher;
+        hasher.hash_bytes(body.data());
+
+        StreamWriter header;
+        header.write_i64(WORKBOOK_MAGIC);
+        header.write_i64(hasher.finish());
+        os.write(header.data().data(), (std::streamsize)header.data().size());
+        os.write(body.data().data(), (std::streamsize)body.data().size());
+        return os.good();
+    }
+
+    bool load(std::istream& is) {
+        std::string data(
+            (std::istreambuf_iterator<char>(is)),
+            std::istreambuf_iterator<char>()
+        );
+        if (is.bad()) {
+            return false;
+        }
+
+        StreamReader r(data);
+        if (r.read_i64() != WORKBOOK_MAGIC) {
+            return false;
+        }
+        int64_t saved_hash = r.read_i64();
+        FnvHasher hasher;
+        hasher.hash_bytes(std::string_view(data).substr(r.position()));
+        if (r.failed() || saved_hash != hasher.finish()) {
+            return false;
+        }
+
+        CWorkbook loaded;
+        int32_t count = r.read_i32();
+        for (int32_t i = 0; i < count && !r.failed(); i++) {
+            std::string name(r.read_string());
+            int64_t size = r.read_i64();
+            std::string_view snapshot = r.read_bytes((size_t)size);
+            if (r.failed() || !loaded.addSheet(name)
+                || !loaded.sheets.back()->load(snapshot)) {
+                return false;
+            }
+        }
+
+        std::vector<std::vector<size_t>> order;
+        if (r.failed() || !r.at_end() || !loaded.levels(order)) {
+            return false;
+        }
+
+        sheets = std::move(loaded.sheets);
+        names = std::move(loaded.names);
+        uint64_t revision = 1;
+        for (auto& sheet : sheets) {
+            sheet->workbook = &sheets;
+            revision = std::max(revision, sheet->revision);
+        }
+        for (auto& sheet : sheets) {
+            sheet->revision = revision;
+        }
+        return true;
+    }
+};
+
+// read only memory mapping of a whole file
+class MappedFile {
+    void* data = MAP_FAILED;
+    size_t size = 0;
+
+  public:
+    MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = (size_t)st.st_size;
+            data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data != MAP_FAILED) {
+            munmap(data, size);
+        }
+    }
+
+    bool valid() const {
+        return data != MAP_FAILED;
+    }
+
+    const char* bytes() const {
+        return valid() ? (const char*)data : nullptr;
+    }
+
+    size_t length() const {
+        return valid() ? size : 0;
+    }
+};
+
+// CSpreadsheet with an append-only journal of edits, stored in two files:
+//   <path>.snapshot  generation (i64) followed by CSpreadsheet::save()
+//   <path>.journal   generation (i64) followed by records of setCell and
+//                    copyRect applied after the snapshot
+//
+// records are buffered and written with a single fsync once a group of them
+// is collected or sync() is called, an edit is durable only after that
+// once the journal grows long enough it is compacted into a new snapshot
+//
+// record layout: payload length (i32), fnv hash of payload (i32), payload
+// a torn record at the end of the journal is dropped during recovery
+class JournaledSpreadsheet {
+    enum class RecordKind : int8_t {
+        SET_CELL = 1,
+        COPY_RECT = 2,
+    };
+
+    CSpreadsheet sheet;
+    std::string snapshot_path;
+    std::string journal_path;
+    int journal_fd = -1;
+    int64_t generation = 0;
+
+    // encoded records which weren't written yet
+    StreamWriter pending;
+    size_t pending_records = 0;
+    // records in the journal since the last snapshot
+    size_t journal_records = 0;
+
+  public:
+    // number of records written by one fsync
+    size_t group_commit_records = 64;
+    // number of journal records after which a new snapshot is written
+    size_t compact_records = 100'000;
+
+    JournaledSpreadsheet() {}
+
+    JournaledSpreadsheet(const JournaledSpreadsheet&) = delete;
+    JournaledSpreadsheet& operator=(const JournaledSpreadsheet&) = delete;
+
+    ~JournaledSpreadsheet() {
+        close();
+    }
+
+    const CSpreadsheet& get() const {
+        return sheet;
+    }
+
+    CValue getValue(CPos pos) {
+        return sheet.getValue(pos);
+    }
+
+    // open the journal at path, recovering the sheet from the latest snapshot
+    // and the journal tail, creates the files if they don't exist
+    bool open(const std::string& path) {
+        close();
+
+        snapshot_path = path + ".snapshot";
+        journal_path = path + ".journal";
+
+        if (!recover()) {
+            return false;
+        }
+
+        journal_fd = ::open(journal_path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (journal_fd < 0) {
+            return false;
+        }
+
+        // drop a torn tail so that new records follow the last valid one
+        off_t end = lseek(journal_fd, 0, SEEK_END);
+        if (end < (off_t)sizeof(int64_t)) {
+            return reset_journal();
+        }
+        return true;
+    }
+
+    // write the pending records, keeps the files open
+    bool sync() {
+        if (!flush()) {
+            return false;
+        }
+        if (journal_records >= compact_records) {
+            return compact();
+        }
+        return true;
+    }
+
+    void close() {
+        if (journal_fd >= 0) {
+            sync();
+            ::close(journal_fd);
+            journal_fd = -1;
+        }
+    }
+
+    // edits are applied once their records are appended, so an edit which
+    // returns false left the sheet as it was, contents which don't parse
+    // aren't journaled
+    bool setCell(CPos pos, std::string contents) {
+        std::optional<Cell> cell;
+        try {
+            cell.emplace(contents);
+        } catch (std::invalid_argument& e) {
+            return false;
+        }
+
+        StreamWriter payload;
+        payload.write_i8((int8_t)RecordKind::SET_CELL);
+        payload.write_cell_pos(pos);
+        payload.write_i64((int64_t)contents.size());
+        payload.write_bytes(contents);
+        // the axes of the sheet never change, so a parsed cell is set
+        return append(payload.data()) && sheet.set_cell(pos, std::move(*cell));
+    }
+
+    bool copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
+        StreamWriter payload;
+        payload.write_i8((int8_t)RecordKind::COPY_RECT);
+        payload.write_cell_pos(dst);
+        payload.write_cell_pos(src);
+        payload.write_i32(w);
+        payload.write_i32(h);
+        if (!append(payload.data())) {
+            return false;
+        }
+        sheet.copyRect(dst, src, w, h);
+        return true;
+    }
+
+    // write the sheet into a new snapshot and start an empty journal
+    bool compact() {
+        if (journal_fd < 0) {
+            return false;
+        }
+
+        // make sure nothing buffered gets lost if the compaction fails
+        if (!flush()) {
+            return false;
+        }
+
+        StreamWriter header;
+        header.write_i64(generation + 1);
+        std::ostringstream oss;
+        oss.write(header.data().data(), (std::streamsize)header.data().size());
+        if (!sheet.save(oss)) {
+            return false;
+        }
+
+        // the snapshot is replaced atomically, a crash before the journal is
+        // reset leaves a journal of an older generation which is ignored
+        std::string tmp_path = snapshot_path + ".tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool written = write_all(fd, oss.view()) && fsync(fd) == 0;
+        ::close(fd);
+        if (!written || rename(tmp_path.c_str(), snapshot_path.c_str()) != 0) {
+            return false;
+        }
+        sync_directory();
+
+        generation++;
+        return reset_journal();
+    }
+
+  private:
+    static bool write_all(int fd, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t written = ::write(fd, data.data(), data.size());
+            if (written < 0) {
+                return false;
+            }
+            data.remove_prefix((size_t)written);
+        }
+        return true;
+    }
+
+    static unsigned int hash_bytes(std::string_view data) {
+        FnvHasher hasher;
+        hasher.hash_bytes(data);
+        return hasher.finish();
+    }
+
+    void sync_directory() {
+        size_t slash = snapshot_path.find_last_of('/');
+        std::string dir =
+            slash == std::string::npos ? "." : snapshot_path.substr(0, slash);
+        int fd = ::open(dir.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    // queue a record, writing the queue once it is full, the record is
+    // dropped again if that fails
+    bool append(std::string_view payload) {
+        if (journal_fd < 0) {
+            return false;
+        }
+
+        size_t queued = pending.data().size();
+        pending.write_i32((int32_t)payload.size());
+        pending.write_i32((int32_t)hash_bytes(payload));
+        pending.write_bytes(payload);
+        pending_records++;
+
+        if (pending_records < group_commit_records) {
+            return true;
+        }
+        if (!flush()) {
+            pending.data().resize(queued);
+            pending_records--;
+            return false;
         }
+        // the record is durable even if the compaction fails, the journal is
+        // compacted by a later sync then
+        if (journal_records >= compact_records) {
+            compact();
+        }
+        return true;
     }
 
-    // call lambda on two number arguments, otherwise return undefined
-    CValue numeric_binary_operator(
-        const Function& function,
-        double (*fun)(double a, double b)
-    ) {
-        CValue a = evaluate_expression(function.arguments[0]);
-        CValue b = evaluate_expression(function.arguments[1]);
+    // write the pending records without compacting, a failed write is cut
+    // off the journal and the records stay pending
+    bool flush() {
+        if (journal_fd < 0) {
+            return false;
+        }
+        if (pending_records == 0) {
+            return true;
+        }
 
-        if (!std::holds_alternative<double>(a)
-            || !std::holds_alternative<double>(b)) {
-            return UNDEFINED;
+        off_t end = lseek(journal_fd, 0, SEEK_CUR);
+        if (!write_all(journal_fd, pending.data()) || fsync(journal_fd) != 0) {
+            if (end >= 0 && ftruncate(journal_fd, end) == 0) {
+                lseek(journal_fd, end, SEEK_SET);
+            }
+            return false;
         }
 
-        double a_ = std::get<double>(a);
-        double b_ = std::get<double>(b);
+        journal_records += pending_records;
+        pending.data().clear();
+        pending_records = 0;
+        return true;
+    }
 
-        return CValue(fun(a_, b_));
+    bool reset_journal() {
+        StreamWriter header;
+        header.write_i64(generation);
+
+        if (ftruncate(journal_fd, 0) != 0
+            || lseek(journal_fd, 0, SEEK_SET) != 0) {
+            return false;
+        }
+        journal_records = 0;
+        return write_all(journal_fd, header.data()) && fsync(journal_fd) == 0;
     }
 
-    CValue comparison_binary_operator(
-        const Function& function,
-        bool (*number_fun)(double a, double b),
-        bool (*string_fun)(std::string& a, std::string& b)
-    ) {
-        CValue a = evaluate_expression(function.arguments[0]);
-        CValue b = evaluate_expression(function.arguments[1]);
+    bool recover() {
+        generation = 0;
+        journal_records = 0;
+        pending.data().clear();
+        pending_records = 0;
+        sheet = CSpreadsheet();
 
-        bool compare = false;
-        if (std::holds_alternative<double>(a)
-            && std::holds_alternative<double>(b)) {
-            compare = number_fun(std::get<double>(a), std::get<double>(b));
-        } else if (std::holds_alternative<std::string>(a) && std::holds_alternative<std::string>(b)) {
-            compare =
-                string_fun(std::get<std::string>(a), std::get<std::string>(b));
-        } else {
-            return UNDEFINED;
+        {
+            MappedFile snapshot(snapshot_path);
+            if (snapshot.valid()) {
+                std::string_view data(snapshot.bytes(), snapshot.length());
+                StreamReader r(data);
+                generation = r.read_i64();
+                if (r.failed() || !sheet.load(data.substr(r.position()))) {
+                    return false;
+                }
+            }
         }
 
-        return CValue((double)compare);
-    }
+        MappedFile journal(journal_path);
+        if (!journal.valid()) {
+            return true;
+        }
 
-    CValue evaluate_expression_internal(const Expression& expr) {
-        // 0 std::monostate
-        // 1 double
-        // 2 std::string
-        // 3 CellReference
-        // 4 CellRange
-        // 5 Function
-        switch (expr.index()) {
-            case 0:
-                return UNDEFINED;
-            case 1:
-                return CValue(std::get<double>(expr));
-            case 2:
-                return CValue(std::get<std::string>(expr));
-            case 3: {
-                CellReference ref = std::get<CellReference>(expr);
-                return getValue_internal(ref.pos);
+        StreamReader r(std::string_view(journal.bytes(), journal.length()));
+        int64_t journal_generation = r.read_i64();
+        if (r.failed()) {
+            return true;
+        }
+
+        // the compaction crashed after writing the snapshot
+        if (journal_generation != generation) {
+            return truncate_journal(0);
+        }
+
+        size_t valid = r.position();
+        while (!r.at_end()) {
+            int32_t size = r.read_i32();
+            int32_t hash = r.read_i32();
+            std::string_view payload = r.read_bytes((size_t)std::max(size, 0));
+            if (r.failed() || size < 0 || (int32_t)hash_bytes(payload) != hash
+                || !replay(payload)) {
+                break;
             }
-            case 4:
-                throw std::invalid_argument("Unexpected cell range");
-            case 5: {
-                const Function& fun = std::get<Function>(expr);
-                switch (fun.kind) {
-                    case FunctionKind::SUM: {
-                        CellRange range = std::get<CellRange>(fun.arguments[0]);
-                        return fold_range(
-                            range,
-                            0.0,
-                            [](double* acc, double in) { *acc += in; }
-                        );
-                    }
-                    case FunctionKind::COUNT: {
-                        CellRange range = std::get<CellRange>(fun.arguments[0]);
-                        int count = 0;
-                        range.for_cells([&](CPos pos) {
-                            const CValue& value = getValue_internal(pos);
-                            if (value != UNDEFINED) {
-                                count++;
-                            }
-                        });
-                        return CValue((double)count);
-                    }
-                    case FunctionKind::COUNT_VAL: {
-                        CValue val = evaluate_expression(fun.arguments[0]);
-                        CellRange range = std::get<CellRange>(fun.arguments[1]);
 
-                        unsigned count = 0;
-                        range.for_cells([&](CPos pos) {
-                            const CValue& value = getValue_internal(pos);
-                            if (val == value) {
-                                count++;
-                            }
-                        });
-                        return CValue((double)count);
-                    }
-                    case FunctionKind::IF: {
-                        CValue cond = evaluate_expression(fun.arguments[0]);
-                        if (std::get<double>(cond) != 0.0) {
-                            return evaluate_expression(fun.arguments[1]);
-                        } else {
-                            return evaluate_expression(fun.arguments[2]);
-                        }
-                    }
-                    case FunctionKind::MIN: {
-                        CellRange range = std::get<CellRange>(fun.arguments[0]);
-                        return fold_range(
-                            range,
-                            std::numeric_limits<double>::infinity(),
-                            [](double* acc, double in) {
-                                *acc = std::min(*acc, in);
-                            }
-                        );
-                    }
-                    case FunctionKind::MAX: {
-                        CellRange range = std::get<CellRange>(fun.arguments[0]);
-                        return fold_range(
-                            range,
-                            -std::numeric_limits<double>::infinity(),
-                            [](double* acc, double in) {
-                                *acc = std::max(*acc, in);
-                            }
-                        );
-                    }
-                    case FunctionKind::NEG: {
-                        CValue val = evaluate_expression(fun.arguments[0]);
-                        return CValue(-std::get<double>(val));
-                    }
-                    case FunctionKind::POW: {
-                        return numeric_binary_operator(
-                            fun,
-                            [](double a, double b) { return std::pow(a, b); }
-                        );
-                    }
-                    case FunctionKind::MUL: {
-                        return numeric_binary_operator(
-                            fun,
-                            [](double a, double b) { return a * b; }
-                        );
-                    }
-                    case FunctionKind::DIV: {
-                        return numeric_binary_operator(
-                            fun,
-                            [](double a, double b) {
-                                if (fabs(b) == 0.0) {
-                                    throw std::invalid_argument("Divide by zero"
-                                    );
-                                }
-                                return a / b;
-                            }
-                        );
-                    }
-                    case FunctionKind::ADD: {
-                        CValue a = evaluate_expression(fun.arguments[0]);
-                        CValue b = evaluate_expression(fun.arguments[1]);
-
-                        if (std::holds_alternative<std::string>(a)
-                            || std::holds_alternative<std::string>(b)) {
-                            std::string buf;
-
-                            if (std::holds_alternative<std::string>(a)) {
-                                buf = std::get<std::string>(std::move(a));
-                            } else if (std::holds_alternative<double>(a)) {
-                                buf = std::to_string(std::get<double>(a));
-                            } else {
-                                return UNDEFINED;
-                            }
+            valid = r.position();
+            journal_records++;
+        }
 
-                            if (std::holds_alternative<std::string>(b)) {
-                                buf += std::get<std::string>(b);
-                            } else if (std::holds_alternative<double>(b)) {
-                                buf += std::to_string(std::get<double>(b));
-                            } else {
-                                return UNDEFINED;
-                            }
+        if (valid != journal.length()) {
+            return truncate_journal(valid);
+        }
+        return true;
+    }
 
-                            return CValue(buf);
-                        }
+    bool truncate_journal(size_t size) {
+        if (truncate(journal_path.c_str(), (off_t)size) != 0) {
+            return false;
+        }
+        if (size == 0) {
+            journal_records = 0;
+        }
+        return true;
+    }
 
-                        double a_ = std::get<double>(a);
-                        double b_ = std::get<double>(b);
+    bool replay(std::string_view payload) {
+        StreamReader r(payload);
 
-                        return CValue(a_ + b_);
-                    }
-                    case FunctionKind::SUB: {
-                        return numeric_binary_operator(
-                            fun,
-                            [](double a, double b) { return a - b; }
-                        );
-                    }
-                    case FunctionKind::LT: {
-                        return comparison_binary_operator(
-                            fun,
-                            [](double a, double b) { return a < b; },
-                            [](std::string& a, std::string& b) { return a < b; }
-                        );
-                    }
-                    case FunctionKind::LE: {
-                        return comparison_binary_operator(
-                            fun,
-                            [](double a, double b) { return a <= b; },
-                            [](std::string& a, std::string& b) {
-                                return a <= b;
-                            }
-                        );
-                    }
-                    case FunctionKind::GT: {
-                        return comparison_binary_operator(
-                            fun,
-                            [](double a, double b) { return a > b; },
-                            [](std::string& a, std::string& b) { return a > b; }
-                        );
-                    }
-                    case FunctionKind::GE: {
-                        return comparison_binary_operator(
-                            fun,
-                            [](double a, double b) { return a >= b; },
-                            [](std::string& a, std::string& b) {
-                                return a >= b;
-                            }
-                        );
-                    }
-                    case FunctionKind::NE: {
-                        return comparison_binary_operator(
-                            fun,
-                            [](double a, double b) { return a != b; },
-                            [](std::string& a, std::string& b) {
-                                return a != b;
-                            }
-                        );
-                    }
-                    case FunctionKind::EQ: {
-                        return comparison_binary_operator(
-                            fun,
-                            [](double a, double b) { return a == b; },
-                            [](std::string& a, std::string& b) {
-                                return a == b;
-                            }
-                        );
-                    }
-                    default:
-                        break;
+        switch ((RecordKind)r.read_i8()) {
+            case RecordKind::SET_CELL: {
+                CPos pos = r.read_cell_pos();
+                int64_t size = r.read_i64();
+                if (r.failed() || size < 0) {
+                    return false;
                 }
+                std::string_view contents = r.read_bytes((size_t)size);
+                return !r.failed() && sheet.setCell(pos, std::string(contents));
+            }
+            case RecordKind::COPY_RECT: {
+                CPos dst = r.read_cell_pos();
+                CPos src = r.read_cell_pos();
+                int w = r.read_i32();
+                int h = r.read_i32();
+                if (r.failed() || w < 0 || h < 0) {
+                    return false;
+                }
+                sheet.copyRect(dst, src, w, h);
+                return true;
             }
             default:
-                break;
+                return false;
         }
-        assert(0 && "Unhandled variant");
-        return UNDEFINED;
     }
+};
 
-    CValue evaluate_expression(const Expression& expr) {
-        try {
-            return evaluate_expression_internal(expr);
-        } catch (...) {
-            return UNDEFINED;
+// a sheet edited by one thread while other threads read consistent versions
+// of it, a reader pins the version current at that moment and keeps seeing
+// it however the head changes
+//
+// a version maps chunks of logical positions to the contents and values of
+// their cells, it is published by the first pin after an edit and shared by
+// every pin until the next edit, the chunks no edit reached since the
+// previous version are shared with it, the cells edited since and the cells
+// depending on them are evaluated in the head and copied into new chunks,
+// versions are never changed, so their readers don't wait for each other
+//
+// readers announce the epoch they pinned at and a replaced version is freed
+// once every reader announces a later epoch or none
+class VersionedSpreadsheet {
+    struct VersionCell {
+        // references at logical positions, shared by the versions in which
+        // the cell wasn't edited
+        std::shared_ptr<const Cell> cell;
+        CValue value;
+    };
+
+    using VersionChunk = std::map<CPos, VersionCell>;
+
+    struct Version {
+        // number of edits of the head the version includes
+        uint64_t epoch;
+        std::map<ChunkKey, std::shared_ptr<const VersionChunk>> chunks;
+
+        const VersionCell* find(CPos pos) const {
+            auto chunk = chunks.find(CSpreadsheet::chunk_of(pos));
+            if (chunk == chunks.end()) {
+                return nullptr;
+            }
+            auto entry = chunk->second->find(pos);
+            return entry == chunk->second->end() ? nullptr : &entry->second;
         }
-    }
+    };
 
-    // getValue but returns a reference
-    const CValue& getValue_internal(CPos pos) {
-        static const CValue STATIC_UNDEFINED = CValue {};
+    // no reader in the slot
+    static constexpr uint64_t IDLE = 0;
 
-        Cell* cell = get_cell(pos);
-        if (!cell) {
-            return STATIC_UNDEFINED;
+    // guards head, versions and retired
+    std::mutex head_lock;
+    CSpreadsheet head;
+    // number of edits of the head, epoch 0 is reserved for idle slots
+    std::atomic<uint64_t> epoch = 1;
+
+    // the newest version, readers load it without taking head_lock
+    std::atomic<Version*> latest = nullptr;
+    std::unique_ptr<Version> latest_owner;
+    // replaced versions with the epoch they were replaced at
+    std::vector<std::pair<uint64_t, std::unique_ptr<Version>>> retired;
+
+    // epochs announced by the readers
+    std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    size_t slot_count;
+
+  public:
+    // a pinned version, unpinned when destroyed
+    class Snapshot {
+        VersionedSpreadsheet* owner = nullptr;
+        size_t slot = 0;
+        const Version* version = nullptr;
+
+        Snapshot(
+            VersionedSpreadsheet* owner,
+            size_t slot,
+            const Version* version
+        ):
+            owner(owner), slot(slot), version(version) {}
+
+        friend class VersionedSpreadsheet;
+
+      public:
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        Snapshot(Snapshot&& other):
+            owner(std::exchange(other.owner, nullptr)),
+            slot(other.slot),
+            version(other.version) {}
+
+        ~Snapshot() {
+            if (owner) {
+                owner->slots[slot].store(IDLE);
+            }
+        }
+
+        uint64_t epoch() const {
+            return version->epoch;
         }
 
-        if (cell->dirty) {
-            auto previous = call_stack.insert(pos);
+        CValue getValue(CPos pos) const {
+            const VersionCell* entry = version->find(pos);
+            return entry ? entry->value : CValue();
+        }
+
+        void getValues(CPos corner, int w, int h, CValue* out) const {
+            assert(w >= 0);
+            assert(h >= 0);
+            for (int x = 0; x < w; x++) {
+                for (int y = 0; y < h; y++) {
+                    out[(size_t)x * h + y] =
+                        getValue(CPos(corner.x + x, corner.y + y));
+                }
+            }
+        }
 
-            if (!previous.second) {
-                return STATIC_UNDEFINED;
+        // saved as CSpreadsheet::save saves the head as of the version
+        bool save(std::ostream& os) const {
+            CSpreadsheet sheet;
+            for (const auto& [key, chunk] : version->chunks) {
+                for (const auto& [pos, entry] : *chunk) {
+                    sheet.setCell_internal(pos, *entry.cell);
+                }
             }
+            return sheet.save(os);
+        }
+    };
+
+    // at most readers snapshots can be pinned at once
+    explicit VersionedSpreadsheet(size_t readers = 64):
+        slots(new std::atomic<uint64_t>[readers]), slot_count(readers) {
+        for (size_t i = 0; i < slot_count; i++) {
+            slots[i].store(IDLE);
+        }
+    }
 
-            cell->cached_value = evaluate_expression(cell->expression);
-            cell->dirty = false;
+    VersionedSpreadsheet(const VersionedSpreadsheet&) = delete;
+    VersionedSpreadsheet& operator=(const VersionedSpreadsheet&) = delete;
 
-            call_stack.erase(pos);
+    // run fun on the head, readers pinned before don't see the changes
+    template<typename F>
+    auto edit(F fun) {
+        std::lock_guard guard(head_lock);
+        epoch++;
+        if (!retired.empty()) {
+            free_retired();
         }
+        return fun(head);
+    }
 
-        return cell->cached_value;
+    bool setCell(CPos pos, std::string contents) {
+        return edit([&](CSpreadsheet& sheet) {
+            return sheet.setCell(pos, std::move(contents));
+        });
+    }
+
+    void copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
+        edit([&](CSpreadsheet& sheet) { sheet.copyRect(dst, src, w, h); });
     }
 
+    // value in the head
     CValue getValue(CPos pos) {
-        assert(call_stack.empty());
-        return getValue_internal(pos);
+        std::lock_guard guard(head_lock);
+        return head.getValue(pos);
     }
 
-    void copyCell(CPos src, CPos dst) {
-        if (dst == src) {
-            return;
+    // pin the current version of the head, empty if all reader slots are
+    // taken
+    std::optional<Snapshot> pin() {
+        size_t slot = 0;
+        while (true) {
+            if (slot == slot_count) {
+                return std::nullopt;
+            }
+            uint64_t idle = IDLE;
+            // the epoch is announced before latest is read, a version
+            // replaced after that is kept until the slot is released
+            if (slots[slot].compare_exchange_strong(idle, epoch.load())) {
+                break;
+            }
+            slot++;
         }
 
-        auto entry = cells.find(src);
-        if (entry == cells.end()) {
-            cells.erase(dst);
-        } else {
-            Cell copy = entry->second;
-            auto offset = CPos::make_relative_offset(src, dst);
-            copy.apply_offset(offset);
-
-            setCell_internal(dst, std::move(copy));
+        Version* version = latest.load();
+        if (!version || version->epoch != epoch.load()) {
+            version = publish();
         }
+        return Snapshot(this, slot, version);
     }
 
-    void copyRect(CPos dst, CPos src, int w = 1, int h = 1) {
-        assert(w >= 0);
-        assert(h >= 0);
+    // number of versions kept for readers, the latest one included
+    size_t versions() {
+        std::lock_guard guard(head_lock);
+        return retired.size() + (latest_owner ? 1 : 0);
+    }
 
-        if (src == dst || w == 0 || h == 0) {
-            return;
+    // number of chunks of the latest version it shares with the one before,
+    // 0 if there is none
+    size_t sharedChunks() {
+        std::lock_guard guard(head_lock);
+        if (!latest_owner || retired.empty()) {
+            return 0;
+        }
+        const Version& previous = *retired.back().second;
+        size_t shared = 0;
+        for (const auto& [key, chunk] : latest_owner->chunks) {
+            auto entry = previous.chunks.find(key);
+            shared += entry != previous.chunks.end() && entry->second == chunk;
         }
+        return shared;
+    }
 
-        int x_start = src.x;
-        int x_end = src.x + w - 1;  // end inclusive
-        int x_d = 1;
+    // free the replaced versions no reader can hold, done by edits and pins
+    // as well
+    void collect() {
+        std::lock_guard guard(head_lock);
+        free_retired();
+    }
 
-        // the copy ranges may overlap so we need to reverse the copy direction
-        if (dst.x > src.x) {
-            std::swap(x_start, x_end);
-            x_d = -1;
+  private:
+    void free_retired() {
+        uint64_t oldest = UINT64_MAX;
+        for (size_t i = 0; i < slot_count; i++) {
+            uint64_t announced = slots[i].load();
+            if (announced != IDLE) {
+                oldest = std::min(oldest, announced);
+            }
         }
+        std::erase_if(retired, [&](const auto& entry) {
+            return entry.first < oldest;
+        });
+    }
 
-        int y_start = src.y;
-        int y_end = src.y + h - 1;
-        int y_d = 1;
+    // contents and value of the cell at logical in the head, previous is its
+    // entry in the version before if the cell wasn't edited since
+    VersionCell version_cell(
+        CPos logical,
+        const Cell& cell,
+        const VersionCell* previous
+    ) {
+        VersionCell entry {
+            previous ? previous->cell : nullptr,
+            head.getValue(logical)
+        };
+        if (!entry.cell) {
+            entry.cell = std::make_shared<const Cell>(head.logical_cell(cell));
+        }
+        return entry;
+    }
 
-        if (dst.y > src.y) {
-            std::swap(y_start, y_end);
-            y_d = -1;
+    // evaluate every cell of the head into version
+    void publish_all(Version& version) {
+        std::map<ChunkKey, std::shared_ptr<VersionChunk>> chunks;
+        for (const auto& [pos, cell] : head.cells) {
+            auto logical = head.to_logical(pos);
+            if (!logical) {
+                continue;
+            }
+            auto& chunk = chunks[CSpreadsheet::chunk_of(*logical)];
+            if (!chunk) {
+                chunk = std::make_shared<VersionChunk>();
+            }
+            chunk->emplace(*logical, version_cell(*logical, cell, nullptr));
         }
+        version.chunks.insert(chunks.begin(), chunks.end());
+    }
 
-        auto offset = CPos::make_relative_offset(src, dst);
+    // bring the chunks of version, shared with the previous version, up to
+    // date with the cells edited since, given by their physical positions,
+    // and the cells depending on them
+    void publish_edits(Version& version, std::vector<CPos> edits) {
+        std::set<CPos> edited(edits.begin(), edits.end());
+        std::map<ChunkKey, VersionChunk*> copied;
+        for (CPos pos : head.with_dependents(std::move(edits))) {
+            // the edits kept don't change the axes, only cells of deleted
+            // rows and columns have no logical position
+            auto logical_pos = head.to_logical(pos);
+            if (!logical_pos) {
+                continue;
+            }
+            CPos logical = *logical_pos;
+            ChunkKey key = CSpreadsheet::chunk_of(logical);
+            VersionChunk*& chunk = copied[key];
+            if (!chunk) {
+                auto& shared = version.chunks[key];
+                auto copy = shared ? std::make_shared<VersionChunk>(*shared)
+                                   : std::make_shared<VersionChunk>();
+                chunk = copy.get();
+                shared = std::move(copy);
+            }
 
-        for (int y = y_start;; y += y_d) {
-            for (int x = x_start;; x += x_d) {
-                CPos src_(x, y);
-                CPos dst_ = src_ + offset;
-                copyCell(src_, dst_);
-                if (x == x_end) {
-                    break;
-                }
+            const Cell* cell = head.get_cell(pos);
+            if (!cell) {
+                chunk->erase(logical);
+                continue;
             }
-            if (y == y_end) {
-                break;
+            auto entry = chunk->find(logical);
+            const VersionCell* previous =
+                entry != chunk->end() && !edited.count(pos) ? &entry->second
+                                                            : nullptr;
+            (*chunk)[logical] = version_cell(logical, *cell, previous);
+        }
+        for (const auto& [key, chunk] : copied) {
+            if (chunk->empty()) {
+                version.chunks.erase(key);
             }
         }
     }
+
+    // publish the current version of the head as the latest one, unless
+    // another reader did
+    Version* publish() {
+        std::lock_guard guard(head_lock);
+        Version* current = latest.load();
+        if (current && current->epoch == epoch.load()) {
+            return current;
+        }
+
+        auto version = std::make_unique<Version>();
+        version->epoch = epoch.load();
+        auto edits = std::exchange(
+            head.version_edits.edits,
+            std::vector<CPos>()
+        );
+        if (current && edits) {
+            version->chunks = current->chunks;
+            publish_edits(*version, std::move(*edits));
+        } else {
+            publish_all(*version);
+        }
+
+        latest.store(version.get());
+        if (latest_owner) {
+            retired.push_back({epoch.load(), std::move(latest_owner)});
+        }
+        latest_owner = std::move(version);
+        free_retired();
+        return latest_owner.get();
+    }
 };